@@ -36,6 +36,13 @@ public:
     AlphabetStatisticsProducer(AlphabetStatisticsProducer<Letter>&& other) :
         name(other.name), n_counts(other.n_counts), letter_frequencies(other.letter_frequencies) {}
 
+    AlphabetStatisticsProducer(const std::string& _name, const LetterFrequencyMap& frequencies) :
+        name(_name), n_counts(0), letter_frequencies(frequencies)
+    {
+        for(const auto& entry : letter_frequencies)
+            n_counts += entry.second;
+    }
+
     template<typename LetterCollection>
     AlphabetStatisticsProducer(const std::string& _name, const LetterCollection* alphabet) :
         AlphabetStatisticsProducer(_name)
@@ -47,8 +54,18 @@ public:
     }
 
     bool IntegerLimitIsReached() const { return n_counts == std::numeric_limits<Integer>::max(); }
+
+    LetterFrequencyMap GetLetterFrequencies() const
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        return letter_frequencies;
+    }
     const std::string& GetName() const { return name; }
-    size_t GetNumberOfLetters() const { return letter_frequencies.size(); }
+    size_t GetNumberOfLetters() const
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        return letter_frequencies.size();
+    }
 
     void AddCount(const Letter& letter)
     {
@@ -58,6 +75,19 @@ public:
         ++n_counts;
     }
 
+    /// Equivalent to calling AddCount frequency times for each letter.
+    void AddCounts(const LetterFrequencyMap& frequencies)
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        for(const auto& entry : frequencies) {
+            if(IntegerLimitIsReached()) return;
+            if(!entry.second) continue;
+            const Integer n = std::min(entry.second, std::numeric_limits<Integer>::max() - n_counts);
+            letter_frequencies[entry.first] += n;
+            n_counts += n;
+        }
+    }
+
     StatisticsPtr Produce()
     {
         std::unique_lock<std::mutex> lock(mutex);
@@ -127,7 +157,7 @@ private:
     }
 
 private:
-    std::mutex mutex;
+    mutable std::mutex mutex;
     std::string name;
     Integer n_counts;
     LetterFrequencyMap letter_frequencies;
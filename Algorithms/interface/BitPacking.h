@@ -0,0 +1,55 @@
+/*! Vectorised kernels used by the bulk read and write operations of the Package.
+The package stores the fields with the most significant bit first, while the bulk kernels pack the values starting
+from the least significant bit. The conversion between them is a bit reversal of each value, which is done with AVX2 or
+SSSE3 instructions, if they are supported by the CPU, or with a scalar fallback otherwise. The instruction set is
+selected at runtime.
+This file is part of https://github.com/kandrosov/OnChipDataCompression. */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+namespace pixel_studies {
+namespace bit_packing {
+
+enum class InstructionSet { Scalar, SSSE3, AVX2 };
+
+/// Returns the best instruction set supported by the CPU.
+InstructionSet GetSupportedInstructionSet();
+const std::string& InstructionSetName(InstructionSet instruction_set);
+
+/// Reverses the order of the lowest number_of_bits bits of each value. Higher bits should be zero.
+void ReverseBits(uint64_t* values, size_t n_values, size_t number_of_bits);
+void ReverseBits(uint64_t* values, size_t n_values, size_t number_of_bits, InstructionSet instruction_set);
+
+inline uint64_t ReverseBits(uint64_t value, size_t number_of_bits)
+{
+    if(!number_of_bits) return 0;
+    value = ((value >> 1) & 0x5555555555555555ULL) | ((value & 0x5555555555555555ULL) << 1);
+    value = ((value >> 2) & 0x3333333333333333ULL) | ((value & 0x3333333333333333ULL) << 2);
+    value = ((value >> 4) & 0x0F0F0F0F0F0F0F0FULL) | ((value & 0x0F0F0F0F0F0F0F0FULL) << 4);
+    return __builtin_bswap64(value) >> (64 - number_of_bits);
+}
+
+/// Appends n_values values of number_of_bits bits to the byte buffer, starting from the bit position bit_position,
+/// the least significant bit first. The buffer should be large enough and the bits after bit_position should be zero.
+void PackLsbFirst(const uint64_t* values, size_t n_values, size_t number_of_bits, uint8_t* buffer,
+                  size_t bit_position);
+
+/// Extracts n_values values of number_of_bits bits packed by PackLsbFirst starting from the bit position bit_position.
+/// The buffer should contain at least ceil((bit_position + n_values * number_of_bits) / 8) bytes.
+void UnpackLsbFirst(const uint8_t* buffer, size_t buffer_size, size_t bit_position, size_t number_of_bits,
+                    uint64_t* values, size_t n_values);
+
+/// Extracts n_values values of number_of_bits bits, starting from the value first_value, from the words where the
+/// values are stored the least significant bit first. The number of bits should be 1, 2, 4, 8 or 16, so the values do
+/// not cross the word boundaries. The common cases of 4 and 8 bits are vectorised.
+void UnpackUInt16(const uint64_t* words, size_t first_value, size_t n_values, size_t number_of_bits,
+                  uint16_t* values);
+void UnpackUInt16(const uint64_t* words, size_t first_value, size_t n_values, size_t number_of_bits,
+                  uint16_t* values, InstructionSet instruction_set);
+
+} // namespace bit_packing
+} // namespace pixel_studies
@@ -18,13 +18,22 @@ public:
     using StatisticsPtr = StatisticsSource::StatisticsPtr;
     using Encoder = typename Decoder::Encoder;
     using Coordinate = Pixel::Coordinate;
+    using LookupTable = typename Decoder::template LookupTable<Statistics>;
+    using LookupTablePtr = std::shared_ptr<const LookupTable>;
 
     BlockPackageMaker(const StatisticsSource* source, const RegionLayout& _readout_unit_layout, size_t _n_bits_per_adc,
                       bool encode_adc) :
         PackageMaker(_n_bits_per_adc), readout_unit_layout(_readout_unit_layout)
     {
-        if(encode_adc)
+        if(encode_adc) {
             adc_stat = source->at(AlphabetType::Adc);
+            // Most pixels of a block are inactive and their ADC code is short, so the ADCs of a block are decoded
+            // several per lookup.
+            const size_t max_letters_per_lookup = std::min(readout_unit_layout.GetNumberOfPixels(),
+                                                           size_t(LookupTable::MaxLettersPerLookup));
+            adc_table = std::make_shared<LookupTable>(*adc_stat, LookupTable::DefaultMaxLookupBits,
+                                                      max_letters_per_lookup);
+        }
     }
 
     static std::string MakerName(bool encode_adc)
@@ -47,58 +56,54 @@ public:
 
     virtual Package Make(const Chip& chip) const override
     {
-        using RegionVector = std::list<std::pair<size_t, PixelRegion>>;
-        using MacroRegionDescriptor = std::pair<size_t, RegionVector>;
-        using MacroRegionCollection = std::list<MacroRegionDescriptor>;
-
         const auto& multi_layout = chip.GetMultiRegionLayout();
         const size_t n_macro_regions = multi_layout.GetNumberOfRegions();
-        size_t n_regions = 0;
-        MacroRegionCollection region_pixels;
-
-        for(size_t macro_region_id = 0; macro_region_id < n_macro_regions; ++macro_region_id) {
-            if(!chip.IsRegionActive(macro_region_id)) continue;
-            const PixelMultiRegion pixel_area(chip.GetRegion(macro_region_id), readout_unit_layout);
-            n_regions = pixel_area.GetMultiRegionLayout().GetNumberOfRegions();
-            MacroRegionDescriptor active_regions;
-            active_regions.first = macro_region_id;
-            for(size_t region_id = 0; region_id < n_regions; ++region_id) {
-                if(!pixel_area.IsRegionActive(region_id)) continue;
-                const PixelRegion& region = pixel_area.GetRegion(region_id);
-                active_regions.second.push_back(std::make_pair(region_id, region));
-            }
-            if(active_regions.second.size())
-                region_pixels.push_back(active_regions);
-        }
+        const MultiRegionLayout layout(multi_layout.region_layout.n_rows, multi_layout.region_layout.n_columns,
+                                       readout_unit_layout);
+        const size_t n_regions = layout.GetNumberOfRegions();
+        const BlockSchedule schedule = ScheduleBlocks(chip, layout);
 
         const size_t n_bits_per_address = RegionLayout::BitsPerValue(n_regions * n_macro_regions);
+        const size_t n_bits_per_block_adc = readout_unit_layout.GetNumberOfPixels() * n_bits_per_adc;
+        const bool write_in_bulk = UseBulkRawBlocks(n_bits_per_address);
+        std::vector<Package::Integer> blocks;
+        std::vector<Adc> block_adcs(readout_unit_layout.GetNumberOfPixels());
 
+        // Each round writes the next block of every macro region that still has blocks.
+        std::vector<BlockRange> active_ranges = schedule.macro_regions;
         Package package;
-        while(region_pixels.size()) {
-            for(auto macro_region_iter = region_pixels.begin(); macro_region_iter != region_pixels.end();) {
-                const size_t macro_region_id = macro_region_iter->first;
-                auto region_iter = macro_region_iter->second.begin();
-                const size_t region_id = region_iter->first;
-                const PixelRegion& region = region_iter->second;
-
-                const size_t full_region_id = GetFullRegionId(macro_region_id, region_id, n_macro_regions);
-                package.write(full_region_id, n_bits_per_address);
+        while(active_ranges.size()) {
+            size_t n_active = 0;
+            for(size_t n = 0; n < active_ranges.size(); ++n) {
+                BlockRange& range = active_ranges[n];
+                const BlockDescriptor& block = schedule.blocks[range.first];
+                std::fill(block_adcs.begin(), block_adcs.end(), 0);
+                for(size_t hit_id = block.offset; hit_id < schedule.blocks[range.first + 1].offset; ++hit_id)
+                    block_adcs[schedule.hits[hit_id].pixel_index] = schedule.hits[hit_id].adc;
 
-                for(size_t row = 0; row < readout_unit_layout.n_rows; ++row) {
-                    for(size_t column = 0; column < readout_unit_layout.n_columns; ++column) {
-                        const Adc adc = region.GetAdc(row, column);
+                if(write_in_bulk) {
+                    Package::Integer block_item = block.full_region_id;
+                    for(Adc adc : block_adcs)
+                        block_item = Package::AppendField(block_item, adc, n_bits_per_adc);
+                    blocks.push_back(block_item);
+                } else {
+                    package.write(block.full_region_id, n_bits_per_address, FieldCategory::RegionId);
+                    for(Adc adc : block_adcs) {
                         if(adc_stat)
-                            Encoder::EncodeLetter(*adc_stat, adc, package);
+                            Encoder::EncodeLetter(*adc_stat, adc, package, FieldCategory::Adc);
                         else
-                            package.write(adc, n_bits_per_adc);
+                            package.write(adc, n_bits_per_adc, FieldCategory::Adc);
                     }
                 }
 
-                macro_region_iter->second.erase(region_iter);
-                auto prev_iter = macro_region_iter;
-                ++macro_region_iter;
-                if(!prev_iter->second.size())
-                    region_pixels.erase(prev_iter);
+                if(++range.first != range.second)
+                    active_ranges[n_active++] = range;
+            }
+            active_ranges.resize(n_active);
+            if(write_in_bulk) {
+                package.write_bulk(blocks.data(), blocks.size(), { { n_bits_per_address, FieldCategory::RegionId },
+                                                                   { n_bits_per_block_adc, FieldCategory::Adc } });
+                blocks.clear();
             }
             package.next_readout_cicle();
         }
@@ -109,36 +114,167 @@ public:
     virtual Chip Read(const Package &package, const MultiRegionLayout& multi_layout) const override
     {
         Chip chip(multi_layout);
+        ChipDecodingOutput output{ chip };
+        ReadBlocks(package, multi_layout, output);
+        return chip;
+    }
+
+    /// The ADC values are still decoded, because the inactive pixels of the blocks are stored with zero ADC.
+    virtual PixelVector ReadAddresses(const Package& package, const MultiRegionLayout& multi_layout) const override
+    {
+        PixelVector pixels;
+        AddressDecodingOutput output{ pixels };
+        ReadBlocks(package, multi_layout, output);
+        return pixels;
+    }
+
+    virtual AdcVector ReadAdcs(const Package& package, const MultiRegionLayout& multi_layout) const override
+    {
+        AdcVector adcs;
+        AdcDecodingOutput output{ adcs };
+        ReadBlocks(package, multi_layout, output);
+        return adcs;
+    }
+
+private:
+    /// Hit of a readout unit: the readout unit id inside the macro region and the pixel index inside the readout unit.
+    struct BlockHit {
+        size_t region_id, pixel_index;
+        Adc adc;
+    };
+
+    /// Block of the hits [offset, offset of the next block) in the hit store.
+    struct BlockDescriptor {
+        size_t full_region_id, offset;
+    };
+
+    /// Range [first, second) of the blocks of a macro region.
+    using BlockRange = std::pair<size_t, size_t>;
+
+    /// Blocks of all active macro regions ordered by the macro region and the readout unit id. The block list ends
+    /// with a sentinel, so the hits of each block are delimited by the offset of the next one.
+    struct BlockSchedule {
+        std::vector<BlockHit> hits;
+        std::vector<BlockDescriptor> blocks;
+        std::vector<BlockRange> macro_regions;
+    };
+
+    BlockSchedule ScheduleBlocks(const Chip& chip, const MultiRegionLayout& layout) const
+    {
+        const size_t n_macro_regions = chip.GetMultiRegionLayout().GetNumberOfRegions();
+        BlockSchedule schedule;
+        schedule.hits.reserve(chip.GetPixels().size());
+        schedule.blocks.reserve(chip.GetPixels().size() + 1);
+        for(size_t macro_region_id = 0; macro_region_id < n_macro_regions; ++macro_region_id) {
+            if(!chip.IsRegionActive(macro_region_id)) continue;
+            const size_t first_hit = schedule.hits.size();
+            for(const auto& pixel_with_adc : chip.GetRegion(macro_region_id).GetPixels()) {
+                BlockHit hit;
+                Pixel region_pixel;
+                layout.ConvertToRegionPixel(pixel_with_adc.first, hit.region_id, region_pixel);
+                hit.pixel_index = region_pixel.row * readout_unit_layout.n_columns + region_pixel.column;
+                hit.adc = pixel_with_adc.second;
+                schedule.hits.push_back(hit);
+            }
+            std::sort(schedule.hits.begin() + first_hit, schedule.hits.end(),
+                      [](const BlockHit& first, const BlockHit& second) {
+                          return first.region_id == second.region_id ? first.pixel_index < second.pixel_index
+                                                                     : first.region_id < second.region_id;
+                      });
+
+            const size_t first_block = schedule.blocks.size();
+            for(size_t hit_id = first_hit; hit_id < schedule.hits.size(); ++hit_id) {
+                const size_t region_id = schedule.hits[hit_id].region_id;
+                if(hit_id == first_hit || region_id != schedule.hits[hit_id - 1].region_id)
+                    schedule.blocks.push_back({ GetFullRegionId(macro_region_id, region_id, n_macro_regions), hit_id });
+            }
+            schedule.macro_regions.emplace_back(first_block, schedule.blocks.size());
+        }
+        schedule.blocks.push_back({ 0, schedule.hits.size() });
+        return schedule;
+    }
+
+    template<typename Output>
+    void ReadBlocks(const Package &package, const MultiRegionLayout& multi_layout, Output& output) const
+    {
         const size_t n_macro_regions = multi_layout.GetNumberOfRegions();
         const MultiRegionLayout layout(multi_layout.region_layout.n_rows, multi_layout.region_layout.n_columns,
                                        readout_unit_layout);
         const size_t n_regions = layout.GetNumberOfRegions();
         const size_t n_bits_per_address = RegionLayout::BitsPerValue(n_regions * n_macro_regions);
 
+        if(UseBulkRawBlocks(n_bits_per_address)) {
+            const size_t n_pixels = readout_unit_layout.GetNumberOfPixels();
+            const size_t n_bits_per_block_adc = n_pixels * n_bits_per_adc;
+            const size_t n_bits_per_block = n_bits_per_address + n_bits_per_block_adc;
+            if(package.size() % n_bits_per_block)
+                throw exception("Package size = %1% is not a multiple of the block size = %2%.")
+                    % package.size() % n_bits_per_block;
+            std::vector<Package::Integer> blocks(package.size() / n_bits_per_block);
+            Package::iterator iter = package.begin();
+            iter.read_bulk(blocks.data(), blocks.size(), n_bits_per_block);
+            const Package::Integer adc_mask = Package::Mask(n_bits_per_adc);
+            for(Package::Integer block : blocks) {
+                const size_t full_region_id = block >> n_bits_per_block_adc;
+                size_t macro_region_id, region_id;
+                SplitFullRegionId(full_region_id, n_macro_regions, macro_region_id, region_id);
+                size_t adc_shift = n_bits_per_block_adc;
+                for(size_t row = 0; row < readout_unit_layout.n_rows; ++row) {
+                    for(size_t column = 0; column < readout_unit_layout.n_columns; ++column) {
+                        adc_shift -= n_bits_per_adc;
+                        const Adc adc = (block >> adc_shift) & adc_mask;
+                        AddPixel(output, multi_layout, layout, macro_region_id, region_id, row, column, adc);
+                    }
+                }
+            }
+            return;
+        }
+
+        std::vector<Letter> block_adcs(readout_unit_layout.GetNumberOfPixels());
         for(Package::iterator iter = package.begin(); iter != package.end();) {
             const size_t full_region_id = iter.read(n_bits_per_address);
             size_t macro_region_id, region_id;
             SplitFullRegionId(full_region_id, n_macro_regions, macro_region_id, region_id);
 
+            if(adc_table) {
+                Decoder::DecodeLetters(*adc_table, iter, block_adcs.data(), block_adcs.size());
+            } else {
+                for(Letter& adc : block_adcs)
+                    adc = iter.read(n_bits_per_adc);
+            }
+            auto adc_iter = block_adcs.begin();
             for(size_t row = 0; row < readout_unit_layout.n_rows; ++row) {
-                for(size_t column = 0; column < readout_unit_layout.n_columns; ++column) {
-                    const Adc adc = adc_stat ? Decoder::DecodeLetter(*adc_stat, iter) : iter.read(n_bits_per_adc);
-                    if(adc) {
-                        const Pixel readout_pixel(row, column);
-                        Pixel macro_region_pixel;
-                        layout.ConvertFromRegionPixel(region_id, readout_pixel, macro_region_pixel);
-                        Pixel chip_pixel;
-                        multi_layout.ConvertFromRegionPixel(macro_region_id, macro_region_pixel, chip_pixel);
-                        chip.AddPixel(chip_pixel, adc);
-                    }
-                }
+                for(size_t column = 0; column < readout_unit_layout.n_columns; ++column, ++adc_iter)
+                    AddPixel(output, multi_layout, layout, macro_region_id, region_id, row, column, *adc_iter);
             }
         }
-        return chip;
+    }
+
+    /// Raw blocks that fit into a single package integer are written and read in bulk.
+    bool UseBulkRawBlocks(size_t n_bits_per_address) const
+    {
+        return !adc_stat && n_bits_per_address + readout_unit_layout.GetNumberOfPixels() * n_bits_per_adc
+                <= Package::BitsPerInteger;
+    }
+
+    template<typename Output>
+    static void AddPixel(Output& output, const MultiRegionLayout& multi_layout, const MultiRegionLayout& layout,
+                         size_t macro_region_id, size_t region_id, size_t row, size_t column, Adc adc)
+    {
+        if(!adc) return;
+        Pixel chip_pixel;
+        if(Output::ReadsAddresses) {
+            const Pixel readout_pixel(row, column);
+            Pixel macro_region_pixel;
+            layout.ConvertFromRegionPixel(region_id, readout_pixel, macro_region_pixel);
+            multi_layout.ConvertFromRegionPixel(macro_region_id, macro_region_pixel, chip_pixel);
+        }
+        output.Add(chip_pixel, adc);
     }
 
 private:
     StatisticsPtr adc_stat;
+    LookupTablePtr adc_table;
     RegionLayout readout_unit_layout;
 };
 
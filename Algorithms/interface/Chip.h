@@ -3,6 +3,8 @@ This file is part of https://github.com/kandrosov/OnChipDataCompression. */
 
 #pragma once
 
+#include <atomic>
+#include <mutex>
 #include "exception.h"
 #include "Pixel.h"
 
@@ -73,6 +75,9 @@ private:
     PixelWithAdcMap pixels;
 };
 
+/// The sub-regions are built on the first access to them, so the chips that are only iterated over or ordered by
+/// region do not pay for the split. The construction is thread-safe for concurrent readers. A copy does not share the
+/// sub-regions with the original and builds its own when needed.
 class PixelMultiRegion : public PixelRegion {
 public:
     using RegionPtr = std::shared_ptr<PixelRegion>;
@@ -81,6 +86,10 @@ public:
     explicit PixelMultiRegion(const MultiRegionLayout& _multi_layout);
     PixelMultiRegion(const PixelRegion& original, size_t n_region_rows, size_t n_region_columns);
     PixelMultiRegion(const PixelRegion& original, const RegionLayout& _region_layout);
+    PixelMultiRegion(const PixelMultiRegion& other);
+    PixelMultiRegion(PixelMultiRegion&& other);
+    PixelMultiRegion& operator=(const PixelMultiRegion& other);
+    PixelMultiRegion& operator=(PixelMultiRegion&& other);
 
     virtual void AddPixel(const Pixel& pixel, Adc adc) override;
     virtual PixelWithAdcVector GetOrderedPixels(Ordering ordering) const override;
@@ -94,12 +103,14 @@ public:
     bool operator!=(const PixelMultiRegion& other) const { return !(*this == other); }
 
 private:
-    void CreateRegions();
-    void AddPixelToRegion(const Pixel& pixel, Adc adc);
+    void CreateRegions() const;
+    void AddPixelToRegion(const Pixel& pixel, Adc adc) const;
 
 private:
     MultiRegionLayout multi_region_layout;
-    RegionVector regions;
+    mutable RegionVector regions;
+    mutable std::atomic<bool> has_regions;
+    mutable std::mutex regions_mutex;
 };
 
 using Chip = PixelMultiRegion;
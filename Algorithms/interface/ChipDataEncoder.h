@@ -5,11 +5,15 @@ This file is part of https://github.com/kandrosov/OnChipDataCompression. */
 
 #include "Chip.h"
 #include "AlphabetStatisticsCollection.h"
+#include "PackageCache.h"
 #include "PackageMaker.h"
 
 namespace pixel_studies {
 
-enum class EncoderFormat { SinglePixel, Region, RegionWithCompressedAdc, Delta };
+enum class EncoderFormat { SinglePixel, Region, RegionWithCompressedAdc, Delta, DeltaWithSubStreams };
+
+const std::map<std::string, EncoderFormat>& EncoderFormatNames();
+EncoderFormat ParseEncoderFormat(const std::string& name);
 
 class ChipDataEncoder {
 public:
@@ -19,13 +23,33 @@ public:
     ChipDataEncoder(EncoderFormat encoder_format, const MultiRegionLayout& _chip_layout,
                     const RegionLayout& readout_unit_layout, size_t max_adc,
                     Ordering ordering = Ordering::ByRegionByColumn, const std::string& dictionary_file = "");
+    /// Enables the cache of the encoded packages indexed by the chip content. Should be called before the encoding.
+    void EnableCache(size_t max_size);
+    const PackageCache* GetCache() const { return cache.get(); }
+
+    /// Chips without hits are encoded into the precomputed empty package.
     Package Encode(const Chip& chip) const;
     Chip Decode(const Package& package) const;
+    /// Decodes macro regions in parallel, if the format has the region index and the package is large enough.
+    Chip Decode(const Package& package, size_t n_threads) const;
+    /// Decodes a single macro region. Only formats with the region index avoid decoding the whole package.
+    PixelRegion DecodeRegion(const Package& package, size_t macro_region_id) const;
+    /// Decodes only the addresses of the hit pixels, skipping the ADC values where the format allows it.
+    PixelVector DecodeAddresses(const Package& package) const;
+    /// Decodes only the ADC values of the hit pixels in the same order as the pixels returned by DecodeAddresses.
+    AdcVector DecodeAdcs(const Package& package) const;
+    bool HasRegionIndex() const { return package_maker->HasRegionIndex(); }
+
+private:
+    /// Returns true for the precomputed empty package, which is decoded without the package maker.
+    bool IsEmptyPackage(const Package& package) const;
 
 private:
     const MultiRegionLayout chip_layout;
     std::shared_ptr<PackageMaker> package_maker;
     std::shared_ptr<StatisticsSource> statistics_source;
+    std::shared_ptr<const Package> empty_package;
+    std::shared_ptr<PackageCache> cache;
 };
 
 } // namespace onchip_algorithms
@@ -1,10 +1,15 @@
 /*! Implementation of a PackageMaker using delta representation.
+By default, pixels of all macro regions are interleaved in a single stream. With sub-streams enabled, each macro region
+is encoded into its own sub-stream and the package starts with an index that contains the number of pixels and the
+size of each sub-stream, so the decoder advances all macro regions in an interleaved loop.
 This file is part of https://github.com/kandrosov/OnChipDataCompression. */
 
 #pragma once
 
+#include <numeric>
 #include "AlphabetStatistics.h"
 #include "AlphabetStatisticsCollection.h"
+#include "Instrumentation.h"
 #include "PackageMaker.h"
 
 namespace pixel_studies {
@@ -21,71 +26,76 @@ public:
     using Encoder = typename Decoder::Encoder;
     using Coordinate = Pixel::Coordinate;
     using Mode = DeltaPackageMakerMode;
+    using LookupTable = typename Decoder::template LookupTable<Statistics>;
+    using LookupTablePtr = std::shared_ptr<const LookupTable>;
+
+    struct SubStream {
+        size_t position, size, n_pixels;
+    };
+    using SubStreamVector = std::vector<SubStream>;
 
     static constexpr size_t BitsPerNpixels = 10;
+    static constexpr size_t BitsPerSubStreamSize = 16;
     static constexpr Coordinate SpecialLetter = -1;
 
     DeltaPackageMaker(const StatisticsSource &source, const RegionLayout& _readout_unit_layout, Mode _mode,
-                      Ordering _ordering) :
+                      Ordering _ordering, bool _use_sub_streams = false) :
         PackageMaker(0), readout_unit_layout(_readout_unit_layout), mode(_mode), ordering(_ordering),
-        adc_stat(source.at(AlphabetType::ActiveAdc))
+        use_sub_streams(_use_sub_streams), adc_stat(source.at(AlphabetType::ActiveAdc))
     {
         if(mode == Mode::SeparateDelta) {
             delta_row_stat = source.at(AlphabetType::DeltaRow);
             delta_column_stat = source.at(AlphabetType::DeltaColumn);
+            delta_row_table = std::make_shared<LookupTable>(*delta_row_stat);
+            delta_column_table = std::make_shared<LookupTable>(*delta_column_stat);
         } else if(mode == Mode::CombinedDelta) {
             delta_rowcolumn_stat = source.at(AlphabetType::DeltaRowColumn);
+            delta_rowcolumn_table = std::make_shared<LookupTable>(*delta_rowcolumn_stat);
         } else
             throw exception("Unsupported delta package maker mode.");
+        adc_table = std::make_shared<LookupTable>(*adc_stat);
     }
 
-    static std::string MakerName(Mode mode)
+    static std::string MakerName(Mode mode, bool use_sub_streams = false)
     {
         static const std::map<DeltaPackageMakerMode, std::string> modeNames = {
             { DeltaPackageMakerMode::SeparateDelta, "separate" },
             { DeltaPackageMakerMode::CombinedDelta, "combined" },
         };
-        return modeNames.at(mode) + "_delta_" + Decoder::Name();
+        return modeNames.at(mode) + "_delta_" + Decoder::Name() + (use_sub_streams ? "_sub_streams" : "");
     }
 
+    bool UsesSubStreams() const { return use_sub_streams; }
+    virtual bool HasRegionIndex() const override { return use_sub_streams; }
+
     virtual Package Make(const Chip& chip) const override
     {
-        using RegionIteratorCollection = std::list<RegionIterator>;
+        if(use_sub_streams)
+            return MakeSubStreams(chip);
+
         Package package;
-        size_t max_size = 0;
         const auto& multi_layout = chip.GetMultiRegionLayout();
         const auto& layout = multi_layout.region_layout;
         const size_t n_macro_regions = multi_layout.GetNumberOfRegions();
-        RegionIteratorCollection region_iterators;
-
+        RegionScheduler scheduler;
+        scheduler.Reserve(n_macro_regions, chip.GetPixels().size());
         for(size_t macro_region_id = 0; macro_region_id < n_macro_regions; ++macro_region_id) {
-            PixelWithAdcVector pixels = {};
-            if(chip.IsRegionActive(macro_region_id)) {
-                const PixelMultiRegion pixel_area(chip.GetRegion(macro_region_id), readout_unit_layout);
-                pixels = pixel_area.GetOrderedPixels(ordering);
-            }
-            region_iterators.push_back(RegionIterator(pixels));
-            max_size = std::max(max_size, region_iterators.back().size());
+            const PixelWithAdcVector pixels = GetOrderedPixels(chip, macro_region_id);
+            scheduler.AddRegion(pixels.begin(), pixels.end());
         }
+        const size_t max_size = scheduler.GetMaxRegionSize();
 
-        for(size_t n = 0; n < max_size; ++n) {
-            for(RegionIterator& region_iter : region_iterators) {
-                if(!region_iter.has_current()) continue;
-                const Pixel previous_pixel = region_iter.previous().first;
-                const Pixel& pixel = region_iter.current().first;
-                const Adc& adc = region_iter.current().second;
-
-                EncodePixel(package, layout, pixel, previous_pixel);
-                Encoder::EncodeLetter(*adc_stat, adc, package);
-                region_iter.move_next();
-            }
+        scheduler.Run([&](size_t, const PixelAdcPair& pixel_with_adc, const PixelAdcPair& previous_pixel) {
+            EncodePixel(package, layout, pixel_with_adc.first, previous_pixel.first);
+            Encoder::EncodeLetter(*adc_stat, pixel_with_adc.second, package, FieldCategory::Adc);
+        }, [&](size_t n) {
             if((n+1) % 2 == 0 || (n+1) == max_size)
                 package.next_readout_cicle();
-        }
+        });
 
         if(n_macro_regions > 1) {
-            for(RegionIterator& region_iter : region_iterators)
-                package.write(region_iter.size(), BitsPerNpixels);
+            for(size_t macro_region_id = 0; macro_region_id < n_macro_regions; ++macro_region_id)
+                package.write(scheduler.GetRegionSize(macro_region_id), BitsPerNpixels, FieldCategory::Trailer);
             package.next_readout_cicle();
         }
 
@@ -95,10 +105,128 @@ public:
     virtual Chip Read(const Package &package, const MultiRegionLayout& multi_layout) const override
     {
         Chip chip(multi_layout);
-        const size_t n_macro_regions = chip.GetMultiRegionLayout().GetNumberOfRegions();
+        ChipDecodingOutput output{ chip };
+        ReadPixels(package, multi_layout, output);
+        return chip;
+    }
+
+    /// The ADC codes are skipped using their lengths only.
+    virtual PixelVector ReadAddresses(const Package& package, const MultiRegionLayout& multi_layout) const override
+    {
+        PixelVector pixels;
+        AddressDecodingOutput output{ pixels };
+        ReadPixels(package, multi_layout, output);
+        return pixels;
+    }
+
+    /// The address codes are parsed, but the pixel coordinates are not reconstructed.
+    virtual AdcVector ReadAdcs(const Package& package, const MultiRegionLayout& multi_layout) const override
+    {
+        AdcVector adcs;
+        AdcDecodingOutput output{ adcs };
+        ReadPixels(package, multi_layout, output);
+        return adcs;
+    }
+
+    /// With sub-streams, only the sub-stream of the requested macro region is decoded.
+    virtual PixelRegion ReadRegion(const Package& package, const MultiRegionLayout& multi_layout,
+                                   size_t macro_region_id) const override
+    {
+        if(!use_sub_streams)
+            return PackageMaker::ReadRegion(package, multi_layout, macro_region_id);
+        const size_t n_macro_regions = multi_layout.GetNumberOfRegions();
+        if(macro_region_id >= n_macro_regions)
+            throw exception("Invalid macro region id = %1%.") % macro_region_id;
+
         const RegionLayout& layout = multi_layout.region_layout;
+        const SubStream sub_stream = ReadSubStreamIndex(package, n_macro_regions).at(macro_region_id);
+        PixelRegion region(layout);
+        Package::iterator iter(package, sub_stream.position);
+        Pixel previous_pixel = RegionScheduler::DefaultPixel().first;
+        for(size_t n = 0; n < sub_stream.n_pixels; ++n) {
+            const Pixel pixel = DecodePixel(iter, layout, previous_pixel);
+            const Adc adc = Decoder::DecodeLetter(*adc_table, iter);
+            region.AddPixel(pixel, adc);
+            previous_pixel = pixel;
+        }
+        if(iter.position() != sub_stream.position + sub_stream.size)
+            throw exception("Sub-stream of the macro region %1% is not consistent with its size.") % macro_region_id;
+        return region;
+    }
+
+    /// Reads the index of the sub-streams: position, size and number of pixels of each macro region.
+    SubStreamVector ReadSubStreamIndex(const Package& package, size_t n_macro_regions) const
+    {
+        if(!use_sub_streams)
+            throw exception("Package maker does not use sub-streams.");
+        SubStreamVector sub_streams(n_macro_regions);
+        Package::iterator iter = package.begin();
+        size_t position = (BitsPerNpixels + BitsPerSubStreamSize) * n_macro_regions;
+        for(size_t k = 0; k < n_macro_regions; ++k) {
+            SubStream& sub_stream = sub_streams.at(k);
+            sub_stream.n_pixels = iter.read(BitsPerNpixels);
+            sub_stream.size = iter.read(BitsPerSubStreamSize);
+            sub_stream.position = position;
+            position += sub_stream.size;
+        }
+        if(position != package.size())
+            throw exception("Total size of the sub-streams = %1% is not consistent with the package size = %2%.")
+                % position % package.size();
+        return sub_streams;
+    }
+
+private:
+    PixelWithAdcVector GetOrderedPixels(const Chip& chip, size_t macro_region_id) const
+    {
+        if(!chip.IsRegionActive(macro_region_id))
+            return PixelWithAdcVector();
+        const PixelRegion& macro_region = chip.GetRegion(macro_region_id);
+        // A single hit does not need the re-partitioning of the macro region into the readout units to be ordered.
+        if(macro_region.GetPixels().size() == 1)
+            return PixelWithAdcVector(macro_region.GetPixels().begin(), macro_region.GetPixels().end());
+        const PixelMultiRegion pixel_area(macro_region, readout_unit_layout);
+        return pixel_area.GetOrderedPixels(ordering);
+    }
+
+    Package MakeSubStreams(const Chip& chip) const
+    {
+        const auto& multi_layout = chip.GetMultiRegionLayout();
+        const auto& layout = multi_layout.region_layout;
+        const size_t n_macro_regions = multi_layout.GetNumberOfRegions();
+        std::vector<Package> sub_streams(n_macro_regions);
+        Package package;
+
+        for(size_t macro_region_id = 0; macro_region_id < n_macro_regions; ++macro_region_id) {
+            const PixelWithAdcVector pixels = GetOrderedPixels(chip, macro_region_id);
+            Package& sub_stream = sub_streams.at(macro_region_id);
+            Pixel previous_pixel = RegionScheduler::DefaultPixel().first;
+            for(const auto& pixel_entry : pixels) {
+                EncodePixel(sub_stream, layout, pixel_entry.first, previous_pixel);
+                Encoder::EncodeLetter(*adc_stat, pixel_entry.second, sub_stream, FieldCategory::Adc);
+                previous_pixel = pixel_entry.first;
+            }
+            package.write(pixels.size(), BitsPerNpixels, FieldCategory::Index);
+            package.write(sub_stream.size(), BitsPerSubStreamSize, FieldCategory::Index);
+        }
+        package.next_readout_cicle();
+
+        for(const Package& sub_stream : sub_streams)
+            package.write(sub_stream);
+        package.next_readout_cicle();
+        return package;
+    }
+
+    template<typename Output>
+    void ReadPixels(const Package &package, const MultiRegionLayout& multi_layout, Output& output) const
+    {
+        if(use_sub_streams) {
+            ReadSubStreams(package, multi_layout, output);
+            return;
+        }
+
+        const size_t n_macro_regions = multi_layout.GetNumberOfRegions();
         std::vector<Pixel> previous_pixel;
-        previous_pixel.assign(n_macro_regions, RegionIterator::DefaultPixel().first);
+        previous_pixel.assign(n_macro_regions, RegionScheduler::DefaultPixel().first);
         size_t max_n_pixels = 0;
         std::vector<size_t> n_pixels(n_macro_regions);
         if(n_macro_regions > 1) {
@@ -109,6 +237,7 @@ public:
                 max_n_pixels = std::max(max_n_pixels, n);
                 n_pixels.at(k) = n;
             }
+            output.Reserve(std::accumulate(n_pixels.begin(), n_pixels.end(), size_t(0)));
         } else {
             max_n_pixels = std::numeric_limits<size_t>::max();
             n_pixels.at(0) = max_n_pixels;
@@ -118,37 +247,82 @@ public:
         for(size_t n = 0; n < max_n_pixels && iter != package.end(); ++n) {
             for(size_t k = 0; k < n_macro_regions; ++k) {
                 if(n_pixels.at(k) <= n) continue;
-                const Pixel region_pixel = DecodePixel(iter, layout, previous_pixel.at(k));
-                const Adc adc = Decoder::DecodeLetter(*adc_stat, iter);
-                Pixel pixel;
-                multi_layout.ConvertFromRegionPixel(k, region_pixel, pixel);
-                chip.AddPixel(pixel, adc);
-                previous_pixel.at(k) = region_pixel;
+                DecodePixel(iter, multi_layout, k, previous_pixel.at(k), output);
             }
         }
+    }
 
-        return chip;
+    /// Decodes one pixel from each sub-stream in turn, so the decoding of the independent sub-streams overlaps.
+    template<typename Output>
+    void ReadSubStreams(const Package& package, const MultiRegionLayout& multi_layout, Output& output) const
+    {
+        struct Lane {
+            Package::iterator iter;
+            size_t end_position, n_pixels_left, macro_region_id;
+            Pixel previous_pixel;
+        };
+
+        const size_t n_macro_regions = multi_layout.GetNumberOfRegions();
+        const SubStreamVector sub_streams = ReadSubStreamIndex(package, n_macro_regions);
+        std::vector<Lane> lanes;
+        lanes.reserve(n_macro_regions);
+        size_t n_pixels = 0;
+        for(size_t k = 0; k < n_macro_regions; ++k) {
+            const SubStream& sub_stream = sub_streams.at(k);
+            n_pixels += sub_stream.n_pixels;
+            if(!sub_stream.n_pixels) continue;
+            lanes.push_back(Lane{ Package::iterator(package, sub_stream.position),
+                                  sub_stream.position + sub_stream.size, sub_stream.n_pixels, k,
+                                  RegionScheduler::DefaultPixel().first });
+        }
+
+        output.Reserve(n_pixels);
+        while(lanes.size()) {
+            for(size_t n = 0; n < lanes.size();) {
+                Lane& lane = lanes[n];
+                DecodePixel(lane.iter, multi_layout, lane.macro_region_id, lane.previous_pixel, output);
+                if(--lane.n_pixels_left) {
+                    ++n;
+                    continue;
+                }
+                if(lane.iter.position() != lane.end_position)
+                    throw exception("Sub-stream of the macro region %1% is not consistent with its size.")
+                        % lane.macro_region_id;
+                lanes.erase(lanes.begin() + n);
+            }
+        }
     }
 
-private:
     static void EncodeLetter(Package& package, StatisticsPtr stat, Letter letter, size_t abs_value,
                              size_t bits_per_raw_data)
     {
         if(stat->GetAlphabet().count(letter)) {
-            Encoder::EncodeLetter(*stat, letter, package);
+            Encoder::EncodeLetter(*stat, letter, package, FieldCategory::Address);
         } else {
-            Encoder::EncodeLetter(*stat, SpecialLetter, package);
-            package.write(abs_value, bits_per_raw_data);
+            Encoder::EncodeLetter(*stat, SpecialLetter, package, FieldCategory::Escape);
+            package.write(abs_value, bits_per_raw_data, FieldCategory::RawFallback);
+            PIXEL_STUDIES_COUNT(Encoding, Escapes, 1);
+        }
+    }
+
+    static void SkipLetter(Package::iterator& iter, const LookupTable& table, size_t bits_per_raw_data)
+    {
+        if(Decoder::DecodeLetter(table, iter) == SpecialLetter) {
+            iter += bits_per_raw_data;
+            iter.check();
+            PIXEL_STUDIES_COUNT(Decoding, Escapes, 1);
         }
     }
 
     template<typename LetterType, typename AbsValueType>
-    static bool DecodeLetter(Package::iterator& iter, StatisticsPtr stat, LetterType& letter, AbsValueType& abs_value,
-                             size_t bits_per_raw_data)
+    static bool DecodeLetter(Package::iterator& iter, const LookupTable& table, LetterType& letter,
+                             AbsValueType& abs_value, size_t bits_per_raw_data)
     {
-        letter = Decoder::DecodeLetter(*stat, iter);
-        if(letter == SpecialLetter)
+        letter = Decoder::DecodeLetter(table, iter);
+        if(letter == SpecialLetter) {
             abs_value = iter.read(bits_per_raw_data, false);
+            PIXEL_STUDIES_COUNT(Decoding, Escapes, 1);
+        }
         return letter != SpecialLetter;
     }
 
@@ -173,12 +347,13 @@ private:
         Pixel delta, pixel;
         bool has_delta_row = false, has_delta_column = false;
         if(mode == Mode::SeparateDelta) {
-            has_delta_row = DecodeLetter(iter, delta_row_stat, delta.row, pixel.row, layout.BitsPerRow());
-            has_delta_column = DecodeLetter(iter, delta_column_stat, delta.column, pixel.column, layout.BitsPerColumn());
+            has_delta_row = DecodeLetter(iter, *delta_row_table, delta.row, pixel.row, layout.BitsPerRow());
+            has_delta_column = DecodeLetter(iter, *delta_column_table, delta.column, pixel.column,
+                                            layout.BitsPerColumn());
         } else {
             Letter delta_rowcolumn;
             size_t pixel_id;
-            has_delta_row = has_delta_column = DecodeLetter(iter, delta_rowcolumn_stat, delta_rowcolumn,
+            has_delta_row = has_delta_column = DecodeLetter(iter, *delta_rowcolumn_table, delta_rowcolumn,
                                                             pixel_id, layout.BitsPerId());
             if(has_delta_row)
                 delta = layout.GetPixel(delta_rowcolumn);
@@ -192,12 +367,39 @@ private:
         return pixel;
     }
 
+    /// Decodes the next pixel of the macro region and passes the parts read by the output to it.
+    template<typename Output>
+    void DecodePixel(Package::iterator& iter, const MultiRegionLayout& multi_layout, size_t macro_region_id,
+                     Pixel& previous_pixel, Output& output) const
+    {
+        const RegionLayout& layout = multi_layout.region_layout;
+        Pixel pixel;
+        if(Output::ReadsAddresses) {
+            const Pixel region_pixel = DecodePixel(iter, layout, previous_pixel);
+            multi_layout.ConvertFromRegionPixel(macro_region_id, region_pixel, pixel);
+            previous_pixel = region_pixel;
+        } else if(mode == Mode::SeparateDelta) {
+            SkipLetter(iter, *delta_row_table, layout.BitsPerRow());
+            SkipLetter(iter, *delta_column_table, layout.BitsPerColumn());
+        } else {
+            SkipLetter(iter, *delta_rowcolumn_table, layout.BitsPerId());
+        }
+        Adc adc = 0;
+        if(Output::ReadsAdcs)
+            adc = Decoder::DecodeLetter(*adc_table, iter);
+        else
+            Decoder::SkipLetter(*adc_table, iter);
+        output.Add(pixel, adc);
+    }
+
 
 private:
     RegionLayout readout_unit_layout;
     Mode mode;
     Ordering ordering;
+    bool use_sub_streams;
     StatisticsPtr adc_stat, delta_row_stat, delta_column_stat, delta_rowcolumn_stat;
+    LookupTablePtr adc_table, delta_row_table, delta_column_table, delta_rowcolumn_table;
 };
 
 } // namespace pixel_studies
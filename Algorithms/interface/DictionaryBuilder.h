@@ -3,11 +3,40 @@ This file is part of https://github.com/kandrosov/OnChipDataCompression. */
 
 #pragma once
 
+#include <atomic>
 #include "Chip.h"
 #include "AlphabetStatisticsProducer.h"
 
 namespace pixel_studies {
 
+struct DictionaryConvergenceConfig {
+    /// Number of chips between two consecutive snapshots of the letter frequencies. Zero disables the snapshots.
+    size_t chips_per_snapshot = 0;
+    /// Maximal KL divergence and expected code length change (bits per letter) between two consecutive snapshots
+    /// for each alphabet, which are considered as no change.
+    double tolerance = 1e-4;
+    /// Number of consecutive snapshots without change that are required for the convergence.
+    size_t n_stable_snapshots = 3;
+    /// Ignore the chips added after the convergence.
+    bool stop_when_converged = false;
+};
+
+/// Change of an alphabet since the previous snapshot. The KL divergence D(current || previous) is computed with the
+/// frequencies smoothed by half a count per letter. The code length change is the expected number of bits per letter
+/// that the previous dictionary would spend on top of the current one on the current frequencies. The letters outside
+/// of a reduced alphabet are counted with the code length of the escape letter.
+struct AlphabetChange {
+    std::string name;
+    double kl_divergence, code_length_change;
+};
+
+struct DictionarySnapshot {
+    size_t n_chips;
+    /// Changes of all alphabets since the previous snapshot. Empty for the first snapshot.
+    std::vector<AlphabetChange> changes;
+    bool is_stable;
+};
+
 class DictionaryBuilder {
 public:
     using Letter = int;
@@ -17,23 +46,64 @@ public:
     using ProducerPtr = std::shared_ptr<Producer>;
 
     DictionaryBuilder(const MultiRegionLayout& _chip_layout, Ordering _ordering,
-                      const RegionLayout& _readout_unit_layout, size_t _max_adc, size_t _max_alphabet_size);
-    void AddChip(const Chip& chip);
+                      const RegionLayout& _readout_unit_layout, size_t _max_adc, size_t _max_alphabet_size,
+                      const DictionaryConvergenceConfig& _convergence = DictionaryConvergenceConfig());
+    /// Returns false if the chip is ignored, because the training is converged and stop_when_converged is set.
+    /// The method can be called concurrently from several threads. In that case, a snapshot may also include the
+    /// chips that were added while the previous snapshot was processed, and a few chips in flight can be accepted
+    /// after the convergence.
+    bool AddChip(const Chip& chip);
+    /// Adds letter frequencies collected by another builder with the same configuration.
+    void Merge(const DictionaryBuilder& other);
     void SaveDictionaries(const std::string& cfg_file_name);
 
+    size_t GetNumberOfChips() const { return n_chips; }
+    bool IsConverged() const { return converged; }
+    std::vector<DictionarySnapshot> GetSnapshots() const;
+    void WriteSnapshots(std::ostream& os) const;
+
 private:
+    using Integer = Producer::Integer;
+    using CountVector = std::vector<Integer>;
+
+    /// Letter frequencies and the code lengths of the corresponding dictionary at the time of a snapshot.
+    struct AlphabetState {
+        std::string name;
+        Producer::LetterFrequencyMap frequencies;
+        std::map<Letter, size_t> code_lengths;
+    };
+
+    /// Letter counts of a single chip. They are collected without locking and added to the producers at once.
+    struct ChipLetterCounts {
+        CountVector all_adc, active_adc;
+        std::vector<Letter> delta_row_column;
+        std::vector<size_t> block_ids;
+    };
+
     static Producer CreateProducer(const std::string& name, const Letter& begin, const Letter& end);
-    void ProcessOrderedPixels(const PixelWithAdcVector& ordered_pixels);
-    void ProcessRegionBlocks(const PixelMultiRegion& pixel_area);
+    static void AddDenseCount(CountVector& counts, size_t letter, Integer n = 1);
+    static Producer::LetterFrequencyMap ToFrequencies(const CountVector& counts);
+    static Producer::LetterFrequencyMap ToFrequencies(std::vector<Letter>& letters);
+    void ProcessOrderedPixels(const PixelWithAdcVector& ordered_pixels, ChipLetterCounts& counts) const;
+    void ProcessRegionBlocks(const PixelRegion& macro_region, ChipLetterCounts& counts) const;
+    void TakeSnapshot(size_t n_processed_chips);
+    AlphabetState GetAlphabetState(const Producer& producer, bool reduce) const;
+    static AlphabetChange Compare(const AlphabetState& previous, const AlphabetState& current);
     void SaveStatistics(Producer& producer, std::ostream& os, bool reduce) const;
 
 private:
-    std::mutex mutex;
+    mutable std::mutex mutex;
     const MultiRegionLayout chip_layout;
     const Ordering ordering;
     const RegionLayout readout_unit_layout;
     const size_t max_alphabet_size;
+    const DictionaryConvergenceConfig convergence;
     Producer all_adc_prod, active_adc_prod, delta_row_column_prod;
+    std::atomic<size_t> n_chips;
+    std::atomic<bool> converged;
+    size_t n_stable_snapshots;
+    std::vector<AlphabetState> last_state;
+    std::vector<DictionarySnapshot> snapshots;
 };
 
 } // namespace pixel_studies
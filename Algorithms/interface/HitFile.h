@@ -0,0 +1,65 @@
+/*! Classes to read and write chip hits in a plain text format.
+Each chip is stored as a header line "chip <event_id> <module_id> <chip_id> <n_hits>" followed by n_hits lines
+"<row> <column> <adc>". Lines that start with '#' are comments.
+This file is part of https://github.com/kandrosov/OnChipDataCompression. */
+
+#pragma once
+
+#include <fstream>
+#include "Chip.h"
+
+namespace pixel_studies {
+
+struct ChipRecord {
+    uint64_t event_id;
+    uint32_t module_id, chip_id;
+    ChipPtr chip;
+
+    ChipRecord() : event_id(0), module_id(0), chip_id(0) {}
+    ChipRecord(uint64_t _event_id, uint32_t _module_id, uint32_t _chip_id, const ChipPtr& _chip) :
+        event_id(_event_id), module_id(_module_id), chip_id(_chip_id), chip(_chip) {}
+};
+
+using ChipRecordVector = std::vector<ChipRecord>;
+
+/// Hits of a chip as they are stored in the file, so the file can be read separately from the chip construction.
+struct HitRecord {
+    uint64_t event_id;
+    uint32_t module_id, chip_id;
+    PixelWithAdcVector hits;
+
+    HitRecord() : event_id(0), module_id(0), chip_id(0) {}
+
+    ChipRecord MakeChip(const MultiRegionLayout& chip_layout) const;
+};
+
+class HitFileReader {
+public:
+    HitFileReader(const std::string& _file_name, const MultiRegionLayout& _chip_layout);
+
+    bool ReadHits(HitRecord& record);
+    bool ReadChip(ChipRecord& record);
+    ChipRecordVector ReadAll(size_t max_n_chips = std::numeric_limits<size_t>::max());
+
+private:
+    bool NextLine(std::string& line);
+
+private:
+    const std::string file_name;
+    const MultiRegionLayout chip_layout;
+    std::ifstream file;
+    size_t line_number;
+};
+
+class HitFileWriter {
+public:
+    explicit HitFileWriter(const std::string& _file_name);
+
+    void WriteChip(const ChipRecord& record);
+
+private:
+    const std::string file_name;
+    std::ofstream file;
+};
+
+} // namespace pixel_studies
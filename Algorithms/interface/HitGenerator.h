@@ -0,0 +1,65 @@
+/*! The class that generates synthetic cluster-based chip hits.
+This file is part of https://github.com/kandrosov/OnChipDataCompression. */
+
+#pragma once
+
+#include <random>
+#include "Chip.h"
+
+namespace pixel_studies {
+
+struct HitGeneratorConfig {
+    /// Mean fraction of the chip pixels that are hit (cluster and noise hits together).
+    double occupancy = 1e-3;
+    /// Fraction of the hits that are isolated noise hits.
+    double noise_fraction = 0.02;
+    /// Sensor thickness in units of the pixel pitch along rows and columns.
+    double thickness_over_row_pitch = 2., thickness_over_column_pitch = 1.;
+    /// Track incidence angle (rad) along rows: gaussian, mostly driven by the Lorentz drift.
+    double row_angle_mean = 0.35, row_angle_sigma = 0.1;
+    /// Track incidence angle (rad) along columns: uniform, driven by the pseudorapidity spread.
+    double column_angle_min = -1.3, column_angle_max = 1.3;
+    /// Moyal (Landau approximation) parameters of the charge deposited per unit of the sensor thickness.
+    double charge_mpv = 10., charge_width = 1.5;
+    /// Minimal charge that a pixel must collect to be read out.
+    double threshold = 1.;
+    /// Maximal ADC value. Higher charges are saturated.
+    size_t max_adc = 15;
+    /// Maximal cluster extent along rows or columns.
+    size_t max_cluster_length = 16;
+};
+
+class HitGenerator {
+public:
+    HitGenerator(const MultiRegionLayout& _chip_layout, const HitGeneratorConfig& _config, uint64_t seed);
+
+    Chip Generate();
+    void Generate(Chip& chip);
+    ChipPtrVector Generate(size_t n_chips);
+
+    const MultiRegionLayout& GetChipLayout() const { return chip_layout; }
+    const HitGeneratorConfig& GetConfig() const { return config; }
+    double GetMeanClusterSize() const { return mean_cluster_size; }
+    double GetMeanNumberOfClusters() const { return mean_n_clusters; }
+    double GetMeanNumberOfNoiseHits() const { return mean_n_noise_hits; }
+
+private:
+    using Generator = std::mt19937_64;
+    using PixelChargeVector = std::vector<std::pair<Pixel, double>>;
+
+    void CheckConfig() const;
+    void GenerateCluster(Generator& gen, PixelChargeVector& cluster_pixels);
+    size_t ChargeToAdc(double charge) const;
+
+private:
+    const MultiRegionLayout chip_layout;
+    const HitGeneratorConfig config;
+    Generator generator;
+    std::uniform_real_distribution<double> unit_distr, column_angle_distr;
+    std::normal_distribution<double> normal_distr, row_angle_distr;
+    std::uniform_int_distribution<size_t> pixel_id_distr;
+    double mean_cluster_size, mean_n_clusters, mean_n_noise_hits;
+    PixelChargeVector cluster_pixels;
+};
+
+} // namespace pixel_studies
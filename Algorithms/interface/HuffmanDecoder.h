@@ -5,6 +5,7 @@ This file is part of https://github.com/kandrosov/OnChipDataCompression. */
 
 #include "Package.h"
 #include "HuffmanLetterCode.h"
+#include "HuffmanLookupTable.h"
 
 namespace pixel_studies {
 
@@ -14,6 +15,9 @@ class HuffmanDecoder {
 public:
     using Encoder = HuffmanEncoder;
 
+    template<typename Statistics>
+    using LookupTable = HuffmanLookupTable<Statistics>;
+
     static const std::string& Name() { static const std::string name = "huffman"; return name; }
 
     template<typename OutputCollection, typename Statistics>
@@ -50,6 +54,26 @@ public:
         return letter;
     }
 
+    template<typename Statistics>
+    static typename Statistics::Letter DecodeLetter(const LookupTable<Statistics>& table,
+                                                    Package::iterator& inputIterator)
+    {
+        return table.DecodeLetter(inputIterator);
+    }
+
+    template<typename Statistics>
+    static void DecodeLetters(const LookupTable<Statistics>& table, Package::iterator& inputIterator,
+                              typename Statistics::Letter* letters, size_t n_letters)
+    {
+        for(size_t n = 0; n < n_letters;)
+            n += table.DecodeLetters(inputIterator, letters + n, n_letters - n);
+    }
+
+    template<typename Statistics>
+    static void SkipLetter(const LookupTable<Statistics>& table, Package::iterator& inputIterator)
+    {
+        table.SkipLetter(inputIterator);
+    }
 
 private:
     ~HuffmanDecoder() {}
@@ -24,12 +24,13 @@ public:
     }
 
     template<typename Statistics>
-    static void EncodeLetter(const Statistics& statistics, const typename Statistics::Letter& letter, Package& package)
+    static void EncodeLetter(const Statistics& statistics, const typename Statistics::Letter& letter, Package& package,
+                             FieldCategory category = FieldCategory::Unspecified)
     {
         const HuffmanCode& code = statistics.GetHuffmanCode(letter);
         for(size_t n = 0; n < code.NumberOfBits(); ++n) {
             const HuffmanCode::CodeContainer bit = (code.Code() >> n) & HuffmanCode::CodeContainer(1);
-            package.write(bit, 1);
+            package.write(bit, 1, category);
         }
 
 //        package.write(code.Code(), code.NumberOfBits());
@@ -0,0 +1,166 @@
+/*! Table-driven decoding of the Huffman codes.
+The table is indexed by the next lookup_bits bits of the package and gives the decoded letter together with its code
+length, so a letter is decoded with a single peek instead of the bit-by-bit search in the Huffman table. Letters with
+codes longer than lookup_bits are decoded bit-by-bit. The code lengths are also stored in a compact table, which is
+used to skip letters whose values are not needed.
+Optionally, the table also stores for each index the sequence of up to max_letters_per_lookup letters whose codes fit
+into lookup_bits bits together, so alphabets dominated by short codes are decoded several letters per lookup.
+This file is part of https://github.com/kandrosov/OnChipDataCompression. */
+
+#pragma once
+
+#include <array>
+#include "Package.h"
+#include "HuffmanLetterCode.h"
+
+namespace pixel_studies {
+
+template<typename _Statistics>
+class HuffmanLookupTable {
+public:
+    using Statistics = _Statistics;
+    using Letter = typename Statistics::Letter;
+
+    static constexpr size_t DefaultMaxLookupBits = 10;
+    static constexpr size_t MaxLettersPerLookup = 4;
+
+    struct Entry {
+        Letter letter;
+        size_t n_bits;
+    };
+
+    struct MultiEntry {
+        std::array<Letter, MaxLettersPerLookup> letters;
+        /// Number of bits from the lookup position to the end of each letter.
+        std::array<uint8_t, MaxLettersPerLookup> end_bits;
+        size_t n_letters;
+    };
+
+    /// With max_letters_per_lookup > 1, the lookup uses max_lookup_bits bits even if all codes are shorter.
+    explicit HuffmanLookupTable(const Statistics& _statistics, size_t max_lookup_bits = DefaultMaxLookupBits,
+                                size_t _max_letters_per_lookup = 1) :
+        statistics(&_statistics), lookup_bits(0), max_letters_per_lookup(_max_letters_per_lookup)
+    {
+        if(!max_lookup_bits || max_lookup_bits > Package::MaxPeekBits)
+            throw exception("Invalid max number of lookup bits = %1%.") % max_lookup_bits;
+        if(!max_letters_per_lookup || max_letters_per_lookup > MaxLettersPerLookup)
+            throw exception("Invalid max number of letters per lookup = %1%.") % max_letters_per_lookup;
+        for(const Letter& letter : statistics->GetAlphabet())
+            lookup_bits = std::max(lookup_bits, statistics->GetHuffmanCode(letter).NumberOfBits());
+        if(max_letters_per_lookup > 1)
+            lookup_bits = max_lookup_bits;
+        lookup_bits = std::max<size_t>(1, std::min(lookup_bits, max_lookup_bits));
+
+        entries.assign(size_t(1) << lookup_bits, Entry{ Letter(), 0 });
+        code_lengths.assign(entries.size(), 0);
+        for(const Letter& letter : statistics->GetAlphabet()) {
+            const HuffmanCode& code = statistics->GetHuffmanCode(letter);
+            if(!code.NumberOfBits() || code.NumberOfBits() > lookup_bits) continue;
+            const size_t n_free_bits = lookup_bits - code.NumberOfBits();
+            const size_t first = bit_packing::ReverseBits(code.Code(), code.NumberOfBits()) << n_free_bits;
+            for(size_t n = first; n < first + (size_t(1) << n_free_bits); ++n) {
+                entries[n] = Entry{ letter, code.NumberOfBits() };
+                code_lengths[n] = static_cast<uint8_t>(code.NumberOfBits());
+            }
+        }
+        if(max_letters_per_lookup > 1)
+            FillMultiEntries();
+    }
+
+    const Statistics& GetStatistics() const { return *statistics; }
+    size_t GetLookupBits() const { return lookup_bits; }
+    size_t GetMaxLettersPerLookup() const { return max_letters_per_lookup; }
+
+    Letter DecodeLetter(Package::iterator& iter) const
+    {
+        const Entry& entry = entries[iter.peek(lookup_bits)];
+        if(!entry.n_bits)
+            return DecodeLongLetter(iter);
+        const size_t bits_left = iter.bits_left();
+        if(entry.n_bits > bits_left)
+            throw exception("No enough data in the package to decode the letter. Number of bits requested = %1%,"
+                            " number of bits left = %2%.") % entry.n_bits % bits_left;
+        iter += entry.n_bits;
+        return entry.letter;
+    }
+
+    /// Decodes up to max_letters letters with a single lookup and returns the number of the decoded letters. At least
+    /// one letter is decoded if max_letters > 0.
+    size_t DecodeLetters(Package::iterator& iter, Letter* letters, size_t max_letters) const
+    {
+        if(!max_letters)
+            return 0;
+        if(multi_entries.empty()) {
+            letters[0] = DecodeLetter(iter);
+            return 1;
+        }
+        const MultiEntry& entry = multi_entries[iter.peek(lookup_bits)];
+        size_t n_letters = std::min(entry.n_letters, max_letters);
+        const size_t bits_left = iter.bits_left();
+        while(n_letters && entry.end_bits[n_letters - 1] > bits_left)
+            --n_letters;
+        if(!n_letters) {
+            letters[0] = DecodeLetter(iter);
+            return 1;
+        }
+        std::copy(entry.letters.begin(), entry.letters.begin() + n_letters, letters);
+        iter += entry.end_bits[n_letters - 1];
+        return n_letters;
+    }
+
+    /// Moves the iterator after the next letter without decoding its value.
+    void SkipLetter(Package::iterator& iter) const
+    {
+        const size_t n_bits = code_lengths[iter.peek(lookup_bits)];
+        if(!n_bits) {
+            DecodeLongLetter(iter);
+            return;
+        }
+        const size_t bits_left = iter.bits_left();
+        if(n_bits > bits_left)
+            throw exception("No enough data in the package to skip the letter. Number of bits requested = %1%,"
+                            " number of bits left = %2%.") % n_bits % bits_left;
+        iter += n_bits;
+    }
+
+private:
+    void FillMultiEntries()
+    {
+        const size_t index_mask = entries.size() - 1;
+        multi_entries.resize(entries.size());
+        for(size_t index = 0; index < entries.size(); ++index) {
+            MultiEntry& multi_entry = multi_entries[index];
+            multi_entry.n_letters = 0;
+            size_t n_bits = 0;
+            while(multi_entry.n_letters < max_letters_per_lookup) {
+                // The consumed bits are shifted out, so the entry is valid only if its code fits the remaining bits.
+                const Entry& entry = entries[(index << n_bits) & index_mask];
+                if(!entry.n_bits || n_bits + entry.n_bits > lookup_bits) break;
+                n_bits += entry.n_bits;
+                multi_entry.letters[multi_entry.n_letters] = entry.letter;
+                multi_entry.end_bits[multi_entry.n_letters] = static_cast<uint8_t>(n_bits);
+                ++multi_entry.n_letters;
+            }
+        }
+    }
+
+    Letter DecodeLongLetter(Package::iterator& iter) const
+    {
+        HuffmanCode code;
+        Letter letter;
+        do {
+            const bool bit = iter.read(1);
+            code = HuffmanCode(code, bit);
+        } while(!statistics->GetLetterFromHuffmanCode(code, letter));
+        return letter;
+    }
+
+private:
+    const Statistics* statistics;
+    size_t lookup_bits, max_letters_per_lookup;
+    std::vector<Entry> entries;
+    std::vector<uint8_t> code_lengths;
+    std::vector<MultiEntry> multi_entries;
+};
+
+} // namespace pixel_studies
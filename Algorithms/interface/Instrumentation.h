@@ -0,0 +1,147 @@
+/*! Per-stage timers and counters for the hot paths of the library.
+The instrumentation is compiled in only if PIXEL_STUDIES_INSTRUMENTATION is defined. Otherwise the macros
+PIXEL_STUDIES_SCOPED_TIMER and PIXEL_STUDIES_COUNT expand to nothing.
+This file is part of https://github.com/kandrosov/OnChipDataCompression. */
+
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <vector>
+
+namespace pixel_studies {
+namespace instrumentation {
+
+enum class Stage { ChipConstruction, Repartition, Ordering, Encoding, Decoding, Verification, DictionaryTraining };
+enum class Counter { Chips, Hits, Bits, Escapes, FastPaths, CacheHits };
+
+constexpr size_t NumberOfStages = static_cast<size_t>(Stage::DictionaryTraining) + 1;
+constexpr size_t NumberOfCounters = static_cast<size_t>(Counter::CacheHits) + 1;
+
+const std::string& StageName(Stage stage);
+const std::string& CounterName(Counter counter);
+
+constexpr bool IsEnabled()
+{
+#ifdef PIXEL_STUDIES_INSTRUMENTATION
+    return true;
+#else
+    return false;
+#endif
+}
+
+using Clock = std::chrono::steady_clock;
+
+struct StageStatistics {
+    size_t n_calls;
+    Clock::duration total_time;
+    std::array<uint64_t, NumberOfCounters> counters;
+
+    StageStatistics() : n_calls(0), total_time(Clock::duration::zero()) { counters.fill(0); }
+    StageStatistics& operator+=(const StageStatistics& other);
+};
+
+using StageStatisticsArray = std::array<StageStatistics, NumberOfStages>;
+
+struct TraceEvent {
+    Stage stage;
+    Clock::time_point start;
+    Clock::duration duration;
+};
+
+/// Statistics collected by a single thread. Each thread writes only into its own recorder.
+class ThreadRecorder {
+public:
+    explicit ThreadRecorder(size_t _thread_index) : thread_index(_thread_index) {}
+
+    size_t GetThreadIndex() const { return thread_index; }
+    const StageStatisticsArray& GetStatistics() const { return statistics; }
+    const std::vector<TraceEvent>& GetTrace() const { return trace; }
+
+    void AddTime(Stage stage, const Clock::time_point& start, const Clock::duration& duration);
+    void AddCount(Stage stage, Counter counter, uint64_t value)
+    {
+        statistics[static_cast<size_t>(stage)].counters[static_cast<size_t>(counter)] += value;
+    }
+    void Reset();
+
+private:
+    size_t thread_index;
+    StageStatisticsArray statistics;
+    std::vector<TraceEvent> trace;
+};
+
+/// Owns the recorders of all threads. The summary and the trace should be produced when the instrumented threads
+/// are not running.
+class Registry {
+public:
+    static Registry& Instance();
+
+    ThreadRecorder& GetThreadRecorder();
+
+    /// Enables the recording of the trace events with at most max_events_per_thread events per thread.
+    void EnableTrace(size_t max_events_per_thread);
+    size_t GetMaxTraceEventsPerThread() const { return max_trace_events_per_thread; }
+
+    StageStatisticsArray GetTotalStatistics() const;
+    void WriteSummary(std::ostream& os, bool per_thread = false) const;
+    void WriteChromeTrace(std::ostream& os) const;
+    void Reset();
+
+private:
+    Registry();
+    static void WriteSummaryRow(std::ostream& os, const std::string& thread_name, Stage stage,
+                                const StageStatistics& stat);
+
+private:
+    mutable std::mutex mutex;
+    const Clock::time_point creation_time;
+    std::atomic<size_t> max_trace_events_per_thread;
+    std::vector<std::unique_ptr<ThreadRecorder>> recorders;
+};
+
+inline ThreadRecorder& CurrentThreadRecorder()
+{
+    static thread_local ThreadRecorder& recorder = Registry::Instance().GetThreadRecorder();
+    return recorder;
+}
+
+class ScopedTimer {
+public:
+    explicit ScopedTimer(Stage _stage) : stage(_stage), start(Clock::now()) {}
+    ~ScopedTimer() { CurrentThreadRecorder().AddTime(stage, start, Clock::now() - start); }
+    ScopedTimer(const ScopedTimer&) = delete;
+    ScopedTimer& operator=(const ScopedTimer&) = delete;
+
+private:
+    Stage stage;
+    Clock::time_point start;
+};
+
+inline void AddCount(Stage stage, Counter counter, uint64_t value)
+{
+    CurrentThreadRecorder().AddCount(stage, counter, value);
+}
+
+} // namespace instrumentation
+} // namespace pixel_studies
+
+#define PIXEL_STUDIES_CONCAT_IMPL(a, b) a##b
+#define PIXEL_STUDIES_CONCAT(a, b) PIXEL_STUDIES_CONCAT_IMPL(a, b)
+
+#ifdef PIXEL_STUDIES_INSTRUMENTATION
+#define PIXEL_STUDIES_SCOPED_TIMER(stage) \
+    const ::pixel_studies::instrumentation::ScopedTimer PIXEL_STUDIES_CONCAT(pixel_studies_scoped_timer_, __LINE__)( \
+        ::pixel_studies::instrumentation::Stage::stage)
+#define PIXEL_STUDIES_COUNT(stage, counter, value) \
+    ::pixel_studies::instrumentation::AddCount(::pixel_studies::instrumentation::Stage::stage, \
+                                               ::pixel_studies::instrumentation::Counter::counter, (value))
+#else
+#define PIXEL_STUDIES_SCOPED_TIMER(stage)
+#define PIXEL_STUDIES_COUNT(stage, counter, value)
+#endif
@@ -0,0 +1,100 @@
+/*! Aggregated link stream that carries the packages of several chips.
+The packages are concatenated into byte-aligned frames:
+    sync word 0x1ACFFC1D, uint16 chip id, uint32 package size in bits, CRC-16 of the chip id and of the size;
+    package bytes, followed by CRC-16 of the package bytes.
+All values are little-endian. Since each frame starts with the sync word, the frame boundaries can be found from any
+position of the stream without parsing the packages. The demultiplexer splits the stream into ranges that are scanned
+in parallel. A frame found by the scan is accepted only if the header of the following frame is valid as well, and
+the ranges are checked to continue each other. Frames with a corrupted header are skipped by resynchronising at the
+next sync word, frames with a corrupted package are reported and not decoded.
+This file is part of https://github.com/kandrosov/OnChipDataCompression. */
+
+#pragma once
+
+#include "ChipDataEncoder.h"
+
+namespace pixel_studies {
+
+struct LinkFrame {
+    static constexpr uint32_t SyncWord = 0x1ACFFC1D;
+    static constexpr size_t SyncWordSize = 4, HeaderSize = 12, TrailerSize = 2;
+
+    size_t offset, n_bits;
+    uint16_t chip_id;
+    bool is_valid;
+
+    LinkFrame() : offset(0), n_bits(0), chip_id(0), is_valid(false) {}
+    size_t payload_offset() const { return offset + HeaderSize; }
+    size_t payload_size() const { return (n_bits + Package::BitsPerItem - 1) / Package::BitsPerItem; }
+    size_t size() const { return HeaderSize + payload_size() + TrailerSize; }
+};
+
+struct LinkStreamStatistics {
+    size_t n_frames, n_corrupted_frames, n_resynchronisations, n_skipped_bytes;
+
+    LinkStreamStatistics() : n_frames(0), n_corrupted_frames(0), n_resynchronisations(0), n_skipped_bytes(0) {}
+    void Add(const LinkStreamStatistics& other);
+};
+
+struct LinkStreamChip {
+    uint16_t chip_id;
+    ChipPtr chip;
+};
+
+class LinkStreamWriter {
+public:
+    using ByteVector = std::vector<uint8_t>;
+
+    LinkStreamWriter() : n_frames(0) {}
+
+    void AddPackage(uint16_t chip_id, const Package& package);
+    const ByteVector& GetBytes() const { return bytes; }
+    size_t GetNumberOfFrames() const { return n_frames; }
+    void Clear();
+
+private:
+    ByteVector bytes;
+    size_t n_frames;
+};
+
+class LinkStreamReader {
+public:
+    using FrameVector = std::vector<LinkFrame>;
+    using ChipVector = std::vector<LinkStreamChip>;
+
+    static constexpr size_t NotFound = std::numeric_limits<size_t>::max();
+    /// Minimal number of bytes scanned by each thread.
+    static constexpr size_t MinBytesPerThread = 4096;
+
+    /// The reader does not copy the stream, so the data should exist as long as the reader is used.
+    LinkStreamReader(const uint8_t* _data, size_t _size) : data(_data), data_size(_size) {}
+
+    size_t size() const { return data_size; }
+
+    /// Finds the frames using up to n_threads threads. The frames are returned in the order of the stream.
+    FrameVector FindFrames(size_t n_threads = 1, LinkStreamStatistics* stat = nullptr) const;
+    Package GetPackage(const LinkFrame& frame) const;
+    /// Demultiplexes the stream and decodes the frames with valid packages using up to n_threads threads.
+    ChipVector Decode(const ChipDataEncoder& encoder, size_t n_threads = 1,
+                      LinkStreamStatistics* stat = nullptr) const;
+
+    /// Returns the offset of the first frame that starts in [begin, end) and is followed by a valid frame header or
+    /// by the end of the stream, or NotFound.
+    size_t FindSync(size_t begin, size_t end) const;
+
+private:
+    struct Range {
+        size_t begin, end, first, next;
+        FrameVector frames;
+        LinkStreamStatistics stat;
+    };
+
+    bool ReadHeader(size_t offset, LinkFrame& frame) const;
+    void ScanRange(size_t start, Range& range) const;
+
+private:
+    const uint8_t* data;
+    size_t data_size;
+};
+
+} // namespace pixel_studies
@@ -3,11 +3,26 @@ This file is part of https://github.com/kandrosov/OnChipDataCompression. */
 
 #pragma once
 
+#include <array>
+#include <cstring>
+#include <initializer_list>
 #include <vector>
+#include "BitPacking.h"
 #include "exception.h"
 
 namespace pixel_studies {
 
+/// Kind of the information stored in a package field. It is used only to account the package bits.
+enum class FieldCategory { Unspecified, Address, RegionId, Adc, Escape, RawFallback, Trailer, Index, Padding };
+
+inline const std::string& FieldCategoryName(FieldCategory category)
+{
+    static const std::array<std::string, static_cast<size_t>(FieldCategory::Padding) + 1> names = { {
+        "Unspecified", "Address", "RegionId", "Adc", "Escape", "RawFallback", "Trailer", "Index", "Padding"
+    } };
+    return names.at(static_cast<size_t>(category));
+}
+
 struct Package {
     using Integer = uint64_t;
     using DataContainer = std::vector<uint8_t>;
@@ -15,15 +30,23 @@ struct Package {
     static constexpr size_t BitsPerByte = std::numeric_limits<uint8_t>::digits;
     static constexpr size_t BitsPerItem = std::numeric_limits<DataContainer::value_type>::digits;
     static constexpr size_t BitsPerInteger = std::numeric_limits<Integer>::digits;
+    static constexpr size_t NumberOfFieldCategories = static_cast<size_t>(FieldCategory::Padding) + 1;
+    static constexpr size_t MaxPeekBits = BitsPerInteger - BitsPerItem + 1;
 
     class iterator {
     public:
         explicit iterator(const Package& _package, size_t _position = 0) : package(&_package), pos(_position) {}
         Integer read(size_t number_of_bits_requested, bool use_zeros_for_missing_data = false);
         Integer read_ex(size_t number_of_bits_requested, bool use_zeros_for_missing_data = false);
+        /// Reads n_values values of number_of_bits bits. The result is the same as calling read for each value.
+        void read_bulk(Integer* values, size_t n_values, size_t number_of_bits);
+        /// Returns the next number_of_bits bits as read would do, without moving the iterator. The bits after the end
+        /// of the package are returned as zeros. The number of bits should not exceed MaxPeekBits.
+        Integer peek(size_t number_of_bits) const;
         size_t position() const { return pos; }
         size_t item_position() const { return position() / BitsPerItem; }
         size_t shift() const { return position() % BitsPerItem; }
+        size_t bits_left() const { return package->end().position() - position(); }
 
         void check() const
         {
@@ -59,67 +82,88 @@ struct Package {
     };
 
     using PositionCollection = std::vector<size_t>;
+    using FieldSizeCollection = std::array<size_t, NumberOfFieldCategories>;
 
-    Package() : begin_iter(*this), end_iter(*this) {}
+    /// Description of a field inside the values written by write_bulk.
+    struct FieldFormat {
+        size_t number_of_bits;
+        FieldCategory category;
+    };
+
+    Package() : begin_iter(*this), end_iter(*this) { field_size_collection.fill(0); }
+    /// Creates a package from the bytes of another package, e.g. stored in a file.
+    Package(const uint8_t* bytes, size_t n_bits, const PositionCollection& readout_positions,
+            const FieldSizeCollection& field_sizes)
+        : data(bytes, bytes + (n_bits + BitsPerItem - 1) / BitsPerItem), begin_iter(*this), end_iter(*this, n_bits),
+          readout_position_collection(readout_positions), field_size_collection(field_sizes) {}
     Package(const Package& other)
         : data(other.data), begin_iter(*this, other.begin_iter.position()),
-          end_iter(*this, other.end_iter.position()) {}
+          end_iter(*this, other.end_iter.position()),
+          readout_position_collection(other.readout_position_collection),
+          field_size_collection(other.field_size_collection) {}
 
     DataContainer& container() { return data; }
     const DataContainer& container() const { return data; }
     const PositionCollection& readout_positions() const { return readout_position_collection; }
 
+    /// Returns number of bits written for each field category.
+    const FieldSizeCollection& field_sizes() const { return field_size_collection; }
+    size_t field_size(FieldCategory category) const { return field_size_collection.at(static_cast<size_t>(category)); }
+
     /// Returns full package size in bits.
     size_t size() const { return end_iter.position(); }
     const iterator& begin() const { return begin_iter; }
     const iterator& end() const { return end_iter; }
 
-    void write(Integer value, size_t number_of_bits)
+    void write(Integer value, size_t number_of_bits, FieldCategory category = FieldCategory::Unspecified)
     {
-        if(number_of_bits > BitsPerInteger)
-            throw exception("Number of bits is too big.");
-        else if(number_of_bits < BitsPerInteger) {
-            const Integer max_input_value = (Integer(1) << number_of_bits) - 1;
-            if(value > max_input_value)
-                throw exception("Input value = %1% is too big. Max value for n_bits = %2% is %3%.")
-                        % value % number_of_bits % max_input_value;
-        }
-        for(size_t n = 0; n < number_of_bits; ++n) {
-            const size_t shift = number_of_bits - n - 1;
-            const Integer bit = (value >> shift) & Integer(1);
-            write_ex(bit, 1);
-        }
+        CheckInputValue(value, number_of_bits);
+        append(value, number_of_bits);
+        field_size_collection[static_cast<size_t>(category)] += number_of_bits;
     }
 
-    void write_ex(Integer value, size_t number_of_bits)
+    void write_ex(Integer value, size_t number_of_bits, FieldCategory category = FieldCategory::Unspecified)
     {
-        if(number_of_bits > BitsPerInteger)
-            throw exception("Number of bits is too big.");
-        else if(number_of_bits < BitsPerInteger) {
-            const Integer max_input_value = (Integer(1) << number_of_bits) - 1;
-            if(value > max_input_value)
-                throw exception("Input value = %1% is too big. Max value for n_bits = %2% is %3%.")
-                        % value % number_of_bits % max_input_value;
-        }
+        CheckInputValue(value, number_of_bits);
+        append_ex(value, number_of_bits);
+        field_size_collection[static_cast<size_t>(category)] += number_of_bits;
+    }
 
-        size_t n_written = 0;
-        while(n_written < number_of_bits) {
-            const size_t current_shift = end_iter.shift();
+    /// Writes n_values values of number_of_bits bits. The result is the same as calling write for each value.
+    void write_bulk(const Integer* values, size_t n_values, size_t number_of_bits,
+                    FieldCategory category = FieldCategory::Unspecified)
+    {
+        write_bulk(values, n_values, { FieldFormat{ number_of_bits, category } });
+    }
 
-            if(!current_shift)
-                data.push_back(0);
-            const size_t delta = number_of_bits - n_written;
-            const size_t n_to_write = std::min(BitsPerItem - current_shift, delta);
-            const Integer mask = Mask(n_to_write);
-            const Integer masked_value = (value >> n_written) & mask;
-            const Integer max_to_write = (Integer(1) << n_to_write) - 1;
-            if(masked_value > max_to_write)
-                throw exception("shifted value is too big");
-            const Integer value_to_write = masked_value << current_shift;
-            data.back() |= value_to_write;
-            n_written += n_to_write;
-            end_iter += n_to_write;
+    /// Writes n_values values, each of them is a concatenation of the fields, the first field in the most
+    /// significant bits. The result is the same as calling write for each field of each value.
+    void write_bulk(const Integer* values, size_t n_values, std::initializer_list<FieldFormat> fields)
+    {
+        static constexpr size_t chunk_size = 256;
+
+        size_t number_of_bits = 0;
+        for(const FieldFormat& field : fields)
+            number_of_bits += field.number_of_bits;
+        Integer all_values = 0;
+        for(size_t n = 0; n < n_values; ++n)
+            all_values |= values[n];
+        if(number_of_bits > BitsPerInteger || all_values > Mask(number_of_bits)) {
+            for(size_t n = 0; n < n_values; ++n)
+                CheckInputValue(values[n], number_of_bits);
+        }
+
+        data.resize((end_iter.position() + n_values * number_of_bits + BitsPerItem - 1) / BitsPerItem, 0);
+        Integer chunk[chunk_size];
+        for(size_t first = 0; first < n_values; first += chunk_size) {
+            const size_t n_chunk_values = std::min(chunk_size, n_values - first);
+            std::copy(values + first, values + first + n_chunk_values, chunk);
+            bit_packing::ReverseBits(chunk, n_chunk_values, number_of_bits);
+            bit_packing::PackLsbFirst(chunk, n_chunk_values, number_of_bits, data.data(), end_iter.position());
+            end_iter += n_chunk_values * number_of_bits;
         }
+        for(const FieldFormat& field : fields)
+            field_size_collection[static_cast<size_t>(field.category)] += n_values * field.number_of_bits;
     }
 
     void write(const Package& other)
@@ -127,15 +171,17 @@ struct Package {
         for(iterator iter = other.begin(); iter != other.end();) {
             const size_t n_to_read = std::min(size_t(BitsPerInteger), other.end() - iter);
             const Integer value = iter.read(n_to_read, false);
-            write(value, n_to_read);
+            append(value, n_to_read);
         }
+        for(size_t n = 0; n < NumberOfFieldCategories; ++n)
+            field_size_collection[n] += other.field_size_collection[n];
     }
 
     void finalize_byte()
     {
         const size_t n_written = end_iter.position() % BitsPerByte;
         const size_t n_to_write = n_written ? BitsPerByte - n_written : 0;
-        write(0, n_to_write);
+        write(0, n_to_write, FieldCategory::Padding);
     }
 
     void next_readout_cicle() { readout_position_collection.push_back(end().position()); }
@@ -157,13 +203,65 @@ struct Package {
                 : (Integer(1) << n_bits) - 1;
     }
 
+    /// Appends the field to the lowest bits of the value, as it would be written by write after the value.
+    static Integer AppendField(Integer value, Integer field, size_t number_of_bits)
+    {
+        CheckInputValue(field, number_of_bits);
+        return number_of_bits == BitsPerInteger ? field : (value << number_of_bits) | field;
+    }
+
+private:
+    static void CheckInputValue(Integer value, size_t number_of_bits)
+    {
+        if(number_of_bits > BitsPerInteger)
+            throw exception("Number of bits is too big.");
+        else if(number_of_bits < BitsPerInteger) {
+            const Integer max_input_value = (Integer(1) << number_of_bits) - 1;
+            if(value > max_input_value)
+                throw exception("Input value = %1% is too big. Max value for n_bits = %2% is %3%.")
+                        % value % number_of_bits % max_input_value;
+        }
+    }
+
+    void append(Integer value, size_t number_of_bits)
+    {
+        for(size_t n = 0; n < number_of_bits; ++n) {
+            const size_t shift = number_of_bits - n - 1;
+            const Integer bit = (value >> shift) & Integer(1);
+            append_ex(bit, 1);
+        }
+    }
+
+    void append_ex(Integer value, size_t number_of_bits)
+    {
+        size_t n_written = 0;
+        while(n_written < number_of_bits) {
+            const size_t current_shift = end_iter.shift();
+
+            if(!current_shift)
+                data.push_back(0);
+            const size_t delta = number_of_bits - n_written;
+            const size_t n_to_write = std::min(BitsPerItem - current_shift, delta);
+            const Integer mask = Mask(n_to_write);
+            const Integer masked_value = (value >> n_written) & mask;
+            const Integer max_to_write = (Integer(1) << n_to_write) - 1;
+            if(masked_value > max_to_write)
+                throw exception("shifted value is too big");
+            const Integer value_to_write = masked_value << current_shift;
+            data.back() |= value_to_write;
+            n_written += n_to_write;
+            end_iter += n_to_write;
+        }
+    }
+
 private:
     DataContainer data;
     iterator begin_iter, end_iter;
     PositionCollection readout_position_collection;
+    FieldSizeCollection field_size_collection;
 };
 
-Package::Integer Package::iterator::read(size_t number_of_bits_requested, bool use_zeros_for_missing_data)
+inline Package::Integer Package::iterator::read(size_t number_of_bits_requested, bool use_zeros_for_missing_data)
 {
     if(number_of_bits_requested > std::numeric_limits<Integer>::digits)
         throw exception("Number of bits to read is too big.");
@@ -182,7 +280,7 @@ Package::Integer Package::iterator::read(size_t number_of_bits_requested, bool u
     return result;
 }
 
-Package::Integer Package::iterator::read_ex(size_t number_of_bits_requested, bool use_zeros_for_missing_data)
+inline Package::Integer Package::iterator::read_ex(size_t number_of_bits_requested, bool use_zeros_for_missing_data)
 {
     if(number_of_bits_requested > std::numeric_limits<Integer>::digits)
         throw exception("Number of bits to read is too big.");
@@ -210,4 +308,47 @@ Package::Integer Package::iterator::read_ex(size_t number_of_bits_requested, boo
     return result;
 }
 
+inline Package::Integer Package::iterator::peek(size_t number_of_bits) const
+{
+    if(number_of_bits > MaxPeekBits)
+        throw exception("Number of bits to peek is too big.");
+    if(!number_of_bits) return 0;
+    const size_t end_position = package->end().position();
+    if(position() >= end_position) return 0;
+
+    const DataContainer& data = package->container();
+    const size_t first_item = item_position();
+    Integer window = 0;
+    if(first_item + sizeof(Integer) <= data.size()) {
+        std::memcpy(&window, data.data() + first_item, sizeof(Integer));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+        window = __builtin_bswap64(window);
+#endif
+    } else {
+        for(size_t n = first_item; n < data.size(); ++n)
+            window |= Integer(data[n]) << ((n - first_item) * BitsPerItem);
+    }
+    window >>= shift();
+    const size_t bits_left = end_position - position();
+    if(bits_left < number_of_bits)
+        window &= Mask(bits_left);
+    return bit_packing::ReverseBits(window & Mask(number_of_bits), number_of_bits);
+}
+
+inline void Package::iterator::read_bulk(Integer* values, size_t n_values, size_t number_of_bits)
+{
+    if(number_of_bits > std::numeric_limits<Integer>::digits)
+        throw exception("Number of bits to read is too big.");
+    const size_t bits_left = package->end().position() - position();
+    const size_t number_of_bits_requested = n_values * number_of_bits;
+    if(number_of_bits_requested > bits_left)
+        throw exception("No enough data in the package to perform read operation."
+            " Number of bits requested = %1%, number of bits left = %2%.") % number_of_bits_requested % bits_left;
+
+    const DataContainer& data = package->container();
+    bit_packing::UnpackLsbFirst(data.data(), data.size(), position(), number_of_bits, values, n_values);
+    bit_packing::ReverseBits(values, n_values, number_of_bits);
+    pos += number_of_bits_requested;
+}
+
 } // namespace pixel_studies
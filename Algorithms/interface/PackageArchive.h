@@ -0,0 +1,115 @@
+/*! Classes to write and read archives of encoded packages.
+The archive is a binary little-endian file:
+    header: magic "PXPKGARC", uint32 version, uint32 number of field categories;
+    packages: for each package, the package bytes, padded to 4 bytes, followed by the readout positions and the field
+              sizes as uint32 values;
+    index: for each package, uint32 run_id, lumi_id, uint64 event_id, uint32 module_id, chip_id, format_id, number of
+           readout positions, uint64 offset of the package bytes and uint64 package size in bits;
+    formats: uint32 number of formats, followed by the format names as uint32 length and characters;
+    footer: uint64 offsets of the index and of the formats, uint64 number of packages and magic "PXPKGARC".
+The reader maps the file into memory, so the packages are accessed without copying them.
+This file is part of https://github.com/kandrosov/OnChipDataCompression. */
+
+#pragma once
+
+#include <fstream>
+#include <mutex>
+#include "Package.h"
+
+namespace pixel_studies {
+
+struct PackageArchiveEntry {
+    uint32_t run_id, lumi_id;
+    uint64_t event_id;
+    uint32_t module_id, chip_id, format_id, n_readout_positions;
+    uint64_t data_offset, n_bits;
+
+    PackageArchiveEntry() : run_id(0), lumi_id(0), event_id(0), module_id(0), chip_id(0), format_id(0),
+        n_readout_positions(0), data_offset(0), n_bits(0) {}
+};
+
+/// Package stored in the archive. The view is valid as long as the reader that created it exists.
+struct PackageView {
+    const uint8_t* data;
+    size_t n_bits;
+    const uint32_t* readout_positions;
+    size_t n_readout_positions;
+    const uint32_t* field_sizes;
+    size_t n_field_categories;
+
+    size_t size() const { return n_bits; }
+    size_t field_size(FieldCategory category) const;
+    /// Copies the package, as required by the package makers.
+    Package ToPackage() const;
+};
+
+class PackageArchiveWriter {
+public:
+    static constexpr uint32_t Version = 2;
+
+    explicit PackageArchiveWriter(const std::string& _file_name);
+    PackageArchiveWriter(const PackageArchiveWriter&) = delete;
+    PackageArchiveWriter& operator=(const PackageArchiveWriter&) = delete;
+    ~PackageArchiveWriter();
+
+    /// Appends the package to the archive. The method can be called concurrently from several threads.
+    void WritePackage(const std::string& format, uint32_t run_id, uint32_t lumi_id, uint64_t event_id,
+                      uint32_t module_id, uint32_t chip_id, const Package& package);
+    /// Writes the index and closes the file. Without Close, the archive is closed by the destructor.
+    void Close();
+
+private:
+    template<typename Value>
+    void WriteValue(const Value& value);
+    void WriteBytes(const void* bytes, size_t n_bytes);
+    void WritePadding(size_t alignment);
+
+private:
+    const std::string file_name;
+    std::ofstream file;
+    std::mutex mutex;
+    uint64_t offset;
+    bool is_open;
+    std::vector<PackageArchiveEntry> entries;
+    std::vector<std::string> formats;
+};
+
+class PackageArchiveReader {
+public:
+    static constexpr size_t NotFound = std::numeric_limits<size_t>::max();
+
+    explicit PackageArchiveReader(const std::string& _file_name);
+    PackageArchiveReader(const PackageArchiveReader&) = delete;
+    PackageArchiveReader& operator=(const PackageArchiveReader&) = delete;
+    ~PackageArchiveReader();
+
+    size_t size() const { return entries.size(); }
+    const std::vector<std::string>& GetFormats() const { return formats; }
+    /// Returns NotFound if the format is not present in the archive.
+    size_t GetFormatId(const std::string& format) const;
+    const PackageArchiveEntry& GetEntry(size_t entry_id) const { return entries.at(entry_id); }
+    PackageView GetPackage(size_t entry_id) const;
+
+    /// Returns id of the entry for the given chip or NotFound.
+    size_t FindEntry(const std::string& format, uint32_t run_id, uint32_t lumi_id, uint64_t event_id,
+                     uint32_t module_id, uint32_t chip_id) const;
+    /// Returns ids of all entries of the format in the order of (run_id, lumi_id, event_id, module_id, chip_id).
+    std::vector<size_t> SelectEntries(const std::string& format) const;
+
+private:
+    static bool EntryLess(const PackageArchiveEntry& first, const PackageArchiveEntry& second);
+    template<typename Value>
+    Value ReadValue(uint64_t& position) const;
+    void CheckRange(uint64_t position, uint64_t n_bytes) const;
+
+private:
+    const std::string file_name;
+    const uint8_t* mapped_data;
+    size_t file_size;
+    uint32_t n_field_categories;
+    std::vector<PackageArchiveEntry> entries;
+    std::vector<std::string> formats;
+    std::vector<size_t> sorted_entries;
+};
+
+} // namespace pixel_studies
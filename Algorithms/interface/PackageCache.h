@@ -0,0 +1,55 @@
+/*! Memoisation cache of the encoded packages indexed by the chip layout and content.
+The cache is useful when identical chips are encoded repeatedly, e.g. in overlays or parameter sweeps. The content of
+the cached chip and its layout are compared in addition to the hash, so hash collisions do not produce wrong packages: a colliding chip
+replaces the cached one. When the cache is full, the oldest entry is removed.
+This file is part of https://github.com/kandrosov/OnChipDataCompression. */
+
+#pragma once
+
+#include <deque>
+#include <mutex>
+#include <unordered_map>
+#include "Chip.h"
+#include "Package.h"
+
+namespace pixel_studies {
+
+class PackageCache {
+public:
+    using PackagePtr = std::shared_ptr<const Package>;
+
+    explicit PackageCache(size_t _max_size);
+
+    static uint64_t Hash(const Chip& chip);
+
+    /// Returns the cached package for the chip or nullptr. The method can be called concurrently from several threads.
+    PackagePtr Find(uint64_t hash, const Chip& chip) const;
+    /// Adds the package of the chip. The method can be called concurrently from several threads.
+    void Insert(uint64_t hash, const Chip& chip, const Package& package);
+
+    size_t GetMaxSize() const { return max_size; }
+    size_t size() const;
+    size_t GetNumberOfHits() const;
+    size_t GetNumberOfMisses() const;
+
+private:
+    struct Entry {
+        MultiRegionLayout layout;
+        PixelWithAdcVector pixels;
+        PackagePtr package;
+
+        explicit Entry(const MultiRegionLayout& _layout) : layout(_layout) {}
+    };
+
+    static bool HasSameLayout(const MultiRegionLayout& first, const MultiRegionLayout& second);
+    static bool HasSamePixels(const Entry& entry, const Chip& chip);
+
+private:
+    const size_t max_size;
+    mutable std::mutex mutex;
+    std::unordered_map<uint64_t, Entry> entries;
+    std::deque<uint64_t> insertion_order;
+    mutable size_t n_hits, n_misses;
+};
+
+} // namespace pixel_studies
@@ -4,11 +4,36 @@ This file is part of https://github.com/kandrosov/OnChipDataCompression. */
 #pragma once
 
 #include <cmath>
+#include <exception>
+#include <thread>
 #include "Chip.h"
 #include "Package.h"
 
 namespace pixel_studies {
 
+/// Outputs of the package decoding. The package makers decode the parts of the pixel data that the output reads, so
+/// partial outputs skip the construction of the chip and of the unused values.
+struct ChipDecodingOutput {
+    static constexpr bool ReadsAddresses = true, ReadsAdcs = true;
+    Chip& chip;
+    void Reserve(size_t) {}
+    void Add(const Pixel& pixel, Adc adc) { chip.AddPixel(pixel, adc); }
+};
+
+struct AddressDecodingOutput {
+    static constexpr bool ReadsAddresses = true, ReadsAdcs = false;
+    PixelVector& pixels;
+    void Reserve(size_t n_pixels) { pixels.reserve(n_pixels); }
+    void Add(const Pixel& pixel, Adc) { pixels.push_back(pixel); }
+};
+
+struct AdcDecodingOutput {
+    static constexpr bool ReadsAddresses = false, ReadsAdcs = true;
+    AdcVector& adcs;
+    void Reserve(size_t n_pixels) { adcs.reserve(n_pixels); }
+    void Add(const Pixel&, Adc adc) { adcs.push_back(adc); }
+};
+
 class PackageMaker {
 public:
     PackageMaker(size_t _n_bits_per_adc) : n_bits_per_adc(_n_bits_per_adc) {}
@@ -17,40 +42,180 @@ public:
     virtual Chip Read(const Package& package, const MultiRegionLayout& layout) const = 0;
     virtual ~PackageMaker() {}
 
+    /// Decodes only the addresses of the hit pixels. The order of the pixels depends on the package maker.
+    virtual PixelVector ReadAddresses(const Package& package, const MultiRegionLayout& layout) const
+    {
+        PixelVector pixels;
+        for(const auto& pixel_with_adc : Read(package, layout).GetPixels())
+            pixels.push_back(pixel_with_adc.first);
+        return pixels;
+    }
+
+    /// Decodes only the ADC values of the hit pixels in the same order as the pixels returned by ReadAddresses.
+    virtual AdcVector ReadAdcs(const Package& package, const MultiRegionLayout& layout) const
+    {
+        AdcVector adcs;
+        for(const auto& pixel_with_adc : Read(package, layout).GetPixels())
+            adcs.push_back(pixel_with_adc.second);
+        return adcs;
+    }
+
+    /// Returns true if the packages contain an index of the macro regions, so each of them is decoded independently.
+    virtual bool HasRegionIndex() const { return false; }
+
+    /// Decodes pixels of a single macro region in the macro region coordinates. Without the region index, the whole
+    /// package is decoded.
+    virtual PixelRegion ReadRegion(const Package& package, const MultiRegionLayout& layout,
+                                   size_t macro_region_id) const
+    {
+        if(macro_region_id >= layout.GetNumberOfRegions())
+            throw exception("Invalid macro region id = %1%.") % macro_region_id;
+        const Chip chip = Read(package, layout);
+        if(!chip.IsRegionActive(macro_region_id))
+            return PixelRegion(layout.region_layout);
+        return chip.GetRegion(macro_region_id);
+    }
+
+    /// Minimal number of package bits decoded by each thread. The threads are started for each call and the decoded
+    /// regions are merged into the chip serially, so only the large packages are decoded faster in parallel.
+    static constexpr size_t MinBitsPerThread = 4096;
+
+    /// Decodes the macro regions in parallel using up to n_threads threads, if the packages have the region index.
+    /// The threads are started for each call, so their number is limited by the package size. Otherwise, or if only
+    /// one thread is left, it is equivalent to Read.
+    Chip ReadInParallel(const Package& package, const MultiRegionLayout& layout, size_t n_threads) const
+    {
+        const size_t n_macro_regions = layout.GetNumberOfRegions();
+        n_threads = std::min(std::min(n_threads, n_macro_regions), package.size() / MinBitsPerThread);
+        if(!HasRegionIndex() || n_threads <= 1)
+            return Read(package, layout);
+
+        std::vector<PixelRegion> regions(n_macro_regions, PixelRegion(layout.region_layout));
+        std::vector<std::exception_ptr> errors(n_threads);
+        const auto readRegions = [&](size_t thread_id) {
+            try {
+                for(size_t k = thread_id; k < n_macro_regions; k += n_threads)
+                    regions.at(k) = ReadRegion(package, layout, k);
+            } catch(...) {
+                errors.at(thread_id) = std::current_exception();
+            }
+        };
+        std::vector<std::thread> threads;
+        for(size_t thread_id = 1; thread_id < n_threads; ++thread_id)
+            threads.emplace_back(readRegions, thread_id);
+        readRegions(0);
+        for(auto& thread : threads)
+            thread.join();
+        for(const auto& error : errors) {
+            if(error)
+                std::rethrow_exception(error);
+        }
+
+        Chip chip(layout);
+        for(size_t k = 0; k < n_macro_regions; ++k) {
+            for(const auto& pixel_with_adc : regions.at(k).GetPixels()) {
+                Pixel pixel;
+                layout.ConvertFromRegionPixel(k, pixel_with_adc.first, pixel);
+                chip.AddPixel(pixel, pixel_with_adc.second);
+            }
+        }
+        return chip;
+    }
+
     const size_t n_bits_per_adc;
 };
 
-class RegionIterator {
+/// Round-robin scheduler of the pixels of several regions. The pixels of all regions are stored in a single array
+/// sorted by region, and each region is read through its own cursor. Each round takes the next pixel of every region
+/// that is not exhausted yet, and the exhausted regions are removed from the rotation.
+class RegionScheduler {
 public:
     static const PixelAdcPair& DefaultPixel() { static const PixelAdcPair pixel(Pixel(0, 0), 0); return pixel; }
-    explicit RegionIterator(const PixelWithAdcVector& _pixels) : pixels(_pixels), current_position(0) {}
 
-    size_t size() const { return pixels.size(); }
-    const PixelAdcPair& previous() const
+    RegionScheduler() : offsets(1, 0) {}
+
+    void Reserve(size_t n_regions, size_t n_pixels)
     {
-        if(!current_position) return DefaultPixel();
-        return pixels.at(current_position - 1);
+        offsets.reserve(n_regions + 1);
+        pixels.reserve(n_pixels);
     }
 
-    bool has_current() const { return current_position < pixels.size(); }
+    /// Appends the next region with the pixels in the order in which they should be scheduled.
+    template<typename Iterator>
+    void AddRegion(Iterator first, Iterator last)
+    {
+        pixels.insert(pixels.end(), first, last);
+        offsets.push_back(pixels.size());
+    }
 
-    const PixelAdcPair& current() const
+    /// Appends all regions of the layout with the pixels of the map in the chip coordinates. The pixels are bucketed by
+    /// region keeping the order of the map, which is also their order inside each region, so the chip is not split into
+    /// the regions.
+    void AddRegions(const PixelWithAdcMap& chip_pixels, const MultiRegionLayout& layout)
     {
-        if(!has_current())
-            throw exception("Pixel not available.");
-        return pixels.at(current_position);
+        const size_t n_regions = layout.GetNumberOfRegions();
+        std::vector<size_t> region_ids;
+        region_ids.reserve(chip_pixels.size());
+        std::vector<size_t> positions(n_regions + 1, 0);
+        for(const auto& pixel_with_adc : chip_pixels) {
+            size_t region_id;
+            Pixel region_pixel;
+            layout.ConvertToRegionPixel(pixel_with_adc.first, region_id, region_pixel);
+            region_ids.push_back(region_id);
+            ++positions[region_id + 1];
+        }
+        const size_t first = pixels.size();
+        for(size_t region_id = 0; region_id < n_regions; ++region_id) {
+            positions[region_id + 1] += positions[region_id];
+            offsets.push_back(first + positions[region_id + 1]);
+        }
+        pixels.resize(first + chip_pixels.size());
+        size_t n = 0;
+        for(const auto& pixel_with_adc : chip_pixels)
+            pixels[first + positions[region_ids[n++]]++] = pixel_with_adc;
+    }
+
+    size_t GetNumberOfRegions() const { return offsets.size() - 1; }
+    size_t GetRegionSize(size_t region_id) const { return offsets.at(region_id + 1) - offsets.at(region_id); }
+    size_t GetMaxRegionSize() const
+    {
+        size_t max_size = 0;
+        for(size_t region_id = 0; region_id < GetNumberOfRegions(); ++region_id)
+            max_size = std::max(max_size, GetRegionSize(region_id));
+        return max_size;
     }
 
-    void move_next()
+    /// Calls processPixel(region_id, pixel, previous_pixel) for each pixel in the round-robin order and endRound(round)
+    /// after each round. The previous pixel of the first pixel of a region is DefaultPixel().
+    template<typename ProcessPixel, typename EndRound>
+    void Run(ProcessPixel&& processPixel, EndRound&& endRound) const
     {
-        if(!has_current())
-            throw exception("Unable to move to the next pixel.");
-        ++current_position;
+        std::vector<size_t> positions(offsets.begin(), offsets.end() - 1);
+        std::vector<size_t> active_regions;
+        active_regions.reserve(GetNumberOfRegions());
+        for(size_t region_id = 0; region_id < GetNumberOfRegions(); ++region_id) {
+            if(offsets[region_id + 1] != offsets[region_id])
+                active_regions.push_back(region_id);
+        }
+
+        for(size_t round = 0; !active_regions.empty(); ++round) {
+            size_t n_active = 0;
+            for(size_t n = 0; n < active_regions.size(); ++n) {
+                const size_t region_id = active_regions[n];
+                size_t& position = positions[region_id];
+                processPixel(region_id, pixels[position],
+                             position == offsets[region_id] ? DefaultPixel() : pixels[position - 1]);
+                if(++position != offsets[region_id + 1])
+                    active_regions[n_active++] = region_id;
+            }
+            active_regions.resize(n_active);
+            endRound(round);
+        }
     }
 
 private:
     PixelWithAdcVector pixels;
-    size_t current_position;
+    std::vector<size_t> offsets;
 };
 
 class DefaultPackageMaker : public PackageMaker {
@@ -61,59 +226,75 @@ public:
 
     virtual Package Make(const Chip& chip) const override
     {
-        using RegionIteratorCollection = std::list<RegionIterator>;
         Package package;
-        size_t max_size = 0;
         const auto& multi_layout = chip.GetMultiRegionLayout();
-        const size_t n_macro_regions = multi_layout.GetNumberOfRegions();
         const size_t n_bits_per_pixel_id = multi_layout.BitsPerId();
-        RegionIteratorCollection region_iterators;
-
-        for(size_t macro_region_id = 0; macro_region_id < n_macro_regions; ++macro_region_id) {
-            PixelWithAdcVector pixels = {};
-            if(chip.IsRegionActive(macro_region_id)) {
-                const auto& region_pixels = chip.GetRegion(macro_region_id).GetPixels();
-                for(const auto& pixel_with_adc : region_pixels) {
-                    Pixel global_pixel;
-                    multi_layout.ConvertFromRegionPixel(macro_region_id, pixel_with_adc.first, global_pixel);
-                    pixels.push_back(PixelAdcPair(global_pixel, pixel_with_adc.second));
-                }
-            }
-            region_iterators.push_back(RegionIterator(pixels));
-            max_size = std::max(max_size, region_iterators.back().size());
-        }
+        RegionScheduler scheduler;
+        scheduler.Reserve(multi_layout.GetNumberOfRegions(), chip.GetPixels().size());
+        scheduler.AddRegions(chip.GetPixels(), multi_layout);
+        const size_t max_size = scheduler.GetMaxRegionSize();
+        std::vector<Package::Integer> items;
+        items.reserve(2 * scheduler.GetNumberOfRegions());
 
-        for(size_t n = 0; n < max_size; ++n) {
-            for(RegionIterator& region_iter : region_iterators) {
-                if(!region_iter.has_current()) continue;
-                const Pixel& pixel = region_iter.current().first;
-                const Adc& adc = region_iter.current().second;
-                const size_t pixel_id = multi_layout.GetPixelId(pixel);
-                package.write(pixel_id, n_bits_per_pixel_id);
-                package.write(adc, n_bits_per_adc);
-                region_iter.move_next();
-            }
-            if((n+1) % 2 == 0 || (n+1) == max_size)
+        scheduler.Run([&](size_t, const PixelAdcPair& pixel_with_adc, const PixelAdcPair&) {
+            const size_t pixel_id = multi_layout.GetPixelId(pixel_with_adc.first);
+            items.push_back(Package::AppendField(pixel_id, pixel_with_adc.second, n_bits_per_adc));
+        }, [&](size_t n) {
+            if((n+1) % 2 == 0 || (n+1) == max_size) {
+                package.write_bulk(items.data(), items.size(), { { n_bits_per_pixel_id, FieldCategory::Address },
+                                                                 { n_bits_per_adc, FieldCategory::Adc } });
+                items.clear();
                 package.next_readout_cicle();
-        }
+            }
+        });
 
         return package;
     }
 
     virtual Chip Read(const Package &package, const MultiRegionLayout& layout) const override
     {
-        const size_t n_bits_per_pixel_id = layout.BitsPerId();
-
         Chip chip(layout);
+        ChipDecodingOutput output{ chip };
+        ReadItems(package, layout, output);
+        return chip;
+    }
 
-        for(Package::iterator iter = package.begin(); iter != package.end();) {
-            const size_t pixel_id = iter.read(n_bits_per_pixel_id);
-            const Adc adc = iter.read(n_bits_per_adc);
-            const Pixel pixel = layout.GetPixel(pixel_id);
-            chip.AddPixel(pixel, adc);
-        }
+    virtual PixelVector ReadAddresses(const Package& package, const MultiRegionLayout& layout) const override
+    {
+        PixelVector pixels;
+        AddressDecodingOutput output{ pixels };
+        ReadItems(package, layout, output);
+        return pixels;
+    }
 
-        return chip;
+    virtual AdcVector ReadAdcs(const Package& package, const MultiRegionLayout& layout) const override
+    {
+        AdcVector adcs;
+        AdcDecodingOutput output{ adcs };
+        ReadItems(package, layout, output);
+        return adcs;
+    }
+
+private:
+    template<typename Output>
+    void ReadItems(const Package &package, const MultiRegionLayout& layout, Output& output) const
+    {
+        const size_t n_bits_per_pixel_id = layout.BitsPerId();
+        const size_t n_bits_per_item = n_bits_per_pixel_id + n_bits_per_adc;
+        if(package.size() % n_bits_per_item)
+            throw exception("Package size = %1% is not a multiple of the item size = %2%.")
+                % package.size() % n_bits_per_item;
+
+        std::vector<Package::Integer> items(package.size() / n_bits_per_item);
+        Package::iterator iter = package.begin();
+        iter.read_bulk(items.data(), items.size(), n_bits_per_item);
+        const Package::Integer adc_mask = Package::Mask(n_bits_per_adc);
+        output.Reserve(items.size());
+        for(Package::Integer item : items) {
+            const Pixel pixel = Output::ReadsAddresses ? layout.GetPixel(item >> n_bits_per_adc) : Pixel();
+            const Adc adc = Output::ReadsAdcs ? item & adc_mask : 0;
+            output.Add(pixel, adc);
+        }
     }
 };
 
@@ -42,6 +42,8 @@ struct Position {
 
 using Pixel = Position<RawCoordinate>;
 using PixelSet = std::set<Pixel>;
+using PixelVector = std::vector<Pixel>;
+using AdcVector = std::vector<Adc>;
 using PixelAdcPair = std::pair<Pixel, Adc>;
 using PixelWithAdcVector = std::vector<PixelAdcPair>;
 using PixelWithAdcMap = std::map<Pixel, Adc>;
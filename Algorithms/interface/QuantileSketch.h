@@ -0,0 +1,141 @@
+/*! Mergeable streaming quantile sketch with bounded relative error.
+Positive values are counted in logarithmic buckets (gamma^(k-1), gamma^k] with gamma = (1 + a) / (1 - a), where a is
+the relative accuracy, so the range is not limited and any quantile is estimated with relative error not larger than a.
+Zeros are counted separately. Two sketches with the same accuracy are merged by adding their bucket counts.
+This file is part of https://github.com/kandrosov/OnChipDataCompression. */
+
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <vector>
+#include "exception.h"
+
+namespace pixel_studies {
+
+class QuantileSketch {
+public:
+    using Count = uint64_t;
+    using Key = int;
+    using BucketCollection = std::vector<Count>;
+
+    static constexpr double DefaultRelativeAccuracy = 1e-3;
+
+    explicit QuantileSketch(double _relative_accuracy = DefaultRelativeAccuracy) :
+        relative_accuracy(_relative_accuracy), gamma((1 + relative_accuracy) / (1 - relative_accuracy)),
+        inverse_log_gamma(1. / std::log(gamma)), min_key(0), zero_count(0), count(0), sum(0),
+        min_value(std::numeric_limits<double>::infinity()), max_value(-std::numeric_limits<double>::infinity())
+    {
+        if(!(relative_accuracy > 0 && relative_accuracy < 1))
+            throw exception("Invalid relative accuracy = %1% for the quantile sketch.") % relative_accuracy;
+    }
+
+    double GetRelativeAccuracy() const { return relative_accuracy; }
+    Count GetCount() const { return count; }
+    double GetSum() const { return sum; }
+    double GetMean() const { return count ? sum / count : 0; }
+    double GetMin() const { return min_value; }
+    double GetMax() const { return max_value; }
+    size_t GetNumberOfBuckets() const { return buckets.size(); }
+
+    void Add(double value, Count n = 1)
+    {
+        if(!(value >= 0))
+            throw exception("Quantile sketch supports only non-negative values. Value = %1%.") % value;
+        if(!n) return;
+        if(value < MinIndexableValue())
+            zero_count += n;
+        else
+            GetBucket(GetKey(value)) += n;
+        count += n;
+        sum += value * n;
+        min_value = std::min(min_value, value);
+        max_value = std::max(max_value, value);
+    }
+
+    void Merge(const QuantileSketch& other)
+    {
+        if(other.relative_accuracy != relative_accuracy)
+            throw exception("Unable to merge quantile sketches with different relative accuracies.");
+        if(!other.count) return;
+        if(other.buckets.size()) {
+            GetBucket(other.min_key);
+            GetBucket(other.min_key + static_cast<Key>(other.buckets.size()) - 1);
+            for(size_t n = 0; n < other.buckets.size(); ++n)
+                buckets[other.min_key - min_key + n] += other.buckets[n];
+        }
+        zero_count += other.zero_count;
+        count += other.count;
+        sum += other.sum;
+        min_value = std::min(min_value, other.min_value);
+        max_value = std::max(max_value, other.max_value);
+    }
+
+    /// Returns an estimate of the q-quantile with the relative error not larger than the relative accuracy.
+    double Quantile(double q) const
+    {
+        Key key;
+        if(!FindBucket(q, key)) return 0;
+        const double value = 2 * std::pow(gamma, key) / (gamma + 1);
+        return std::max(min_value, std::min(max_value, value));
+    }
+
+    /// Returns a value that is not smaller than the q-quantile: the upper edge of the bucket that contains it.
+    double UpperBound(double q) const
+    {
+        Key key;
+        if(!FindBucket(q, key)) return 0;
+        return std::min(max_value, std::pow(gamma, key));
+    }
+
+private:
+    static constexpr double MinIndexableValue() { return 1e-9; }
+
+    Key GetKey(double value) const { return static_cast<Key>(std::ceil(std::log(value) * inverse_log_gamma)); }
+
+    Count& GetBucket(Key key)
+    {
+        if(buckets.empty()) {
+            min_key = key;
+            buckets.push_back(0);
+        } else if(key < min_key) {
+            buckets.insert(buckets.begin(), static_cast<size_t>(min_key - key), 0);
+            min_key = key;
+        } else if(key - min_key >= static_cast<Key>(buckets.size())) {
+            buckets.resize(static_cast<size_t>(key - min_key) + 1, 0);
+        }
+        return buckets[key - min_key];
+    }
+
+    /// Finds the bucket that contains the element with the rank ceil(q * (count - 1)). Returns false for zeros.
+    bool FindBucket(double q, Key& key) const
+    {
+        if(!(q >= 0 && q <= 1))
+            throw exception("Invalid quantile = %1%.") % q;
+        if(!count)
+            throw exception("Unable to estimate quantile of an empty sketch.");
+        const Count rank = static_cast<Count>(std::ceil(q * (count - 1)));
+        Count n_below = zero_count;
+        if(rank < n_below) return false;
+        for(size_t n = 0; n < buckets.size(); ++n) {
+            n_below += buckets[n];
+            if(rank < n_below) {
+                key = min_key + static_cast<Key>(n);
+                return true;
+            }
+        }
+        key = min_key + static_cast<Key>(buckets.size()) - 1;
+        return true;
+    }
+
+private:
+    double relative_accuracy, gamma, inverse_log_gamma;
+    Key min_key;
+    BucketCollection buckets;
+    Count zero_count, count;
+    double sum, min_value, max_value;
+};
+
+} // namespace pixel_studies
@@ -0,0 +1,57 @@
+/*! Simple model of the chip readout link.
+Each readout cycle appends the bits written since the previous readout position to the output queue, while the link
+sends a fixed number of bits per clock cycle. The remaining queue is sent after the last readout cycle.
+This file is part of https://github.com/kandrosov/OnChipDataCompression. */
+
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+
+namespace pixel_studies {
+
+struct ReadoutLinkStatistics {
+    size_t n_clc, n_active_clc, max_queue_size;
+
+    ReadoutLinkStatistics() : n_clc(0), n_active_clc(0), max_queue_size(0) {}
+    size_t n_inactive_clc() const { return n_clc - n_active_clc; }
+};
+
+class ReadoutLinkModel {
+public:
+    static constexpr size_t DefaultBitsPerClc = 64;
+
+    explicit ReadoutLinkModel(size_t _bits_per_clc = DefaultBitsPerClc) : bits_per_clc(_bits_per_clc) {}
+
+    size_t GetBitsPerClc() const { return bits_per_clc; }
+
+    /// Simulates the readout of a package given its readout positions, e.g. Package::readout_positions.
+    template<typename PositionIterator>
+    ReadoutLinkStatistics Simulate(PositionIterator first, PositionIterator last) const
+    {
+        ReadoutLinkStatistics stat;
+        size_t queue_size = 0, prev_pos = 0;
+        for(; first != last; ++first) {
+            const size_t pos = *first;
+            queue_size += pos - prev_pos;
+            stat.max_queue_size = std::max(queue_size, stat.max_queue_size);
+            prev_pos = pos;
+            if(queue_size >= bits_per_clc) {
+                queue_size -= bits_per_clc;
+                ++stat.n_active_clc;
+            }
+            ++stat.n_clc;
+        }
+        while(queue_size) {
+            queue_size -= std::min(queue_size, bits_per_clc);
+            ++stat.n_clc;
+            ++stat.n_active_clc;
+        }
+        return stat;
+    }
+
+private:
+    size_t bits_per_clc;
+};
+
+} // namespace pixel_studies
@@ -0,0 +1,294 @@
+/*! Vectorised kernels used by the bulk read and write operations of the Package.
+This file is part of https://github.com/kandrosov/OnChipDataCompression. */
+
+#include <algorithm>
+#include <cstring>
+#include <map>
+#include "../interface/BitPacking.h"
+#include "../interface/exception.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define PIXEL_STUDIES_BIT_PACKING_X86
+#include <immintrin.h>
+#endif
+
+namespace pixel_studies {
+namespace bit_packing {
+
+namespace {
+
+inline uint64_t LoadLittleEndian(const uint8_t* buffer)
+{
+    uint64_t value;
+    std::memcpy(&value, buffer, sizeof(value));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    value = __builtin_bswap64(value);
+#endif
+    return value;
+}
+
+inline void StoreLittleEndian(uint8_t* buffer, uint64_t value)
+{
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    value = __builtin_bswap64(value);
+#endif
+    std::memcpy(buffer, &value, sizeof(value));
+}
+
+inline uint64_t LowBitsMask(size_t number_of_bits)
+{
+    return number_of_bits >= 64 ? ~uint64_t(0) : (uint64_t(1) << number_of_bits) - 1;
+}
+
+void ReverseBitsScalar(uint64_t* values, size_t n_values, size_t number_of_bits)
+{
+    for(size_t n = 0; n < n_values; ++n)
+        values[n] = ReverseBits(values[n], number_of_bits);
+}
+
+void UnpackUInt16Scalar(const uint64_t* words, size_t first_value, size_t n_values, size_t number_of_bits,
+                        uint16_t* values)
+{
+    const size_t values_per_word = 64 / number_of_bits;
+    const uint64_t mask = LowBitsMask(number_of_bits);
+    for(size_t n = 0; n < n_values; ++n) {
+        const size_t index = first_value + n;
+        const uint64_t word = words[index / values_per_word];
+        values[n] = static_cast<uint16_t>((word >> ((index % values_per_word) * number_of_bits)) & mask);
+    }
+}
+
+#ifdef PIXEL_STUDIES_BIT_PACKING_X86
+
+// Each byte is reversed with two lookups of the reversed nibbles, the bytes are reversed with a shuffle inside
+// each 64-bit lane and, finally, the lane is shifted right to drop the bits above number_of_bits.
+
+__attribute__((target("ssse3")))
+void ReverseBitsSSSE3(uint64_t* values, size_t n_values, size_t number_of_bits)
+{
+    const __m128i byte_order = _mm_setr_epi8(7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8);
+    const __m128i reversed_nibbles = _mm_setr_epi8(0x0, 0x8, 0x4, 0xC, 0x2, 0xA, 0x6, 0xE,
+                                                   0x1, 0x9, 0x5, 0xD, 0x3, 0xB, 0x7, 0xF);
+    const __m128i nibble_mask = _mm_set1_epi8(0x0F);
+    const __m128i shift = _mm_cvtsi32_si128(static_cast<int>(64 - number_of_bits));
+
+    size_t n = 0;
+    for(; n + 2 <= n_values; n += 2) {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(values + n));
+        v = _mm_shuffle_epi8(v, byte_order);
+        const __m128i low = _mm_shuffle_epi8(reversed_nibbles, _mm_and_si128(v, nibble_mask));
+        const __m128i high = _mm_shuffle_epi8(reversed_nibbles, _mm_and_si128(_mm_srli_epi16(v, 4), nibble_mask));
+        v = _mm_or_si128(_mm_slli_epi16(low, 4), high);
+        v = _mm_srl_epi64(v, shift);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(values + n), v);
+    }
+    ReverseBitsScalar(values + n, n_values - n, number_of_bits);
+}
+
+__attribute__((target("avx2")))
+void ReverseBitsAVX2(uint64_t* values, size_t n_values, size_t number_of_bits)
+{
+    const __m256i byte_order = _mm256_setr_epi8(7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8,
+                                                7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8);
+    const __m256i reversed_nibbles = _mm256_setr_epi8(0x0, 0x8, 0x4, 0xC, 0x2, 0xA, 0x6, 0xE,
+                                                      0x1, 0x9, 0x5, 0xD, 0x3, 0xB, 0x7, 0xF,
+                                                      0x0, 0x8, 0x4, 0xC, 0x2, 0xA, 0x6, 0xE,
+                                                      0x1, 0x9, 0x5, 0xD, 0x3, 0xB, 0x7, 0xF);
+    const __m256i nibble_mask = _mm256_set1_epi8(0x0F);
+    const __m128i shift = _mm_cvtsi32_si128(static_cast<int>(64 - number_of_bits));
+
+    size_t n = 0;
+    for(; n + 4 <= n_values; n += 4) {
+        __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(values + n));
+        v = _mm256_shuffle_epi8(v, byte_order);
+        const __m256i low = _mm256_shuffle_epi8(reversed_nibbles, _mm256_and_si256(v, nibble_mask));
+        const __m256i high = _mm256_shuffle_epi8(reversed_nibbles,
+                                                 _mm256_and_si256(_mm256_srli_epi16(v, 4), nibble_mask));
+        v = _mm256_or_si256(_mm256_slli_epi16(low, 4), high);
+        v = _mm256_srl_epi64(v, shift);
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(values + n), v);
+    }
+    ReverseBitsScalar(values + n, n_values - n, number_of_bits);
+}
+
+// The 4-bit values are split into the low and high nibbles of each byte, interleaved back into the original order
+// and zero-extended to 16 bits. The 8-bit values are only zero-extended.
+
+__attribute__((target("ssse3")))
+size_t UnpackUInt16SSSE3(const uint8_t* bytes, size_t n_values, size_t number_of_bits, uint16_t* values)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i nibble_mask = _mm_set1_epi8(0x0F);
+    size_t n = 0;
+    if(number_of_bits == 4) {
+        for(; n + 32 <= n_values; n += 32) {
+            const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(bytes + n / 2));
+            const __m128i low = _mm_and_si128(v, nibble_mask);
+            const __m128i high = _mm_and_si128(_mm_srli_epi16(v, 4), nibble_mask);
+            const __m128i first = _mm_unpacklo_epi8(low, high), second = _mm_unpackhi_epi8(low, high);
+            __m128i* output = reinterpret_cast<__m128i*>(values + n);
+            _mm_storeu_si128(output, _mm_unpacklo_epi8(first, zero));
+            _mm_storeu_si128(output + 1, _mm_unpackhi_epi8(first, zero));
+            _mm_storeu_si128(output + 2, _mm_unpacklo_epi8(second, zero));
+            _mm_storeu_si128(output + 3, _mm_unpackhi_epi8(second, zero));
+        }
+    } else if(number_of_bits == 8) {
+        for(; n + 16 <= n_values; n += 16) {
+            const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(bytes + n));
+            __m128i* output = reinterpret_cast<__m128i*>(values + n);
+            _mm_storeu_si128(output, _mm_unpacklo_epi8(v, zero));
+            _mm_storeu_si128(output + 1, _mm_unpackhi_epi8(v, zero));
+        }
+    }
+    return n;
+}
+
+__attribute__((target("avx2")))
+size_t UnpackUInt16AVX2(const uint8_t* bytes, size_t n_values, size_t number_of_bits, uint16_t* values)
+{
+    const __m128i nibble_mask = _mm_set1_epi8(0x0F);
+    size_t n = 0;
+    if(number_of_bits == 4) {
+        for(; n + 32 <= n_values; n += 32) {
+            const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(bytes + n / 2));
+            const __m128i low = _mm_and_si128(v, nibble_mask);
+            const __m128i high = _mm_and_si128(_mm_srli_epi16(v, 4), nibble_mask);
+            __m256i* output = reinterpret_cast<__m256i*>(values + n);
+            _mm256_storeu_si256(output, _mm256_cvtepu8_epi16(_mm_unpacklo_epi8(low, high)));
+            _mm256_storeu_si256(output + 1, _mm256_cvtepu8_epi16(_mm_unpackhi_epi8(low, high)));
+        }
+    } else if(number_of_bits == 8) {
+        for(; n + 16 <= n_values; n += 16) {
+            const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(bytes + n));
+            _mm256_storeu_si256(reinterpret_cast<__m256i*>(values + n), _mm256_cvtepu8_epi16(v));
+        }
+    }
+    return n;
+}
+
+#endif
+
+InstructionSet DetectInstructionSet()
+{
+#ifdef PIXEL_STUDIES_BIT_PACKING_X86
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx2"))
+        return InstructionSet::AVX2;
+    if(__builtin_cpu_supports("ssse3"))
+        return InstructionSet::SSSE3;
+#endif
+    return InstructionSet::Scalar;
+}
+
+} // anonymous namespace
+
+InstructionSet GetSupportedInstructionSet()
+{
+    static const InstructionSet instruction_set = DetectInstructionSet();
+    return instruction_set;
+}
+
+const std::string& InstructionSetName(InstructionSet instruction_set)
+{
+    static const std::map<InstructionSet, std::string> names = {
+        { InstructionSet::Scalar, "scalar" }, { InstructionSet::SSSE3, "ssse3" }, { InstructionSet::AVX2, "avx2" },
+    };
+    return names.at(instruction_set);
+}
+
+void ReverseBits(uint64_t* values, size_t n_values, size_t number_of_bits)
+{
+    ReverseBits(values, n_values, number_of_bits, GetSupportedInstructionSet());
+}
+
+void ReverseBits(uint64_t* values, size_t n_values, size_t number_of_bits, InstructionSet instruction_set)
+{
+    if(number_of_bits > 64)
+        throw exception("Number of bits = %1% is too big.") % number_of_bits;
+    if(static_cast<int>(instruction_set) > static_cast<int>(GetSupportedInstructionSet()))
+        throw exception("Instruction set '%1%' is not supported by the CPU.") % InstructionSetName(instruction_set);
+#ifdef PIXEL_STUDIES_BIT_PACKING_X86
+    if(instruction_set == InstructionSet::AVX2)
+        return ReverseBitsAVX2(values, n_values, number_of_bits);
+    if(instruction_set == InstructionSet::SSSE3)
+        return ReverseBitsSSSE3(values, n_values, number_of_bits);
+#endif
+    ReverseBitsScalar(values, n_values, number_of_bits);
+}
+
+void UnpackUInt16(const uint64_t* words, size_t first_value, size_t n_values, size_t number_of_bits,
+                  uint16_t* values)
+{
+    UnpackUInt16(words, first_value, n_values, number_of_bits, values, GetSupportedInstructionSet());
+}
+
+void UnpackUInt16(const uint64_t* words, size_t first_value, size_t n_values, size_t number_of_bits,
+                  uint16_t* values, InstructionSet instruction_set)
+{
+    if(number_of_bits != 1 && number_of_bits != 2 && number_of_bits != 4 && number_of_bits != 8
+            && number_of_bits != 16)
+        throw exception("Unsupported number of bits = %1% for the unpacking.") % number_of_bits;
+    if(static_cast<int>(instruction_set) > static_cast<int>(GetSupportedInstructionSet()))
+        throw exception("Instruction set '%1%' is not supported by the CPU.") % InstructionSetName(instruction_set);
+
+    size_t n_unpacked = 0;
+#if defined(PIXEL_STUDIES_BIT_PACKING_X86) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    if(instruction_set != InstructionSet::Scalar && (number_of_bits == 4 || number_of_bits == 8)) {
+        const size_t values_per_byte = 8 / number_of_bits;
+        n_unpacked = std::min(n_values, (values_per_byte - first_value % values_per_byte) % values_per_byte);
+        UnpackUInt16Scalar(words, first_value, n_unpacked, number_of_bits, values);
+        const uint8_t* bytes = reinterpret_cast<const uint8_t*>(words) + (first_value + n_unpacked) / values_per_byte;
+        if(instruction_set == InstructionSet::AVX2)
+            n_unpacked += UnpackUInt16AVX2(bytes, n_values - n_unpacked, number_of_bits, values + n_unpacked);
+        else
+            n_unpacked += UnpackUInt16SSSE3(bytes, n_values - n_unpacked, number_of_bits, values + n_unpacked);
+    }
+#endif
+    UnpackUInt16Scalar(words, first_value + n_unpacked, n_values - n_unpacked, number_of_bits, values + n_unpacked);
+}
+
+void PackLsbFirst(const uint64_t* values, size_t n_values, size_t number_of_bits, uint8_t* buffer,
+                  size_t bit_position)
+{
+    uint8_t* output = buffer + bit_position / 8;
+    size_t n_accumulated = bit_position % 8;
+    uint64_t accumulator = n_accumulated ? *output & LowBitsMask(n_accumulated) : 0;
+    for(size_t n = 0; n < n_values; ++n) {
+        const uint64_t value = values[n];
+        accumulator |= value << n_accumulated;
+        n_accumulated += number_of_bits;
+        if(n_accumulated >= 64) {
+            StoreLittleEndian(output, accumulator);
+            output += 8;
+            n_accumulated -= 64;
+            accumulator = n_accumulated ? value >> (number_of_bits - n_accumulated) : 0;
+        }
+    }
+    for(size_t k = 0; k < (n_accumulated + 7) / 8; ++k)
+        output[k] = static_cast<uint8_t>(accumulator >> (8 * k));
+}
+
+void UnpackLsbFirst(const uint8_t* buffer, size_t buffer_size, size_t bit_position, size_t number_of_bits,
+                    uint64_t* values, size_t n_values)
+{
+    const uint64_t mask = LowBitsMask(number_of_bits);
+    for(size_t n = 0; n < n_values; ++n, bit_position += number_of_bits) {
+        const size_t byte_position = bit_position / 8;
+        const size_t shift = bit_position % 8;
+        uint64_t word;
+        if(byte_position + 8 <= buffer_size) {
+            word = LoadLittleEndian(buffer + byte_position);
+        } else {
+            word = 0;
+            for(size_t k = 0; byte_position + k < buffer_size; ++k)
+                word |= uint64_t(buffer[byte_position + k]) << (8 * k);
+        }
+        uint64_t value = word >> shift;
+        if(shift + number_of_bits > 64)
+            value |= uint64_t(buffer[byte_position + 8]) << (64 - shift);
+        values[n] = value & mask;
+    }
+}
+
+} // namespace bit_packing
+} // namespace pixel_studies
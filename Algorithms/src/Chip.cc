@@ -1,8 +1,9 @@
 /*! The classes that define chip layout and content.
 This file is part of https://github.com/kandrosov/OnChipDataCompression. */
 
-#include <functional>
+#include <algorithm>
 #include "../interface/Chip.h"
+#include "../interface/Instrumentation.h"
 
 namespace pixel_studies {
 
@@ -152,6 +153,8 @@ PixelWithAdcVector PixelRegion::GetOrderedPixels(Ordering ordering) const
     };
     if(!orderers.count(ordering))
         throw exception("Unsupported ordering");
+    PIXEL_STUDIES_SCOPED_TIMER(Ordering);
+    PIXEL_STUDIES_COUNT(Ordering, Hits, pixels.size());
     PixelWithAdcVector result(pixels.begin(), pixels.end());
     std::sort(result.begin(), result.end(), orderers.at(ordering));
     return result;
@@ -165,6 +168,8 @@ Adc PixelRegion::GetAdc(const Pixel& pixel) const
 
 bool PixelRegion::HasSamePixels(const PixelRegion& other, std::ostream* os) const
 {
+    PIXEL_STUDIES_SCOPED_TIMER(Verification);
+    PIXEL_STUDIES_COUNT(Verification, Hits, pixels.size());
     if(os)
         *os << "this vs. other" << "\nsize: " << pixels.size() << " - " << other.pixels.size() << "\n";
     if(pixels.size() != other.pixels.size()) return false;
@@ -181,43 +186,75 @@ bool PixelRegion::HasSamePixels(const PixelRegion& other, std::ostream* os) cons
 }
 
 PixelMultiRegion::PixelMultiRegion(const MultiRegionLayout& _multi_layout) :
-    PixelRegion(_multi_layout), multi_region_layout(_multi_layout)
+    PixelRegion(_multi_layout), multi_region_layout(_multi_layout), has_regions(false)
 {
-    CreateRegions();
 }
 
 PixelMultiRegion::PixelMultiRegion(const PixelRegion& original, size_t n_region_rows, size_t n_region_columns) :
-    PixelRegion(original), multi_region_layout(original.GetRegionLayout(), n_region_rows, n_region_columns)
+    PixelRegion(original), multi_region_layout(original.GetRegionLayout(), n_region_rows, n_region_columns),
+    has_regions(false)
 {
-    CreateRegions();
 }
 
 PixelMultiRegion::PixelMultiRegion(const PixelRegion& original, const RegionLayout& _region_layout) :
     PixelRegion(original),
-    multi_region_layout(original.GetRegionLayout().n_rows, original.GetRegionLayout().n_columns, _region_layout)
+    multi_region_layout(original.GetRegionLayout().n_rows, original.GetRegionLayout().n_columns, _region_layout),
+    has_regions(false)
 {
-    CreateRegions();
 }
 
-void PixelMultiRegion::CreateRegions()
+PixelMultiRegion::PixelMultiRegion(const PixelMultiRegion& other) :
+    PixelRegion(other), multi_region_layout(other.multi_region_layout), has_regions(false)
 {
-    if(multi_region_layout.GetNumberOfRegions() > 1) {
-        regions.resize(multi_region_layout.GetNumberOfRegions());
+}
 
-        for(const auto& pixel_with_adc : GetPixels())
-            AddPixelToRegion(pixel_with_adc.first, pixel_with_adc.second);
-    }
+PixelMultiRegion::PixelMultiRegion(PixelMultiRegion&& other) :
+    PixelRegion(std::move(other)), multi_region_layout(other.multi_region_layout), has_regions(false)
+{
+}
+
+PixelMultiRegion& PixelMultiRegion::operator=(const PixelMultiRegion& other)
+{
+    if(this == &other) return *this;
+    PixelRegion::operator=(other);
+    multi_region_layout = other.multi_region_layout;
+    regions.clear();
+    has_regions = false;
+    return *this;
+}
+
+PixelMultiRegion& PixelMultiRegion::operator=(PixelMultiRegion&& other)
+{
+    if(this == &other) return *this;
+    PixelRegion::operator=(std::move(other));
+    multi_region_layout = other.multi_region_layout;
+    regions.clear();
+    has_regions = false;
+    return *this;
+}
+
+void PixelMultiRegion::CreateRegions() const
+{
+    if(multi_region_layout.GetNumberOfRegions() <= 1 || has_regions.load(std::memory_order_acquire)) return;
+    std::lock_guard<std::mutex> lock(regions_mutex);
+    if(has_regions.load(std::memory_order_relaxed)) return;
+    PIXEL_STUDIES_SCOPED_TIMER(Repartition);
+    PIXEL_STUDIES_COUNT(Repartition, Hits, GetPixels().size());
+    regions.resize(multi_region_layout.GetNumberOfRegions());
+    for(const auto& pixel_with_adc : GetPixels())
+        AddPixelToRegion(pixel_with_adc.first, pixel_with_adc.second);
+    has_regions.store(true, std::memory_order_release);
 }
 
 void PixelMultiRegion::AddPixel(const Pixel& pixel, Adc adc)
 {
     PixelRegion::AddPixel(pixel, adc);
-    AddPixelToRegion(pixel, adc);
+    if(has_regions.load(std::memory_order_acquire))
+        AddPixelToRegion(pixel, adc);
 }
 
-void PixelMultiRegion::AddPixelToRegion(const Pixel& pixel, Adc adc)
+void PixelMultiRegion::AddPixelToRegion(const Pixel& pixel, Adc adc) const
 {
-    if(multi_region_layout.GetNumberOfRegions() <= 1) return;
     Pixel region_pixel;
     size_t region_id;
     multi_region_layout.ConvertToRegionPixel(pixel, region_id, region_pixel);
@@ -248,6 +285,7 @@ bool PixelMultiRegion::IsRegionActive(size_t region_id) const
         throw exception("Invalid region id = %1%.") % region_id;
     if(multi_region_layout.GetNumberOfRegions() == 1)
         return GetPixels().size();
+    CreateRegions();
     return regions.at(region_id) != nullptr;
 }
 
@@ -261,41 +299,31 @@ PixelWithAdcVector PixelMultiRegion::GetOrderedPixels(Ordering ordering) const
 {
     if(ordering != Ordering::ByRegionByRow && ordering != Ordering::ByRegionByColumn)
         return PixelRegion::GetOrderedPixels(ordering);
-
-    using getRegionIdFn = std::function<size_t(size_t, size_t)>;
-    const getRegionIdFn getRegionIdByRow = [&](size_t n, size_t k) -> size_t {
-        return multi_region_layout.GetRegionId(n, k);
-    };
-    const getRegionIdFn getRegionIdByColumn = [&](size_t n, size_t k) -> size_t {
-        return multi_region_layout.GetRegionId(k, n);
-    };
-    const auto getRegionId = ordering == Ordering::ByRegionByRow ? getRegionIdByRow : getRegionIdByColumn;
-
-    using getRegionNumberFn = std::function<std::pair<size_t, size_t>()>;
-    const getRegionNumberFn getRegionNumbersByRow = [&]() {
-        return std::make_pair(multi_region_layout.n_region_rows, multi_region_layout.n_region_columns);
-    };
-    const getRegionNumberFn getRegioNumbersByColumn = [&]() {
-        return std::make_pair(multi_region_layout.n_region_columns, multi_region_layout.n_region_rows);
-    };
-
-    const auto getRegionNumbers = ordering == Ordering::ByRegionByRow ? getRegionNumbersByRow : getRegioNumbersByColumn;
-
-    PixelWithAdcVector result;
-    const auto n_regions = getRegionNumbers();
-    for(size_t n = 0; n < n_regions.first; ++n) {
-        for(size_t k = 0; k < n_regions.second; ++k) {
-            const size_t region_id = getRegionId(n, k);
-            if(!IsRegionActive(region_id)) continue;
-            const auto& pixels = GetRegion(region_id).GetPixels();
-            for(const auto& pixel_with_adc : pixels) {
-                Pixel global_pixel;
-                multi_region_layout.ConvertFromRegionPixel(region_id, pixel_with_adc.first, global_pixel);
-                result.push_back(PixelAdcPair(global_pixel, pixel_with_adc.second));
-            }
-        }
+    PIXEL_STUDIES_SCOPED_TIMER(Ordering);
+    PIXEL_STUDIES_COUNT(Ordering, Hits, GetPixels().size());
+
+    // The pixels are ordered by the region directly, without splitting the chip into the regions. The pixels of the
+    // parent map are already ordered by row and column, which is the order of the pixels inside each region.
+    const bool by_row = ordering == Ordering::ByRegionByRow;
+    std::vector<std::pair<size_t, PixelAdcPair>> ordered_pixels;
+    ordered_pixels.reserve(GetPixels().size());
+    for(const auto& pixel_with_adc : GetPixels()) {
+        const size_t region_row_index = pixel_with_adc.first.row / multi_region_layout.region_layout.n_rows;
+        const size_t region_column_index = pixel_with_adc.first.column / multi_region_layout.region_layout.n_columns;
+        const size_t region_index = by_row
+                ? region_row_index * multi_region_layout.n_region_columns + region_column_index
+                : region_column_index * multi_region_layout.n_region_rows + region_row_index;
+        ordered_pixels.emplace_back(region_index, pixel_with_adc);
     }
+    std::stable_sort(ordered_pixels.begin(), ordered_pixels.end(),
+                     [](const std::pair<size_t, PixelAdcPair>& first, const std::pair<size_t, PixelAdcPair>& second) {
+                         return first.first < second.first;
+                     });
 
+    PixelWithAdcVector result;
+    result.reserve(ordered_pixels.size());
+    for(const auto& entry : ordered_pixels)
+        result.push_back(entry.second);
     return result;
 }
 
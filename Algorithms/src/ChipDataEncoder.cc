@@ -7,9 +7,28 @@ This file is part of https://github.com/kandrosov/OnChipDataCompression. */
 #include "../interface/DeltaPackageMaker.h"
 #include "../interface/HuffmanDecoder.h"
 #include "../interface/HuffmanEncoder.h"
+#include "../interface/Instrumentation.h"
 
 namespace pixel_studies {
 
+const std::map<std::string, EncoderFormat>& EncoderFormatNames()
+{
+    static const std::map<std::string, EncoderFormat> formats = {
+        { "SinglePixel", EncoderFormat::SinglePixel }, { "Region", EncoderFormat::Region },
+        { "RegionWithCompressedAdc", EncoderFormat::RegionWithCompressedAdc }, { "Delta", EncoderFormat::Delta },
+        { "DeltaWithSubStreams", EncoderFormat::DeltaWithSubStreams },
+    };
+    return formats;
+}
+
+EncoderFormat ParseEncoderFormat(const std::string& name)
+{
+    const auto iter = EncoderFormatNames().find(name);
+    if(iter == EncoderFormatNames().end())
+        throw exception("Unknown encoder format '%1%'.") % name;
+    return iter->second;
+}
+
 ChipDataEncoder::ChipDataEncoder(EncoderFormat encoder_format, const MultiRegionLayout& _chip_layout,
                                  const RegionLayout& readout_unit_layout, size_t max_adc,
                                  Ordering ordering, const std::string& dictionary_file) :
@@ -23,22 +42,51 @@ ChipDataEncoder::ChipDataEncoder(EncoderFormat encoder_format, const MultiRegion
         package_maker = std::make_shared<DefaultPackageMaker>(n_bits_per_adc);
     } else if(encoder_format == EncoderFormat::Region) {
         package_maker = std::make_shared<BlockPackageMaker>(nullptr, readout_unit_layout, n_bits_per_adc, false);
-    } else if(encoder_format == EncoderFormat::RegionWithCompressedAdc || encoder_format == EncoderFormat::Delta) {
+    } else if(encoder_format == EncoderFormat::RegionWithCompressedAdc || encoder_format == EncoderFormat::Delta
+              || encoder_format == EncoderFormat::DeltaWithSubStreams) {
         statistics_source = std::make_shared<StatisticsSource>(dictionary_file);
         if(encoder_format == EncoderFormat::RegionWithCompressedAdc) {
             package_maker = std::make_shared<BlockPackageMaker>(statistics_source.get(), readout_unit_layout,
                                                                 n_bits_per_adc, true);
         } else {
+            const bool use_sub_streams = encoder_format == EncoderFormat::DeltaWithSubStreams;
             package_maker = std::make_shared<DeltaPackageMaker>(*statistics_source, readout_unit_layout,
-                                                                DeltaPackageMakerMode::CombinedDelta, ordering);
+                                                                DeltaPackageMakerMode::CombinedDelta, ordering,
+                                                                use_sub_streams);
         }
     } else {
         throw exception("Encoder format is not supported.");
     }
+    empty_package = std::make_shared<const Package>(package_maker->Make(Chip(chip_layout)));
+}
+
+void ChipDataEncoder::EnableCache(size_t max_size)
+{
+    cache = std::make_shared<PackageCache>(max_size);
 }
 
 Package ChipDataEncoder::Encode(const Chip& original_chip) const
 {
+    PIXEL_STUDIES_SCOPED_TIMER(Encoding);
+    if(!original_chip.HasActivePixels()) {
+        PIXEL_STUDIES_COUNT(Encoding, Chips, 1);
+        PIXEL_STUDIES_COUNT(Encoding, FastPaths, 1);
+        PIXEL_STUDIES_COUNT(Encoding, Bits, empty_package->size());
+        return *empty_package;
+    }
+
+    uint64_t hash = 0;
+    if(cache) {
+        hash = PackageCache::Hash(original_chip);
+        if(const PackageCache::PackagePtr cached_package = cache->Find(hash, original_chip)) {
+            PIXEL_STUDIES_COUNT(Encoding, Chips, 1);
+            PIXEL_STUDIES_COUNT(Encoding, CacheHits, 1);
+            PIXEL_STUDIES_COUNT(Encoding, Hits, original_chip.GetPixels().size());
+            PIXEL_STUDIES_COUNT(Encoding, Bits, cached_package->size());
+            return *cached_package;
+        }
+    }
+
     ChipPtr split_chip;
     const Chip* chip = nullptr;
     if(original_chip.GetMultiRegionLayout() == chip_layout) {
@@ -48,12 +96,74 @@ Package ChipDataEncoder::Encode(const Chip& original_chip) const
         chip = split_chip.get();
     }
 
-    return package_maker->Make(*chip);
+    Package package = package_maker->Make(*chip);
+    if(cache)
+        cache->Insert(hash, original_chip, package);
+    PIXEL_STUDIES_COUNT(Encoding, Chips, 1);
+    PIXEL_STUDIES_COUNT(Encoding, Hits, chip->GetPixels().size());
+    PIXEL_STUDIES_COUNT(Encoding, Bits, package.size());
+    return package;
+}
+
+bool ChipDataEncoder::IsEmptyPackage(const Package& package) const
+{
+    if(!(package == *empty_package)) return false;
+    PIXEL_STUDIES_COUNT(Decoding, Chips, 1);
+    PIXEL_STUDIES_COUNT(Decoding, FastPaths, 1);
+    PIXEL_STUDIES_COUNT(Decoding, Bits, package.size());
+    return true;
 }
 
 Chip ChipDataEncoder::Decode(const Package& package) const
 {
-    return package_maker->Read(package, chip_layout);
+    PIXEL_STUDIES_SCOPED_TIMER(Decoding);
+    if(IsEmptyPackage(package))
+        return Chip(chip_layout);
+    Chip chip = package_maker->Read(package, chip_layout);
+    PIXEL_STUDIES_COUNT(Decoding, Chips, 1);
+    PIXEL_STUDIES_COUNT(Decoding, Hits, chip.GetPixels().size());
+    PIXEL_STUDIES_COUNT(Decoding, Bits, package.size());
+    return chip;
+}
+
+Chip ChipDataEncoder::Decode(const Package& package, size_t n_threads) const
+{
+    PIXEL_STUDIES_SCOPED_TIMER(Decoding);
+    if(IsEmptyPackage(package))
+        return Chip(chip_layout);
+    Chip chip = package_maker->ReadInParallel(package, chip_layout, n_threads);
+    PIXEL_STUDIES_COUNT(Decoding, Chips, 1);
+    PIXEL_STUDIES_COUNT(Decoding, Hits, chip.GetPixels().size());
+    PIXEL_STUDIES_COUNT(Decoding, Bits, package.size());
+    return chip;
+}
+
+PixelVector ChipDataEncoder::DecodeAddresses(const Package& package) const
+{
+    PIXEL_STUDIES_SCOPED_TIMER(Decoding);
+    PixelVector pixels = package_maker->ReadAddresses(package, chip_layout);
+    PIXEL_STUDIES_COUNT(Decoding, Chips, 1);
+    PIXEL_STUDIES_COUNT(Decoding, Hits, pixels.size());
+    PIXEL_STUDIES_COUNT(Decoding, Bits, package.size());
+    return pixels;
+}
+
+AdcVector ChipDataEncoder::DecodeAdcs(const Package& package) const
+{
+    PIXEL_STUDIES_SCOPED_TIMER(Decoding);
+    AdcVector adcs = package_maker->ReadAdcs(package, chip_layout);
+    PIXEL_STUDIES_COUNT(Decoding, Chips, 1);
+    PIXEL_STUDIES_COUNT(Decoding, Hits, adcs.size());
+    PIXEL_STUDIES_COUNT(Decoding, Bits, package.size());
+    return adcs;
+}
+
+PixelRegion ChipDataEncoder::DecodeRegion(const Package& package, size_t macro_region_id) const
+{
+    PIXEL_STUDIES_SCOPED_TIMER(Decoding);
+    PixelRegion region = package_maker->ReadRegion(package, chip_layout, macro_region_id);
+    PIXEL_STUDIES_COUNT(Decoding, Hits, region.GetPixels().size());
+    return region;
 }
 
 } // namespace pixel_studies
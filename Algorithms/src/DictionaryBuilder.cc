@@ -1,8 +1,12 @@
 /*! The class that creates dictionaries for compression algorithms.
 This file is part of https://github.com/kandrosov/OnChipDataCompression. */
 
+#include <algorithm>
+#include <cmath>
 #include <fstream>
+#include <set>
 #include "../interface/DictionaryBuilder.h"
+#include "../interface/Instrumentation.h"
 
 namespace pixel_studies {
 
@@ -17,16 +21,24 @@ DictionaryBuilder::Producer DictionaryBuilder::CreateProducer(const std::string&
 
 DictionaryBuilder::DictionaryBuilder(const MultiRegionLayout& _chip_layout, Ordering _ordering,
                                      const RegionLayout& _readout_unit_layout, size_t max_adc,
-                                     size_t _max_alphabet_size) :
+                                     size_t _max_alphabet_size, const DictionaryConvergenceConfig& _convergence) :
     chip_layout(_chip_layout), ordering(_ordering), readout_unit_layout(_readout_unit_layout),
-    max_alphabet_size(_max_alphabet_size), all_adc_prod(CreateProducer("all_adc", 0, max_adc)),
-    active_adc_prod(CreateProducer("active_adc", 1, max_adc)),
-    delta_row_column_prod(CreateProducer("delta_row_column", 0, chip_layout.region_layout.GetNumberOfPixels()))
+    max_alphabet_size(_max_alphabet_size), convergence(_convergence),
+    all_adc_prod(CreateProducer("all_adc", 0, max_adc)), active_adc_prod(CreateProducer("active_adc", 1, max_adc)),
+    delta_row_column_prod(CreateProducer("delta_row_column", 0, chip_layout.region_layout.GetNumberOfPixels())),
+    n_chips(0), converged(false), n_stable_snapshots(0)
 {
+    if(convergence.tolerance < 0)
+        throw exception("Convergence tolerance should be a non-negative number.");
 }
 
-void DictionaryBuilder::AddChip(const Chip& original_chip)
+bool DictionaryBuilder::AddChip(const Chip& original_chip)
 {
+    if(convergence.stop_when_converged && converged)
+        return false;
+    PIXEL_STUDIES_SCOPED_TIMER(DictionaryTraining);
+    PIXEL_STUDIES_COUNT(DictionaryTraining, Chips, 1);
+    PIXEL_STUDIES_COUNT(DictionaryTraining, Hits, original_chip.GetPixels().size());
     ChipPtr split_chip;
     const Chip* chip = nullptr;
     if(original_chip.GetMultiRegionLayout() == chip_layout) {
@@ -36,44 +48,224 @@ void DictionaryBuilder::AddChip(const Chip& original_chip)
         chip = split_chip.get();
     }
 
+    ChipLetterCounts counts;
+    counts.delta_row_column.reserve(chip->GetPixels().size());
     for(size_t n = 0; n < chip_layout.GetNumberOfRegions(); ++n) {
         if(!chip->IsRegionActive(n)) continue;
-        const PixelMultiRegion pixel_region(chip->GetRegion(n), readout_unit_layout);
-        const auto ordered_pixels = pixel_region.GetOrderedPixels(ordering);
-        ProcessOrderedPixels(ordered_pixels);
-        ProcessRegionBlocks(pixel_region);
+        const PixelRegion& macro_region = chip->GetRegion(n);
+        const PixelMultiRegion pixel_region(macro_region, readout_unit_layout);
+        ProcessOrderedPixels(pixel_region.GetOrderedPixels(ordering), counts);
+        ProcessRegionBlocks(macro_region, counts);
     }
+
+    all_adc_prod.AddCounts(ToFrequencies(counts.all_adc));
+    active_adc_prod.AddCounts(ToFrequencies(counts.active_adc));
+    delta_row_column_prod.AddCounts(ToFrequencies(counts.delta_row_column));
+
+    const size_t n_processed_chips = ++n_chips;
+    if(convergence.chips_per_snapshot && n_processed_chips % convergence.chips_per_snapshot == 0)
+        TakeSnapshot(n_processed_chips);
+    return true;
+}
+
+void DictionaryBuilder::Merge(const DictionaryBuilder& other)
+{
+    if(!(other.chip_layout == chip_layout) || other.ordering != ordering
+            || !(other.readout_unit_layout == readout_unit_layout) || other.max_alphabet_size != max_alphabet_size)
+        throw exception("Unable to merge dictionary builders with different configurations.");
+    all_adc_prod.AddCounts(other.all_adc_prod.GetLetterFrequencies());
+    active_adc_prod.AddCounts(other.active_adc_prod.GetLetterFrequencies());
+    delta_row_column_prod.AddCounts(other.delta_row_column_prod.GetLetterFrequencies());
+    n_chips += other.n_chips;
+}
+
+std::vector<DictionarySnapshot> DictionaryBuilder::GetSnapshots() const
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    return snapshots;
+}
+
+void DictionaryBuilder::WriteSnapshots(std::ostream& os) const
+{
+    static const std::string sep = " ";
+    os << "n_chips" << sep << "alphabet" << sep << "kl_divergence" << sep << "code_length_change" << sep
+       << "is_stable\n";
+    for(const DictionarySnapshot& snapshot : GetSnapshots()) {
+        for(const AlphabetChange& change : snapshot.changes) {
+            os << snapshot.n_chips << sep << change.name << sep << change.kl_divergence << sep
+               << change.code_length_change << sep << snapshot.is_stable << "\n";
+        }
+    }
+    os << "converged" << sep << IsConverged() << sep << "after" << sep << GetNumberOfChips() << sep << "chips"
+       << std::endl;
+}
+
+void DictionaryBuilder::AddDenseCount(CountVector& counts, size_t letter, Integer n)
+{
+    if(letter >= counts.size())
+        counts.resize(letter + 1, 0);
+    counts[letter] += n;
+}
+
+DictionaryBuilder::Producer::LetterFrequencyMap DictionaryBuilder::ToFrequencies(const CountVector& counts)
+{
+    Producer::LetterFrequencyMap frequencies;
+    for(size_t letter = 0; letter < counts.size(); ++letter) {
+        if(counts[letter])
+            frequencies[letter] = counts[letter];
+    }
+    return frequencies;
+}
+
+DictionaryBuilder::Producer::LetterFrequencyMap DictionaryBuilder::ToFrequencies(std::vector<Letter>& letters)
+{
+    std::sort(letters.begin(), letters.end());
+    Producer::LetterFrequencyMap frequencies;
+    for(size_t first = 0; first < letters.size();) {
+        size_t last = first + 1;
+        while(last < letters.size() && letters[last] == letters[first])
+            ++last;
+        frequencies[letters[first]] = last - first;
+        first = last;
+    }
+    return frequencies;
 }
 
-void DictionaryBuilder::ProcessOrderedPixels(const PixelWithAdcVector& ordered_pixels)
+void DictionaryBuilder::ProcessOrderedPixels(const PixelWithAdcVector& ordered_pixels, ChipLetterCounts& counts) const
 {
     const auto& layout = chip_layout.region_layout;
+    const int n_rows = layout.n_rows, n_columns = layout.n_columns;
+    const size_t first = counts.delta_row_column.size();
+    counts.delta_row_column.resize(first + ordered_pixels.size());
+    Letter* delta_row_column = counts.delta_row_column.data() + first;
+
+    // The pixels are inside the region, so the modular deltas need at most one correction. The pass stays scalar:
+    // it takes less than 1% of AddChip, which is dominated by the split into the readout units and the ordering.
     Pixel previous_pixel(0, 0);
-    for(const PixelAdcPair& pixel_with_adc : ordered_pixels) {
-        const Pixel& pixel = pixel_with_adc.first;
-        const Adc adc = pixel_with_adc.second;
-        const auto delta_row = (pixel.row + layout.n_rows - previous_pixel.row) % layout.n_rows;
-        const auto delta_column = (pixel.column + layout.n_columns - previous_pixel.column) % layout.n_columns;
-        const auto delta_row_column = layout.GetPixelId(Pixel(delta_row, delta_column));
-        active_adc_prod.AddCount(adc);
-        delta_row_column_prod.AddCount(delta_row_column);
+    for(size_t n = 0; n < ordered_pixels.size(); ++n) {
+        const Pixel& pixel = ordered_pixels[n].first;
+        int delta_row = pixel.row - previous_pixel.row;
+        int delta_column = pixel.column - previous_pixel.column;
+        delta_row += delta_row < 0 ? n_rows : 0;
+        delta_column += delta_column < 0 ? n_columns : 0;
+        delta_row_column[n] = delta_row * n_columns + delta_column;
         previous_pixel = pixel;
     }
+    for(const PixelAdcPair& pixel_with_adc : ordered_pixels)
+        AddDenseCount(counts.active_adc, pixel_with_adc.second);
 }
 
-void DictionaryBuilder::ProcessRegionBlocks(const PixelMultiRegion& pixel_area)
+void DictionaryBuilder::ProcessRegionBlocks(const PixelRegion& macro_region, ChipLetterCounts& counts) const
 {
-    for(size_t n = 0; n < pixel_area.GetMultiRegionLayout().GetNumberOfRegions(); ++n) {
-        if(!pixel_area.IsRegionActive(n)) continue;
-        const PixelRegion& region = pixel_area.GetRegion(n);
-        const RegionLayout& layout = region.GetRegionLayout();
-        for(size_t row = 0; row < layout.n_rows; ++row) {
-            for(size_t column = 0; column < layout.n_columns; ++column) {
-                const Adc adc = region.GetAdc(row, column);
-                all_adc_prod.AddCount(adc);
-            }
-        }
+    // Each active readout unit is stored as a full block, where the inactive pixels, including the pixels of an
+    // incomplete block outside of the macro region, have zero ADC. So only the number of active blocks is needed.
+    const MultiRegionLayout layout(macro_region.GetNumberOfRows(), macro_region.GetNumberOfColumns(),
+                                   readout_unit_layout);
+    const auto& pixels = macro_region.GetPixels();
+    counts.block_ids.clear();
+    for(const auto& pixel_with_adc : pixels) {
+        const size_t block_row = pixel_with_adc.first.row / readout_unit_layout.n_rows;
+        const size_t block_column = pixel_with_adc.first.column / readout_unit_layout.n_columns;
+        counts.block_ids.push_back(layout.GetRegionId(block_row, block_column));
+        AddDenseCount(counts.all_adc, pixel_with_adc.second);
+    }
+    std::sort(counts.block_ids.begin(), counts.block_ids.end());
+    const size_t n_blocks = std::unique(counts.block_ids.begin(), counts.block_ids.end()) - counts.block_ids.begin();
+    AddDenseCount(counts.all_adc, 0, n_blocks * readout_unit_layout.GetNumberOfPixels() - pixels.size());
+}
+
+void DictionaryBuilder::TakeSnapshot(size_t n_processed_chips)
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    if(convergence.stop_when_converged && converged)
+        return;
+    std::vector<AlphabetState> state;
+    state.push_back(GetAlphabetState(all_adc_prod, false));
+    state.push_back(GetAlphabetState(active_adc_prod, false));
+    state.push_back(GetAlphabetState(delta_row_column_prod, true));
+
+    DictionarySnapshot snapshot;
+    snapshot.n_chips = n_processed_chips;
+    snapshot.is_stable = !last_state.empty();
+    for(size_t n = 0; n < last_state.size(); ++n) {
+        const AlphabetChange change = Compare(last_state.at(n), state.at(n));
+        snapshot.is_stable = snapshot.is_stable && change.kl_divergence <= convergence.tolerance
+                && std::abs(change.code_length_change) <= convergence.tolerance;
+        snapshot.changes.push_back(change);
+    }
+    n_stable_snapshots = snapshot.is_stable ? n_stable_snapshots + 1 : 0;
+    if(n_stable_snapshots >= convergence.n_stable_snapshots)
+        converged = true;
+    last_state = std::move(state);
+    snapshots.push_back(snapshot);
+}
+
+DictionaryBuilder::AlphabetState DictionaryBuilder::GetAlphabetState(const Producer& producer, bool reduce) const
+{
+    // Other threads may add counts to the producer, so everything is computed from a single copy of the frequencies.
+    AlphabetState state;
+    state.name = producer.GetName();
+    state.frequencies = producer.GetLetterFrequencies();
+    Integer n_counts = 0;
+    for(const auto& entry : state.frequencies)
+        n_counts += entry.second;
+    if(!n_counts)
+        return state;
+
+    // The code lengths are taken from the same dictionary as the one that would be saved.
+    Producer::LetterFrequencyMap dictionary_frequencies = state.frequencies;
+    if(reduce && state.frequencies.size() > max_alphabet_size) {
+        Producer state_producer(state.name, state.frequencies);
+        dictionary_frequencies = state_producer.Reduce(max_alphabet_size, state.name, -1)->GetLetterFrequencies();
+    }
+    const HuffmanTree<Letter, Integer> huffman_tree(dictionary_frequencies);
+    for(const auto& entry : huffman_tree.GetTable().left)
+        state.code_lengths[entry.first] = entry.second.NumberOfBits();
+    return state;
+}
+
+AlphabetChange DictionaryBuilder::Compare(const AlphabetState& previous, const AlphabetState& current)
+{
+    static constexpr double smoothing = 0.5;
+    static constexpr Letter escape_letter = -1;
+    const auto getCodeLength = [](const AlphabetState& state, Letter letter) -> double {
+        auto iter = state.code_lengths.find(letter);
+        if(iter == state.code_lengths.end())
+            iter = state.code_lengths.find(escape_letter);
+        return iter != state.code_lengths.end() ? iter->second : 0;
+    };
+    const auto getFrequency = [](const AlphabetState& state, Letter letter) -> double {
+        const auto iter = state.frequencies.find(letter);
+        return iter != state.frequencies.end() ? iter->second : 0;
+    };
+
+    std::set<Letter> letters;
+    double n_previous = 0, n_current = 0;
+    for(const auto& entry : previous.frequencies) {
+        letters.insert(entry.first);
+        n_previous += entry.second;
+    }
+    for(const auto& entry : current.frequencies) {
+        letters.insert(entry.first);
+        n_current += entry.second;
+    }
+
+    AlphabetChange change;
+    change.name = current.name;
+    change.kl_divergence = 0;
+    change.code_length_change = 0;
+    const double n_smoothed_previous = n_previous + smoothing * letters.size();
+    const double n_smoothed_current = n_current + smoothing * letters.size();
+    for(Letter letter : letters) {
+        const double frequency = getFrequency(current, letter);
+        const double p = (frequency + smoothing) / n_smoothed_current;
+        const double q = (getFrequency(previous, letter) + smoothing) / n_smoothed_previous;
+        change.kl_divergence += p * std::log2(p / q);
+        if(n_current)
+            change.code_length_change += frequency / n_current
+                    * (getCodeLength(previous, letter) - getCodeLength(current, letter));
     }
+    return change;
 }
 
 void DictionaryBuilder::SaveDictionaries(const std::string& cfg_file_name)
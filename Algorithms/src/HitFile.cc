@@ -0,0 +1,107 @@
+/*! Classes to read and write chip hits in a plain text format.
+This file is part of https://github.com/kandrosov/OnChipDataCompression. */
+
+#include <boost/algorithm/string.hpp>
+#include "../interface/HitFile.h"
+#include "../interface/Instrumentation.h"
+
+namespace pixel_studies {
+
+HitFileReader::HitFileReader(const std::string& _file_name, const MultiRegionLayout& _chip_layout) :
+    file_name(_file_name), chip_layout(_chip_layout), file(file_name), line_number(0)
+{
+    if(!file.is_open())
+        throw exception("Unable to open hit file '%1%'.") % file_name;
+}
+
+bool HitFileReader::NextLine(std::string& line)
+{
+    while(std::getline(file, line)) {
+        ++line_number;
+        boost::trim(line);
+        if(line.size() && line.at(0) != '#')
+            return true;
+    }
+    if(file.bad())
+        throw exception("Error while reading hit file '%1%'.") % file_name;
+    return false;
+}
+
+ChipRecord HitRecord::MakeChip(const MultiRegionLayout& chip_layout) const
+{
+    PIXEL_STUDIES_SCOPED_TIMER(ChipConstruction);
+    const ChipRecord record(event_id, module_id, chip_id, std::make_shared<Chip>(chip_layout));
+    for(const auto& hit : hits)
+        record.chip->AddPixel(hit.first, hit.second);
+    PIXEL_STUDIES_COUNT(ChipConstruction, Chips, 1);
+    PIXEL_STUDIES_COUNT(ChipConstruction, Hits, hits.size());
+    return record;
+}
+
+bool HitFileReader::ReadHits(HitRecord& record)
+{
+    static const std::string chip_header = "chip";
+
+    std::string line;
+    if(!NextLine(line)) return false;
+
+    std::istringstream header(line);
+    std::string header_name;
+    size_t n_hits;
+    header >> header_name >> record.event_id >> record.module_id >> record.chip_id >> n_hits;
+    if(header.fail() || header_name != chip_header)
+        throw exception("Invalid chip header at line %1% of '%2%'.") % line_number % file_name;
+
+    record.hits.clear();
+    record.hits.reserve(std::min(n_hits, chip_layout.GetNumberOfPixels()));
+    for(size_t n = 0; n < n_hits; ++n) {
+        if(!NextLine(line))
+            throw exception("Unexpected end of hit file '%1%'.") % file_name;
+        std::istringstream hit(line);
+        RawCoordinate row, column;
+        Adc adc;
+        hit >> row >> column >> adc;
+        if(hit.fail())
+            throw exception("Invalid hit at line %1% of '%2%'.") % line_number % file_name;
+        record.hits.emplace_back(Pixel(row, column), adc);
+    }
+    return true;
+}
+
+bool HitFileReader::ReadChip(ChipRecord& record)
+{
+    HitRecord hit_record;
+    if(!ReadHits(hit_record)) return false;
+    record = hit_record.MakeChip(chip_layout);
+    return true;
+}
+
+ChipRecordVector HitFileReader::ReadAll(size_t max_n_chips)
+{
+    ChipRecordVector records;
+    ChipRecord record;
+    while(records.size() < max_n_chips && ReadChip(record))
+        records.push_back(record);
+    return records;
+}
+
+HitFileWriter::HitFileWriter(const std::string& _file_name) :
+    file_name(_file_name), file(file_name)
+{
+    if(!file.is_open())
+        throw exception("Unable to create hit file '%1%'.") % file_name;
+    file << "# chip <event_id> <module_id> <chip_id> <n_hits>, followed by n_hits lines <row> <column> <adc>\n";
+}
+
+void HitFileWriter::WriteChip(const ChipRecord& record)
+{
+    const auto& pixels = record.chip->GetPixels();
+    file << "chip " << record.event_id << " " << record.module_id << " " << record.chip_id << " "
+         << pixels.size() << "\n";
+    for(const auto& pixel_with_adc : pixels)
+        file << pixel_with_adc.first.row << " " << pixel_with_adc.first.column << " " << pixel_with_adc.second << "\n";
+    if(file.fail())
+        throw exception("Error while writing hit file '%1%'.") % file_name;
+}
+
+} // namespace pixel_studies
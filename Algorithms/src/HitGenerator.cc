@@ -0,0 +1,147 @@
+/*! The class that generates synthetic cluster-based chip hits.
+This file is part of https://github.com/kandrosov/OnChipDataCompression. */
+
+#include "../interface/HitGenerator.h"
+#include "../interface/Instrumentation.h"
+
+namespace pixel_studies {
+
+HitGenerator::HitGenerator(const MultiRegionLayout& _chip_layout, const HitGeneratorConfig& _config,
+                           uint64_t seed) :
+    chip_layout(_chip_layout), config(_config), generator(seed), unit_distr(0., 1.),
+    column_angle_distr(config.column_angle_min, config.column_angle_max), normal_distr(0., 1.),
+    row_angle_distr(config.row_angle_mean, config.row_angle_sigma),
+    pixel_id_distr(0, chip_layout.GetNumberOfPixels() - 1)
+{
+    static constexpr size_t n_calibration_clusters = 4096;
+    static constexpr uint64_t calibration_seed_mask = 0x9E3779B97F4A7C15ULL;
+
+    CheckConfig();
+
+    // The mean cluster size is estimated on an independent sequence, so that the main sequence depends only on seed.
+    Generator calibration_generator(seed ^ calibration_seed_mask);
+    size_t n_cluster_pixels = 0;
+    for(size_t n = 0; n < n_calibration_clusters; ++n) {
+        GenerateCluster(calibration_generator, cluster_pixels);
+        n_cluster_pixels += cluster_pixels.size();
+    }
+    mean_cluster_size = double(n_cluster_pixels) / n_calibration_clusters;
+    if(!mean_cluster_size)
+        throw exception("Hit generator configuration does not produce any hits above the threshold.");
+
+    const double n_hits = config.occupancy * chip_layout.GetNumberOfPixels();
+    mean_n_clusters = n_hits * (1. - config.noise_fraction) / mean_cluster_size;
+    mean_n_noise_hits = n_hits * config.noise_fraction;
+}
+
+void HitGenerator::CheckConfig() const
+{
+    if(config.occupancy < 0 || config.occupancy > 1)
+        throw exception("Invalid occupancy = %1%.") % config.occupancy;
+    if(config.noise_fraction < 0 || config.noise_fraction > 1)
+        throw exception("Invalid noise fraction = %1%.") % config.noise_fraction;
+    if(config.thickness_over_row_pitch <= 0 || config.thickness_over_column_pitch <= 0)
+        throw exception("Sensor thickness should be a positive number.");
+    if(config.row_angle_sigma < 0 || config.column_angle_min > config.column_angle_max)
+        throw exception("Invalid track angle distribution.");
+    if(config.charge_mpv <= 0 || config.charge_width <= 0)
+        throw exception("Invalid charge distribution.");
+    if(!config.max_adc || !config.max_cluster_length)
+        throw exception("Max ADC and max cluster length should be positive numbers.");
+}
+
+Chip HitGenerator::Generate()
+{
+    Chip chip(chip_layout);
+    Generate(chip);
+    return chip;
+}
+
+ChipPtrVector HitGenerator::Generate(size_t n_chips)
+{
+    ChipPtrVector chips;
+    chips.reserve(n_chips);
+    for(size_t n = 0; n < n_chips; ++n) {
+        chips.push_back(std::make_shared<Chip>(chip_layout));
+        Generate(*chips.back());
+    }
+    return chips;
+}
+
+void HitGenerator::Generate(Chip& chip)
+{
+    PIXEL_STUDIES_SCOPED_TIMER(ChipConstruction);
+    const auto& chip_pixels = chip.GetPixels();
+    const auto addHit = [&](const Pixel& pixel, size_t adc) {
+        if(chip_layout.IsPixelInside(pixel) && !chip_pixels.count(pixel))
+            chip.AddPixel(pixel, adc);
+    };
+
+    if(mean_n_clusters > 0) {
+        std::poisson_distribution<size_t> n_clusters_distr(mean_n_clusters);
+        const size_t n_clusters = n_clusters_distr(generator);
+        for(size_t n = 0; n < n_clusters; ++n) {
+            GenerateCluster(generator, cluster_pixels);
+            for(const auto& pixel_with_charge : cluster_pixels)
+                addHit(pixel_with_charge.first, ChargeToAdc(pixel_with_charge.second));
+        }
+    }
+
+    if(mean_n_noise_hits > 0) {
+        std::poisson_distribution<size_t> n_noise_hits_distr(mean_n_noise_hits);
+        const size_t n_noise_hits = n_noise_hits_distr(generator);
+        for(size_t n = 0; n < n_noise_hits; ++n) {
+            const Pixel pixel = chip_layout.GetPixel(pixel_id_distr(generator));
+            const double charge = config.threshold + std::abs(normal_distr(generator)) * config.charge_width;
+            addHit(pixel, ChargeToAdc(charge));
+        }
+    }
+    PIXEL_STUDIES_COUNT(ChipConstruction, Chips, 1);
+    PIXEL_STUDIES_COUNT(ChipConstruction, Hits, chip_pixels.size());
+}
+
+void HitGenerator::GenerateCluster(Generator& gen, PixelChargeVector& pixels)
+{
+    static constexpr size_t n_steps_per_pixel = 4;
+
+    pixels.clear();
+    const double max_length = config.max_cluster_length - 1;
+    const double row_start = unit_distr(gen) * chip_layout.n_rows;
+    const double column_start = unit_distr(gen) * chip_layout.n_columns;
+    const double tan_row = std::tan(row_angle_distr(gen));
+    const double tan_column = std::tan(column_angle_distr(gen));
+    double delta_row = config.thickness_over_row_pitch * tan_row;
+    double delta_column = config.thickness_over_column_pitch * tan_column;
+    delta_row = std::max(-max_length, std::min(max_length, delta_row));
+    delta_column = std::max(-max_length, std::min(max_length, delta_column));
+
+    // Moyal distribution: charge = mpv - width * ln(z^2), z ~ N(0, 1).
+    const double z = normal_distr(gen);
+    const double charge_per_thickness = std::max(0., config.charge_mpv - config.charge_width * std::log(z * z));
+    const double path_length = std::sqrt(1. + tan_row * tan_row + tan_column * tan_column);
+    const double charge = charge_per_thickness * path_length;
+
+    const double max_delta = std::max(std::abs(delta_row), std::abs(delta_column));
+    const size_t n_steps = n_steps_per_pixel * size_t(std::ceil(max_delta)) + 1;
+    const double charge_per_step = charge / n_steps;
+    for(size_t n = 0; n < n_steps; ++n) {
+        const double t = (n + 0.5) / n_steps;
+        const Pixel pixel(std::floor(row_start + t * delta_row), std::floor(column_start + t * delta_column));
+        if(pixels.size() && pixels.back().first == pixel)
+            pixels.back().second += charge_per_step;
+        else
+            pixels.emplace_back(pixel, charge_per_step);
+    }
+
+    pixels.erase(std::remove_if(pixels.begin(), pixels.end(), [&](const std::pair<Pixel, double>& p) {
+        return p.second < config.threshold;
+    }), pixels.end());
+}
+
+size_t HitGenerator::ChargeToAdc(double charge) const
+{
+    const double adc = std::round(charge);
+    return adc < 1 ? 1 : std::min<size_t>(config.max_adc, adc);
+}
+
+} // namespace pixel_studies
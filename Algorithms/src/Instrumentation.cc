@@ -0,0 +1,154 @@
+/*! Per-stage timers and counters for the hot paths of the library.
+This file is part of https://github.com/kandrosov/OnChipDataCompression. */
+
+#include <iomanip>
+#include <map>
+#include "../interface/Instrumentation.h"
+
+namespace pixel_studies {
+namespace instrumentation {
+
+const std::string& StageName(Stage stage)
+{
+    static const std::map<Stage, std::string> names = {
+        { Stage::ChipConstruction, "ChipConstruction" }, { Stage::Repartition, "Repartition" },
+        { Stage::Ordering, "Ordering" }, { Stage::Encoding, "Encoding" }, { Stage::Decoding, "Decoding" },
+        { Stage::Verification, "Verification" }, { Stage::DictionaryTraining, "DictionaryTraining" },
+    };
+    return names.at(stage);
+}
+
+const std::string& CounterName(Counter counter)
+{
+    static const std::map<Counter, std::string> names = {
+        { Counter::Chips, "chips" }, { Counter::Hits, "hits" }, { Counter::Bits, "bits" },
+        { Counter::Escapes, "escapes" }, { Counter::FastPaths, "fast_paths" }, { Counter::CacheHits, "cache_hits" },
+    };
+    return names.at(counter);
+}
+
+StageStatistics& StageStatistics::operator+=(const StageStatistics& other)
+{
+    n_calls += other.n_calls;
+    total_time += other.total_time;
+    for(size_t n = 0; n < NumberOfCounters; ++n)
+        counters[n] += other.counters[n];
+    return *this;
+}
+
+void ThreadRecorder::AddTime(Stage stage, const Clock::time_point& start, const Clock::duration& duration)
+{
+    StageStatistics& stat = statistics[static_cast<size_t>(stage)];
+    ++stat.n_calls;
+    stat.total_time += duration;
+    if(trace.size() < Registry::Instance().GetMaxTraceEventsPerThread())
+        trace.push_back(TraceEvent{ stage, start, duration });
+}
+
+void ThreadRecorder::Reset()
+{
+    statistics = StageStatisticsArray();
+    trace.clear();
+}
+
+Registry& Registry::Instance()
+{
+    static Registry registry;
+    return registry;
+}
+
+Registry::Registry() : creation_time(Clock::now()), max_trace_events_per_thread(0) {}
+
+ThreadRecorder& Registry::GetThreadRecorder()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    recorders.emplace_back(new ThreadRecorder(recorders.size()));
+    return *recorders.back();
+}
+
+void Registry::EnableTrace(size_t max_events_per_thread)
+{
+    max_trace_events_per_thread = max_events_per_thread;
+}
+
+StageStatisticsArray Registry::GetTotalStatistics() const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    StageStatisticsArray total;
+    for(const auto& recorder : recorders) {
+        for(size_t n = 0; n < NumberOfStages; ++n)
+            total[n] += recorder->GetStatistics()[n];
+    }
+    return total;
+}
+
+void Registry::WriteSummaryRow(std::ostream& os, const std::string& thread_name, Stage stage,
+                               const StageStatistics& stat)
+{
+    static constexpr int thread_width = 8, stage_width = 20, column_width = 14;
+    const double total_time = std::chrono::duration<double>(stat.total_time).count();
+    const double mean_time = stat.n_calls ? total_time / stat.n_calls * 1e6 : 0;
+    os << std::left << std::setw(thread_width) << thread_name << std::setw(stage_width) << StageName(stage)
+       << std::right << std::setw(column_width) << stat.n_calls << std::setw(column_width) << std::fixed
+       << std::setprecision(3) << total_time << std::setw(column_width) << mean_time;
+    for(size_t n = 0; n < NumberOfCounters; ++n)
+        os << std::setw(column_width) << stat.counters[n];
+    os << std::defaultfloat << "\n";
+}
+
+void Registry::WriteSummary(std::ostream& os, bool per_thread) const
+{
+    static constexpr int thread_width = 8, stage_width = 20, column_width = 14;
+    os << std::left << std::setw(thread_width) << "thread" << std::setw(stage_width) << "stage" << std::right
+       << std::setw(column_width) << "calls" << std::setw(column_width) << "total_s" << std::setw(column_width)
+       << "mean_us";
+    for(size_t n = 0; n < NumberOfCounters; ++n)
+        os << std::setw(column_width) << CounterName(static_cast<Counter>(n));
+    os << "\n";
+
+    const StageStatisticsArray total = GetTotalStatistics();
+    for(size_t n = 0; n < NumberOfStages; ++n) {
+        if(total[n].n_calls || total[n].counters != StageStatistics().counters)
+            WriteSummaryRow(os, "all", static_cast<Stage>(n), total[n]);
+    }
+
+    if(per_thread) {
+        std::lock_guard<std::mutex> lock(mutex);
+        for(const auto& recorder : recorders) {
+            for(size_t n = 0; n < NumberOfStages; ++n) {
+                const StageStatistics& stat = recorder->GetStatistics()[n];
+                if(stat.n_calls)
+                    WriteSummaryRow(os, std::to_string(recorder->GetThreadIndex()), static_cast<Stage>(n), stat);
+            }
+        }
+    }
+    os.flush();
+}
+
+void Registry::WriteChromeTrace(std::ostream& os) const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    os << "{\"traceEvents\": [";
+    bool first = true;
+    for(const auto& recorder : recorders) {
+        for(const TraceEvent& event : recorder->GetTrace()) {
+            const double ts = std::chrono::duration<double, std::micro>(event.start - creation_time).count();
+            const double dur = std::chrono::duration<double, std::micro>(event.duration).count();
+            os << (first ? "\n" : ",\n") << "{\"name\": \"" << StageName(event.stage)
+               << "\", \"ph\": \"X\", \"pid\": 0, \"tid\": " << recorder->GetThreadIndex() << std::fixed
+               << std::setprecision(3) << ", \"ts\": " << ts << ", \"dur\": " << dur << "}" << std::defaultfloat;
+            first = false;
+        }
+    }
+    os << "\n], \"displayTimeUnit\": \"ns\"}" << std::endl;
+}
+
+void Registry::Reset()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    for(const auto& recorder : recorders)
+        recorder->Reset();
+}
+
+} // namespace instrumentation
+} // namespace pixel_studies
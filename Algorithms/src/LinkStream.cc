@@ -0,0 +1,235 @@
+/*! Aggregated link stream that carries the packages of several chips.
+This file is part of https://github.com/kandrosov/OnChipDataCompression. */
+
+#include <cstring>
+#include <exception>
+#include <thread>
+#include "../interface/LinkStream.h"
+
+namespace pixel_studies {
+
+namespace {
+/// CRC-16/CCITT-FALSE: polynomial 0x1021, initial value 0xFFFF.
+uint16_t Crc16(const uint8_t* bytes, size_t n_bytes)
+{
+    static const std::array<uint16_t, 256> table = [] {
+        std::array<uint16_t, 256> crc_table;
+        for(size_t n = 0; n < crc_table.size(); ++n) {
+            uint16_t crc = static_cast<uint16_t>(n << 8);
+            for(size_t bit = 0; bit < 8; ++bit)
+                crc = static_cast<uint16_t>(crc & 0x8000 ? (crc << 1) ^ 0x1021 : crc << 1);
+            crc_table[n] = crc;
+        }
+        return crc_table;
+    }();
+
+    uint16_t crc = 0xFFFF;
+    for(size_t n = 0; n < n_bytes; ++n)
+        crc = static_cast<uint16_t>((crc << 8) ^ table[(crc >> 8) ^ bytes[n]]);
+    return crc;
+}
+
+void WriteValue(std::vector<uint8_t>& bytes, uint64_t value, size_t n_bytes)
+{
+    for(size_t n = 0; n < n_bytes; ++n)
+        bytes.push_back(static_cast<uint8_t>(value >> (n * 8)));
+}
+
+uint64_t ReadValue(const uint8_t* bytes, size_t n_bytes)
+{
+    uint64_t value = 0;
+    for(size_t n = 0; n < n_bytes; ++n)
+        value |= uint64_t(bytes[n]) << (n * 8);
+    return value;
+}
+
+constexpr size_t ChipIdOffset = LinkFrame::SyncWordSize, NbitsOffset = ChipIdOffset + 2;
+constexpr size_t HeaderCrcOffset = NbitsOffset + 4;
+} // anonymous namespace
+
+void LinkStreamStatistics::Add(const LinkStreamStatistics& other)
+{
+    n_frames += other.n_frames;
+    n_corrupted_frames += other.n_corrupted_frames;
+    n_resynchronisations += other.n_resynchronisations;
+    n_skipped_bytes += other.n_skipped_bytes;
+}
+
+void LinkStreamWriter::AddPackage(uint16_t chip_id, const Package& package)
+{
+    if(package.size() > std::numeric_limits<uint32_t>::max())
+        throw exception("Package is too big to be sent as a single link frame.");
+    const size_t n_bytes = (package.size() + Package::BitsPerItem - 1) / Package::BitsPerItem;
+    bytes.reserve(bytes.size() + LinkFrame::HeaderSize + n_bytes + LinkFrame::TrailerSize);
+
+    const size_t header_offset = bytes.size();
+    WriteValue(bytes, LinkFrame::SyncWord, LinkFrame::SyncWordSize);
+    WriteValue(bytes, chip_id, 2);
+    WriteValue(bytes, package.size(), 4);
+    WriteValue(bytes, Crc16(bytes.data() + header_offset + ChipIdOffset, HeaderCrcOffset - ChipIdOffset), 2);
+
+    const uint8_t* payload = package.container().data();
+    bytes.insert(bytes.end(), payload, payload + n_bytes);
+    WriteValue(bytes, Crc16(payload, n_bytes), 2);
+    ++n_frames;
+}
+
+void LinkStreamWriter::Clear()
+{
+    bytes.clear();
+    n_frames = 0;
+}
+
+LinkStreamReader::FrameVector LinkStreamReader::FindFrames(size_t n_threads, LinkStreamStatistics* stat) const
+{
+    n_threads = std::max<size_t>(1, std::min(n_threads, data_size / MinBytesPerThread));
+    std::vector<Range> ranges(n_threads);
+    const auto scan = [&](size_t thread_id) {
+        Range& range = ranges.at(thread_id);
+        range.begin = data_size * thread_id / n_threads;
+        range.end = data_size * (thread_id + 1) / n_threads;
+        range.first = FindSync(range.begin, range.end);
+        if(range.first == NotFound)
+            range.next = NotFound;
+        else
+            ScanRange(range.first, range);
+    };
+
+    std::vector<std::thread> threads;
+    for(size_t thread_id = 1; thread_id < n_threads; ++thread_id)
+        threads.emplace_back(scan, thread_id);
+    scan(0);
+    for(auto& thread : threads)
+        thread.join();
+
+    // A range that does not continue the previous one has started on a false sync word inside a package, so it is
+    // scanned again from the end of the last frame of the previous range.
+    for(size_t thread_id = 1; thread_id < n_threads; ++thread_id) {
+        const size_t expected_first = ranges.at(thread_id - 1).next;
+        Range& range = ranges.at(thread_id);
+        if(expected_first == NotFound || range.first == expected_first) continue;
+        range.frames.clear();
+        range.stat = LinkStreamStatistics();
+        range.first = expected_first;
+        ScanRange(expected_first, range);
+    }
+
+    FrameVector frames;
+    LinkStreamStatistics total_stat;
+    for(const Range& range : ranges) {
+        frames.insert(frames.end(), range.frames.begin(), range.frames.end());
+        total_stat.Add(range.stat);
+    }
+    if(stat)
+        stat->Add(total_stat);
+    return frames;
+}
+
+Package LinkStreamReader::GetPackage(const LinkFrame& frame) const
+{
+    if(frame.offset + frame.size() > data_size)
+        throw exception("Link frame at %1% is outside of the stream.") % frame.offset;
+    Package::FieldSizeCollection field_sizes;
+    field_sizes.fill(0);
+    return Package(data + frame.payload_offset(), frame.n_bits, Package::PositionCollection(), field_sizes);
+}
+
+LinkStreamReader::ChipVector LinkStreamReader::Decode(const ChipDataEncoder& encoder, size_t n_threads,
+                                                      LinkStreamStatistics* stat) const
+{
+    const FrameVector frames = FindFrames(n_threads, stat);
+    n_threads = std::max<size_t>(1, std::min(n_threads, frames.size()));
+    std::vector<ChipPtr> chips(frames.size());
+    std::vector<std::exception_ptr> errors(n_threads);
+    const auto decode = [&](size_t thread_id) {
+        try {
+            const size_t begin = frames.size() * thread_id / n_threads;
+            const size_t end = frames.size() * (thread_id + 1) / n_threads;
+            for(size_t n = begin; n < end; ++n) {
+                if(!frames.at(n).is_valid) continue;
+                chips.at(n) = std::make_shared<Chip>(encoder.Decode(GetPackage(frames.at(n))));
+            }
+        } catch(...) {
+            errors.at(thread_id) = std::current_exception();
+        }
+    };
+
+    std::vector<std::thread> threads;
+    for(size_t thread_id = 1; thread_id < n_threads; ++thread_id)
+        threads.emplace_back(decode, thread_id);
+    decode(0);
+    for(auto& thread : threads)
+        thread.join();
+    for(const auto& error : errors) {
+        if(error)
+            std::rethrow_exception(error);
+    }
+
+    ChipVector result;
+    result.reserve(frames.size());
+    for(size_t n = 0; n < frames.size(); ++n) {
+        if(chips.at(n))
+            result.push_back(LinkStreamChip{ frames.at(n).chip_id, chips.at(n) });
+    }
+    return result;
+}
+
+size_t LinkStreamReader::FindSync(size_t begin, size_t end) const
+{
+    static constexpr uint8_t first_sync_byte = LinkFrame::SyncWord & 0xFF;
+    end = std::min(end, data_size);
+    for(size_t pos = begin; pos < end; ++pos) {
+        const void* found = std::memchr(data + pos, first_sync_byte, end - pos);
+        if(!found)
+            return NotFound;
+        pos = static_cast<const uint8_t*>(found) - data;
+        LinkFrame frame, next_frame;
+        if(!ReadHeader(pos, frame)) continue;
+        const size_t next_offset = pos + frame.size();
+        if(next_offset == data_size || ReadHeader(next_offset, next_frame))
+            return pos;
+    }
+    return NotFound;
+}
+
+bool LinkStreamReader::ReadHeader(size_t offset, LinkFrame& frame) const
+{
+    if(offset > data_size || data_size - offset < LinkFrame::HeaderSize + LinkFrame::TrailerSize)
+        return false;
+    const uint8_t* header = data + offset;
+    if(ReadValue(header, LinkFrame::SyncWordSize) != LinkFrame::SyncWord)
+        return false;
+    if(ReadValue(header + HeaderCrcOffset, 2) != Crc16(header + ChipIdOffset, HeaderCrcOffset - ChipIdOffset))
+        return false;
+    frame.offset = offset;
+    frame.chip_id = static_cast<uint16_t>(ReadValue(header + ChipIdOffset, 2));
+    frame.n_bits = ReadValue(header + NbitsOffset, 4);
+    if(frame.size() > data_size - offset)
+        return false;
+    const uint8_t* payload = data + frame.payload_offset();
+    frame.is_valid = ReadValue(payload + frame.payload_size(), 2) == Crc16(payload, frame.payload_size());
+    return true;
+}
+
+void LinkStreamReader::ScanRange(size_t start, Range& range) const
+{
+    size_t pos = start;
+    while(pos < range.end) {
+        LinkFrame frame;
+        if(ReadHeader(pos, frame)) {
+            range.frames.push_back(frame);
+            ++range.stat.n_frames;
+            if(!frame.is_valid)
+                ++range.stat.n_corrupted_frames;
+            pos += frame.size();
+            continue;
+        }
+        const size_t next = FindSync(pos + 1, range.end);
+        ++range.stat.n_resynchronisations;
+        range.stat.n_skipped_bytes += (next == NotFound ? range.end : next) - pos;
+        pos = next;
+    }
+    range.next = pos;
+}
+
+} // namespace pixel_studies
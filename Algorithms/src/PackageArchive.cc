@@ -0,0 +1,314 @@
+/*! Classes to write and read archives of encoded packages.
+This file is part of https://github.com/kandrosov/OnChipDataCompression. */
+
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "../interface/PackageArchive.h"
+
+namespace pixel_studies {
+
+namespace {
+const char Magic[] = "PXPKGARC";
+constexpr size_t MagicSize = sizeof(Magic) - 1;
+constexpr size_t HeaderSize = MagicSize + 2 * sizeof(uint32_t);
+constexpr size_t FooterSize = 3 * sizeof(uint64_t) + MagicSize;
+constexpr size_t EntrySize = 3 * sizeof(uint64_t) + 6 * sizeof(uint32_t);
+
+void CheckByteOrder()
+{
+#if __BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__
+    throw exception("Package archives are supported only on the little-endian platforms.");
+#endif
+}
+
+uint64_t ReadoutPositionsOffset(const PackageArchiveEntry& entry)
+{
+    const uint64_t data_end = entry.data_offset + (entry.n_bits + Package::BitsPerItem - 1) / Package::BitsPerItem;
+    return (data_end + sizeof(uint32_t) - 1) / sizeof(uint32_t) * sizeof(uint32_t);
+}
+} // anonymous namespace
+
+size_t PackageView::field_size(FieldCategory category) const
+{
+    const size_t index = static_cast<size_t>(category);
+    return index < n_field_categories ? field_sizes[index] : 0;
+}
+
+Package PackageView::ToPackage() const
+{
+    Package::FieldSizeCollection package_field_sizes;
+    package_field_sizes.fill(0);
+    for(size_t n = 0; n < std::min(n_field_categories, size_t(Package::NumberOfFieldCategories)); ++n)
+        package_field_sizes[n] = field_sizes[n];
+    const Package::PositionCollection positions(readout_positions, readout_positions + n_readout_positions);
+    return Package(data, n_bits, positions, package_field_sizes);
+}
+
+PackageArchiveWriter::PackageArchiveWriter(const std::string& _file_name) :
+    file_name(_file_name), file(file_name, std::ios::binary), offset(0), is_open(true)
+{
+    CheckByteOrder();
+    if(!file.is_open())
+        throw exception("Unable to create package archive '%1%'.") % file_name;
+    WriteBytes(Magic, MagicSize);
+    WriteValue<uint32_t>(uint32_t(Version));
+    WriteValue<uint32_t>(Package::NumberOfFieldCategories);
+}
+
+PackageArchiveWriter::~PackageArchiveWriter()
+{
+    try {
+        Close();
+    } catch(std::exception& e) {
+        std::cerr << "ERROR: " << e.what() << std::endl;
+    }
+}
+
+void PackageArchiveWriter::WritePackage(const std::string& format, uint32_t run_id, uint32_t lumi_id,
+                                        uint64_t event_id, uint32_t module_id, uint32_t chip_id,
+                                        const Package& package)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    if(!is_open)
+        throw exception("Package archive '%1%' is already closed.") % file_name;
+    if(package.size() > std::numeric_limits<uint32_t>::max())
+        throw exception("Package is too big to be stored in the archive.");
+
+    PackageArchiveEntry entry;
+    entry.run_id = run_id;
+    entry.lumi_id = lumi_id;
+    entry.event_id = event_id;
+    entry.module_id = module_id;
+    entry.chip_id = chip_id;
+    const auto format_iter = std::find(formats.begin(), formats.end(), format);
+    entry.format_id = static_cast<uint32_t>(format_iter - formats.begin());
+    if(format_iter == formats.end())
+        formats.push_back(format);
+    entry.n_readout_positions = static_cast<uint32_t>(package.readout_positions().size());
+    entry.data_offset = offset;
+    entry.n_bits = package.size();
+
+    WriteBytes(package.container().data(), (package.size() + Package::BitsPerItem - 1) / Package::BitsPerItem);
+    WritePadding(sizeof(uint32_t));
+    for(size_t position : package.readout_positions())
+        WriteValue<uint32_t>(static_cast<uint32_t>(position));
+    for(size_t field_size : package.field_sizes())
+        WriteValue<uint32_t>(static_cast<uint32_t>(field_size));
+    entries.push_back(entry);
+}
+
+void PackageArchiveWriter::Close()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    if(!is_open) return;
+    is_open = false;
+
+    WritePadding(sizeof(uint64_t));
+    const uint64_t index_offset = offset;
+    for(const PackageArchiveEntry& entry : entries) {
+        WriteValue(entry.run_id);
+        WriteValue(entry.lumi_id);
+        WriteValue(entry.event_id);
+        WriteValue(entry.module_id);
+        WriteValue(entry.chip_id);
+        WriteValue(entry.format_id);
+        WriteValue(entry.n_readout_positions);
+        WriteValue(entry.data_offset);
+        WriteValue(entry.n_bits);
+    }
+    const uint64_t formats_offset = offset;
+    WriteValue<uint32_t>(static_cast<uint32_t>(formats.size()));
+    for(const std::string& format : formats) {
+        WriteValue<uint32_t>(static_cast<uint32_t>(format.size()));
+        WriteBytes(format.data(), format.size());
+    }
+    WriteValue(index_offset);
+    WriteValue(formats_offset);
+    WriteValue<uint64_t>(entries.size());
+    WriteBytes(Magic, MagicSize);
+    file.close();
+    if(file.fail())
+        throw exception("Error while writing package archive '%1%'.") % file_name;
+}
+
+template<typename Value>
+void PackageArchiveWriter::WriteValue(const Value& value)
+{
+    WriteBytes(&value, sizeof(Value));
+}
+
+void PackageArchiveWriter::WriteBytes(const void* bytes, size_t n_bytes)
+{
+    file.write(static_cast<const char*>(bytes), n_bytes);
+    if(file.fail())
+        throw exception("Error while writing package archive '%1%'.") % file_name;
+    offset += n_bytes;
+}
+
+void PackageArchiveWriter::WritePadding(size_t alignment)
+{
+    static const char zeros[sizeof(uint64_t)] = {};
+    WriteBytes(zeros, (alignment - offset % alignment) % alignment);
+}
+
+PackageArchiveReader::PackageArchiveReader(const std::string& _file_name) :
+    file_name(_file_name), mapped_data(nullptr), file_size(0), n_field_categories(0)
+{
+    CheckByteOrder();
+    const int fd = open(file_name.c_str(), O_RDONLY);
+    if(fd < 0)
+        throw exception("Unable to open package archive '%1%'.") % file_name;
+    struct stat file_stat;
+    if(fstat(fd, &file_stat) != 0) {
+        close(fd);
+        throw exception("Unable to get size of package archive '%1%'.") % file_name;
+    }
+    file_size = static_cast<size_t>(file_stat.st_size);
+    if(file_size < HeaderSize + FooterSize) {
+        close(fd);
+        throw exception("Package archive '%1%' is too small.") % file_name;
+    }
+    void* mapped = mmap(nullptr, file_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(mapped == MAP_FAILED)
+        throw exception("Unable to map package archive '%1%' into memory.") % file_name;
+    mapped_data = static_cast<const uint8_t*>(mapped);
+
+    try {
+        if(std::memcmp(mapped_data, Magic, MagicSize) || std::memcmp(mapped_data + file_size - MagicSize, Magic,
+                                                                     MagicSize))
+            throw exception("'%1%' is not a package archive or it was not closed properly.") % file_name;
+        uint64_t position = MagicSize;
+        const uint32_t version = ReadValue<uint32_t>(position);
+        if(version != PackageArchiveWriter::Version)
+            throw exception("Unsupported version %1% of package archive '%2%'.") % version % file_name;
+        n_field_categories = ReadValue<uint32_t>(position);
+
+        position = file_size - FooterSize;
+        uint64_t index_offset = ReadValue<uint64_t>(position);
+        uint64_t formats_offset = ReadValue<uint64_t>(position);
+        const uint64_t n_entries = ReadValue<uint64_t>(position);
+        if(n_entries > file_size / EntrySize)
+            throw exception("Package archive '%1%' is corrupted.") % file_name;
+        CheckRange(index_offset, n_entries * EntrySize);
+
+        uint32_t n_formats = ReadValue<uint32_t>(formats_offset);
+        for(uint32_t n = 0; n < n_formats; ++n) {
+            const uint32_t length = ReadValue<uint32_t>(formats_offset);
+            CheckRange(formats_offset, length);
+            formats.emplace_back(reinterpret_cast<const char*>(mapped_data + formats_offset), length);
+            formats_offset += length;
+        }
+
+        entries.resize(n_entries);
+        for(PackageArchiveEntry& entry : entries) {
+            entry.run_id = ReadValue<uint32_t>(index_offset);
+            entry.lumi_id = ReadValue<uint32_t>(index_offset);
+            entry.event_id = ReadValue<uint64_t>(index_offset);
+            entry.module_id = ReadValue<uint32_t>(index_offset);
+            entry.chip_id = ReadValue<uint32_t>(index_offset);
+            entry.format_id = ReadValue<uint32_t>(index_offset);
+            entry.n_readout_positions = ReadValue<uint32_t>(index_offset);
+            entry.data_offset = ReadValue<uint64_t>(index_offset);
+            entry.n_bits = ReadValue<uint64_t>(index_offset);
+            if(entry.format_id >= formats.size())
+                throw exception("Invalid format id in package archive '%1%'.") % file_name;
+            CheckRange(ReadoutPositionsOffset(entry),
+                       (uint64_t(entry.n_readout_positions) + n_field_categories) * sizeof(uint32_t));
+        }
+    } catch(...) {
+        munmap(const_cast<uint8_t*>(mapped_data), file_size);
+        throw;
+    }
+
+    sorted_entries.resize(entries.size());
+    for(size_t n = 0; n < entries.size(); ++n)
+        sorted_entries[n] = n;
+    std::stable_sort(sorted_entries.begin(), sorted_entries.end(), [&](size_t first, size_t second) {
+        return EntryLess(entries[first], entries[second]);
+    });
+}
+
+PackageArchiveReader::~PackageArchiveReader()
+{
+    munmap(const_cast<uint8_t*>(mapped_data), file_size);
+}
+
+size_t PackageArchiveReader::GetFormatId(const std::string& format) const
+{
+    const auto iter = std::find(formats.begin(), formats.end(), format);
+    return iter != formats.end() ? static_cast<size_t>(iter - formats.begin()) : NotFound;
+}
+
+PackageView PackageArchiveReader::GetPackage(size_t entry_id) const
+{
+    const PackageArchiveEntry& entry = entries.at(entry_id);
+    const uint32_t* readout_positions = reinterpret_cast<const uint32_t*>(mapped_data + ReadoutPositionsOffset(entry));
+    return PackageView{ mapped_data + entry.data_offset, entry.n_bits, readout_positions, entry.n_readout_positions,
+                        readout_positions + entry.n_readout_positions, n_field_categories };
+}
+
+size_t PackageArchiveReader::FindEntry(const std::string& format, uint32_t run_id, uint32_t lumi_id,
+                                       uint64_t event_id, uint32_t module_id, uint32_t chip_id) const
+{
+    const size_t format_id = GetFormatId(format);
+    if(format_id == NotFound) return NotFound;
+    PackageArchiveEntry key;
+    key.format_id = static_cast<uint32_t>(format_id);
+    key.run_id = run_id;
+    key.lumi_id = lumi_id;
+    key.event_id = event_id;
+    key.module_id = module_id;
+    key.chip_id = chip_id;
+    const auto iter = std::lower_bound(sorted_entries.begin(), sorted_entries.end(), key,
+                                       [&](size_t entry_id, const PackageArchiveEntry& value) {
+        return EntryLess(entries[entry_id], value);
+    });
+    if(iter == sorted_entries.end() || EntryLess(key, entries[*iter]))
+        return NotFound;
+    return *iter;
+}
+
+std::vector<size_t> PackageArchiveReader::SelectEntries(const std::string& format) const
+{
+    std::vector<size_t> selected;
+    const size_t format_id = GetFormatId(format);
+    for(size_t entry_id : sorted_entries) {
+        if(entries[entry_id].format_id == format_id)
+            selected.push_back(entry_id);
+    }
+    return selected;
+}
+
+bool PackageArchiveReader::EntryLess(const PackageArchiveEntry& first, const PackageArchiveEntry& second)
+{
+    if(first.format_id != second.format_id) return first.format_id < second.format_id;
+    if(first.run_id != second.run_id) return first.run_id < second.run_id;
+    if(first.lumi_id != second.lumi_id) return first.lumi_id < second.lumi_id;
+    if(first.event_id != second.event_id) return first.event_id < second.event_id;
+    if(first.module_id != second.module_id) return first.module_id < second.module_id;
+    return first.chip_id < second.chip_id;
+}
+
+template<typename Value>
+Value PackageArchiveReader::ReadValue(uint64_t& position) const
+{
+    CheckRange(position, sizeof(Value));
+    Value value;
+    std::memcpy(&value, mapped_data + position, sizeof(Value));
+    position += sizeof(Value);
+    return value;
+}
+
+void PackageArchiveReader::CheckRange(uint64_t position, uint64_t n_bytes) const
+{
+    if(position > file_size || n_bytes > file_size - position)
+        throw exception("Package archive '%1%' is corrupted.") % file_name;
+}
+
+} // namespace pixel_studies
@@ -0,0 +1,108 @@
+/*! Memoisation cache of the encoded packages indexed by the chip layout and content.
+This file is part of https://github.com/kandrosov/OnChipDataCompression. */
+
+#include <algorithm>
+#include "../interface/PackageCache.h"
+
+namespace pixel_studies {
+
+PackageCache::PackageCache(size_t _max_size) : max_size(_max_size), n_hits(0), n_misses(0)
+{
+    if(!max_size)
+        throw exception("Package cache size should be a positive number.");
+}
+
+uint64_t PackageCache::Hash(const Chip& chip)
+{
+    // FNV-1a over the chip layout, the pixel coordinates and ADC values, mixed once more at the end.
+    static constexpr uint64_t offset_basis = 0xcbf29ce484222325ULL, prime = 0x100000001b3ULL;
+    uint64_t hash = offset_basis;
+    const auto addValue = [&](uint64_t value) {
+        hash ^= value;
+        hash *= prime;
+    };
+    const MultiRegionLayout& layout = chip.GetMultiRegionLayout();
+    addValue(layout.n_rows);
+    addValue(layout.n_columns);
+    addValue(layout.region_layout.n_rows);
+    addValue(layout.region_layout.n_columns);
+    addValue(chip.GetPixels().size());
+    for(const auto& pixel_with_adc : chip.GetPixels()) {
+        addValue(static_cast<uint16_t>(pixel_with_adc.first.row));
+        addValue(static_cast<uint16_t>(pixel_with_adc.first.column));
+        addValue(pixel_with_adc.second);
+    }
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdULL;
+    hash ^= hash >> 33;
+    return hash;
+}
+
+PackageCache::PackagePtr PackageCache::Find(uint64_t hash, const Chip& chip) const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    const auto iter = entries.find(hash);
+    if(iter == entries.end() || !HasSameLayout(iter->second.layout, chip.GetMultiRegionLayout())
+            || !HasSamePixels(iter->second, chip)) {
+        ++n_misses;
+        return nullptr;
+    }
+    ++n_hits;
+    return iter->second.package;
+}
+
+void PackageCache::Insert(uint64_t hash, const Chip& chip, const Package& package)
+{
+    Entry entry(chip.GetMultiRegionLayout());
+    entry.pixels.assign(chip.GetPixels().begin(), chip.GetPixels().end());
+    entry.package = std::make_shared<const Package>(package);
+
+    std::lock_guard<std::mutex> lock(mutex);
+    auto iter = entries.find(hash);
+    if(iter != entries.end()) {
+        iter->second = std::move(entry);
+        return;
+    }
+    if(entries.size() >= max_size) {
+        entries.erase(insertion_order.front());
+        insertion_order.pop_front();
+    }
+    entries.emplace(hash, std::move(entry));
+    insertion_order.push_back(hash);
+}
+
+size_t PackageCache::size() const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return entries.size();
+}
+
+size_t PackageCache::GetNumberOfHits() const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return n_hits;
+}
+
+size_t PackageCache::GetNumberOfMisses() const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return n_misses;
+}
+
+bool PackageCache::HasSameLayout(const MultiRegionLayout& first, const MultiRegionLayout& second)
+{
+    // MultiRegionLayout::operator== compares only the region split, so the chip dimensions are compared separately.
+    return static_cast<const RegionLayout&>(first) == second && first == second;
+}
+
+bool PackageCache::HasSamePixels(const Entry& entry, const Chip& chip)
+{
+    const auto& pixels = chip.GetPixels();
+    return entry.pixels.size() == pixels.size()
+            && std::equal(entry.pixels.begin(), entry.pixels.end(), pixels.begin(),
+                          [](const PixelAdcPair& cached, const PixelWithAdcMap::value_type& pixel) {
+                              return cached.first == pixel.first && cached.second == pixel.second;
+                          });
+}
+
+} // namespace pixel_studies
@@ -0,0 +1,174 @@
+/*! Opt-in counting of the heap allocations for the benchmark executables.
+The global operator new/delete are replaced only if PIXEL_STUDIES_COUNT_ALLOCATIONS is defined. In that case this file
+should be included in exactly one translation unit of the executable.
+Each block remembers the counters of the thread that allocated it, so a block released by another thread is subtracted
+from the live bytes of the allocating thread. Hence the footprint of the objects built by one thread is correct even if
+they are destroyed by another thread.
+This file is part of https://github.com/kandrosov/OnChipDataCompression. */
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <new>
+
+namespace pixel_studies {
+namespace benchmark {
+
+struct AllocationStatistics {
+    size_t n_allocations, n_bytes, peak_live_bytes;
+    int64_t retained_bytes;
+
+    AllocationStatistics() : n_allocations(0), n_bytes(0), peak_live_bytes(0), retained_bytes(0) {}
+};
+
+/// Per-thread allocation counters updated by the replaced operator new/delete.
+class AllocationCounter {
+public:
+    /// Only the live bytes are updated by the other threads, when they release the blocks allocated by this thread.
+    struct Counters {
+        size_t n_allocations = 0, n_bytes = 0;
+        std::atomic<int64_t> live_bytes{0};
+        int64_t peak_live_bytes = 0;
+    };
+
+    static bool IsEnabled()
+    {
+#ifdef PIXEL_STUDIES_COUNT_ALLOCATIONS
+        return true;
+#else
+        return false;
+#endif
+    }
+
+    /// The counters are allocated with malloc and never destroyed, so the blocks that outlive their thread can still
+    /// be released.
+    static Counters& ThreadCounters()
+    {
+        static thread_local Counters* counters = new(std::malloc(sizeof(Counters))) Counters();
+        return *counters;
+    }
+
+    /// Returns the counters that own the allocated block.
+    static Counters* OnAllocate(size_t size)
+    {
+        Counters& counters = ThreadCounters();
+        ++counters.n_allocations;
+        counters.n_bytes += size;
+        const int64_t live_bytes = counters.live_bytes.fetch_add(size, std::memory_order_relaxed) + size;
+        counters.peak_live_bytes = std::max(counters.peak_live_bytes, live_bytes);
+        return &counters;
+    }
+
+    static void OnDeallocate(Counters* owner, size_t size)
+    {
+        owner->live_bytes.fetch_sub(size, std::memory_order_relaxed);
+    }
+
+    /// Collects the allocation statistics of the current thread between construction and the call of Stop.
+    /// The peak of live bytes is measured relative to the live bytes at the start of the scope. The retained bytes
+    /// are the bytes allocated by the current thread within the scope that are not yet released by any thread.
+    class Scope {
+    public:
+        Scope() :
+            start_n_allocations(ThreadCounters().n_allocations), start_n_bytes(ThreadCounters().n_bytes),
+            start_live_bytes(ThreadCounters().live_bytes.load(std::memory_order_relaxed))
+        {
+            ThreadCounters().peak_live_bytes = start_live_bytes;
+        }
+
+        AllocationStatistics Stop() const
+        {
+            const Counters& counters = ThreadCounters();
+            const int64_t live_bytes = counters.live_bytes.load(std::memory_order_relaxed);
+            AllocationStatistics stat;
+            stat.n_allocations = counters.n_allocations - start_n_allocations;
+            stat.n_bytes = counters.n_bytes - start_n_bytes;
+            stat.peak_live_bytes = size_t(std::max<int64_t>(0, counters.peak_live_bytes - start_live_bytes));
+            stat.retained_bytes = live_bytes - start_live_bytes;
+            return stat;
+        }
+
+    private:
+        size_t start_n_allocations, start_n_bytes;
+        int64_t start_live_bytes;
+    };
+};
+
+} // namespace benchmark
+} // namespace pixel_studies
+
+#ifdef PIXEL_STUDIES_COUNT_ALLOCATIONS
+
+namespace pixel_studies {
+namespace benchmark {
+namespace detail {
+
+// The block size and the owning counters are stored in front of each block. The header size preserves the
+// fundamental alignment.
+struct AllocationHeader {
+    size_t size;
+    AllocationCounter::Counters* owner;
+};
+
+constexpr size_t AllocationHeaderSize = (sizeof(AllocationHeader) + alignof(std::max_align_t) - 1)
+        / alignof(std::max_align_t) * alignof(std::max_align_t);
+
+inline void* CountedAllocate(size_t size) noexcept
+{
+    void* block = std::malloc(size + AllocationHeaderSize);
+    if(!block) return nullptr;
+    AllocationHeader* header = static_cast<AllocationHeader*>(block);
+    header->size = size;
+    header->owner = AllocationCounter::OnAllocate(size);
+    return static_cast<char*>(block) + AllocationHeaderSize;
+}
+
+inline void CountedDeallocate(void* ptr) noexcept
+{
+    if(!ptr) return;
+    void* block = static_cast<char*>(ptr) - AllocationHeaderSize;
+    const AllocationHeader* header = static_cast<const AllocationHeader*>(block);
+    AllocationCounter::OnDeallocate(header->owner, header->size);
+    std::free(block);
+}
+
+inline void* CountedAllocateOrThrow(size_t size)
+{
+    void* ptr = CountedAllocate(size);
+    if(!ptr)
+        throw std::bad_alloc();
+    return ptr;
+}
+
+} // namespace detail
+} // namespace benchmark
+} // namespace pixel_studies
+
+void* operator new(size_t size) { return pixel_studies::benchmark::detail::CountedAllocateOrThrow(size); }
+void* operator new[](size_t size) { return pixel_studies::benchmark::detail::CountedAllocateOrThrow(size); }
+void* operator new(size_t size, const std::nothrow_t&) noexcept
+{
+    return pixel_studies::benchmark::detail::CountedAllocate(size);
+}
+void* operator new[](size_t size, const std::nothrow_t&) noexcept
+{
+    return pixel_studies::benchmark::detail::CountedAllocate(size);
+}
+void operator delete(void* ptr) noexcept { pixel_studies::benchmark::detail::CountedDeallocate(ptr); }
+void operator delete[](void* ptr) noexcept { pixel_studies::benchmark::detail::CountedDeallocate(ptr); }
+void operator delete(void* ptr, size_t) noexcept { pixel_studies::benchmark::detail::CountedDeallocate(ptr); }
+void operator delete[](void* ptr, size_t) noexcept { pixel_studies::benchmark::detail::CountedDeallocate(ptr); }
+void operator delete(void* ptr, const std::nothrow_t&) noexcept
+{
+    pixel_studies::benchmark::detail::CountedDeallocate(ptr);
+}
+void operator delete[](void* ptr, const std::nothrow_t&) noexcept
+{
+    pixel_studies::benchmark::detail::CountedDeallocate(ptr);
+}
+
+#endif
@@ -0,0 +1,467 @@
+/*! End-to-end encode, decode and verify throughput benchmark for each EncoderFormat.
+The decoding of a single macro region is measured as well, which is cheaper only for the formats with a region index,
+together with the decoding of each chip by several threads and the partial decoding of the pixel addresses only and of
+the ADC values only. The packages of all chips
+are also concatenated into a link stream, which is demultiplexed and decoded in parallel. The encoding of the repeated
+chips is measured with the package cache enabled.
+If compiled with PIXEL_STUDIES_COUNT_ALLOCATIONS, the heap allocations per call and the memory footprint of the main
+objects are reported as well. If compiled with PIXEL_STUDIES_INSTRUMENTATION, the per-stage summary is printed at the
+end and the Chrome trace can be saved.
+This file is part of https://github.com/kandrosov/OnChipDataCompression. */
+
+#include <algorithm>
+#include <fstream>
+#include <thread>
+#include <boost/program_options.hpp>
+#include "OnChipDataCompression/Algorithms/interface/ChipDataEncoder.h"
+#include "OnChipDataCompression/Algorithms/interface/DictionaryBuilder.h"
+#include "OnChipDataCompression/Algorithms/interface/HitFile.h"
+#include "OnChipDataCompression/Algorithms/interface/HitGenerator.h"
+#include "OnChipDataCompression/Algorithms/interface/Instrumentation.h"
+#include "OnChipDataCompression/Algorithms/interface/LinkStream.h"
+#include "OnChipDataCompression/Algorithms/interface/QuantileSketch.h"
+#include "OnChipDataCompression/Algorithms/test/AllocationCounter.h"
+#include "OnChipDataCompression/Algorithms/test/BenchmarkTools.h"
+#include "OnChipDataCompression/Algorithms/test/PackedAdcRegion.h"
+
+namespace pixel_studies {
+namespace benchmark {
+
+struct Arguments {
+    std::string input, dictionaries, dictionaries_output, output, trace;
+    size_t n_chips;
+    std::vector<double> hits_per_chip;
+    std::vector<size_t> threads;
+    std::vector<std::string> formats;
+    uint64_t seed;
+};
+
+class BenchmarkChipDataEncoder {
+public:
+    using PackagePtr = std::shared_ptr<Package>;
+    using PackagePtrVector = std::vector<PackagePtr>;
+    using LatencyVector = std::vector<double>;
+
+    explicit BenchmarkChipDataEncoder(const Arguments& _args) :
+        args(_args), results("BenchmarkChipDataEncoder"), chip_layout(400, 400, 1, 4), readout_unit_layout(2, 2)
+    {
+        for(const auto& format : args.formats)
+            ParseEncoderFormat(format);
+    }
+
+    void Run()
+    {
+        static constexpr size_t max_trace_events_per_thread = 1000000;
+        if(!args.trace.empty())
+            instrumentation::Registry::Instance().EnableTrace(max_trace_events_per_thread);
+
+        if(!args.input.empty()) {
+            HitFileReader reader(args.input, chip_layout);
+            ChipPtrVector chips;
+            for(const ChipRecord& record : reader.ReadAll(args.n_chips))
+                chips.push_back(record.chip);
+            RunPoint("input", chips);
+        } else {
+            for(double hits_per_chip : args.hits_per_chip) {
+                HitGeneratorConfig config;
+                config.occupancy = hits_per_chip / chip_layout.GetNumberOfPixels();
+                HitGenerator generator(chip_layout, config, args.seed);
+                RunPoint(ToString(hits_per_chip), generator.Generate(args.n_chips));
+            }
+        }
+
+        if(!args.output.empty()) {
+            std::ofstream f(args.output);
+            f.exceptions(std::ofstream::badbit | std::ofstream::failbit);
+            results.WriteJson(f);
+        }
+
+        if(instrumentation::IsEnabled()) {
+            instrumentation::Registry::Instance().WriteSummary(std::cout, true);
+            if(!args.trace.empty()) {
+                std::ofstream f(args.trace);
+                f.exceptions(std::ofstream::badbit | std::ofstream::failbit);
+                instrumentation::Registry::Instance().WriteChromeTrace(f);
+            }
+        }
+    }
+
+private:
+    void RunPoint(const std::string& hits_per_chip_label, const ChipPtrVector& chips)
+    {
+        size_t n_hits = 0;
+        for(const auto& chip : chips)
+            n_hits += chip->GetPixels().size();
+        const double mean_n_hits = chips.size() ? double(n_hits) / chips.size() : 0;
+
+        // Without the input dictionaries, the dictionaries trained on the benchmark chips are used. They are saved into
+        // a temporary file, unless the output file is specified.
+        std::string dictionaries = args.dictionaries;
+        std::unique_ptr<TemporaryFile> trained_dictionaries;
+        if(dictionaries.empty() && !n_hits)
+            throw exception("Unable to train the dictionaries on chips without hits. Please specify --dictionaries.");
+        for(size_t n_threads : args.threads) {
+            const Result::ParameterMap params = { { "hits_per_chip", hits_per_chip_label },
+                                                  { "threads", ToString(n_threads) } };
+            DictionaryBuilder builder(chip_layout, Ordering::ByRegionByColumn, readout_unit_layout, max_adc,
+                                      max_alphabet_size);
+            Result add_chip = RunStage("add_chip", params, n_threads, chips.size(), [&](size_t n) {
+                builder.AddChip(*chips.at(n));
+            });
+            add_chip.extra_values["hits_per_chip_mean"] = mean_n_hits;
+            results.Add(add_chip);
+            if(dictionaries.empty()) {
+                if(args.dictionaries_output.empty()) {
+                    trained_dictionaries.reset(new TemporaryFile("benchmark_dictionaries_"));
+                    dictionaries = trained_dictionaries->GetFileName();
+                } else {
+                    dictionaries = args.dictionaries_output;
+                }
+                builder.SaveDictionaries(dictionaries);
+            }
+        }
+
+        if(AllocationCounter::IsEnabled())
+            MeasureFootprints(hits_per_chip_label, chips, dictionaries);
+
+        for(const auto& format_name : args.formats) {
+            const ChipDataEncoder encoder(ParseEncoderFormat(format_name), chip_layout, readout_unit_layout, max_adc,
+                                          Ordering::ByRegionByColumn, dictionaries);
+            for(size_t n_threads : args.threads) {
+                const Result::ParameterMap params = { { "format", format_name },
+                                                      { "hits_per_chip", hits_per_chip_label },
+                                                      { "threads", ToString(n_threads) } };
+                PackagePtrVector packages(chips.size());
+                ChipPtrVector decoded_chips(chips.size());
+                std::vector<char> is_valid(chips.size());
+
+                Result encode = RunStage("encode", params, n_threads, chips.size(), [&](size_t n) {
+                    packages.at(n) = std::make_shared<Package>(encoder.Encode(*chips.at(n)));
+                });
+                ChipDataEncoder cached_encoder(encoder);
+                cached_encoder.EnableCache(chips.size());
+                for(const auto& chip : chips)
+                    cached_encoder.Encode(*chip);
+                Result encode_cached = RunStage("encode_cached", params, n_threads, chips.size(), [&](size_t n) {
+                    is_valid.at(n) = cached_encoder.Encode(*chips.at(n)) == *packages.at(n);
+                });
+                size_t n_invalid = std::count(is_valid.begin(), is_valid.end(), 0);
+                if(n_invalid)
+                    throw exception("%1% chips are not correctly encoded with the cache for the format '%2%'.")
+                        % n_invalid % format_name;
+
+                Result decode = RunStage("decode", params, n_threads, chips.size(), [&](size_t n) {
+                    decoded_chips.at(n) = std::make_shared<Chip>(encoder.Decode(*packages.at(n)));
+                });
+                Result verify = RunStage("verify", params, n_threads, chips.size(), [&](size_t n) {
+                    is_valid.at(n) = *decoded_chips.at(n) == *chips.at(n);
+                });
+
+                n_invalid = std::count(is_valid.begin(), is_valid.end(), 0);
+                if(n_invalid)
+                    throw exception("%1% chips are not correctly decoded for the format '%2%'.")
+                        % n_invalid % format_name;
+
+                Result decode_region = RunStage("decode_region", params, n_threads, chips.size(), [&](size_t n) {
+                    const PixelRegion region = encoder.DecodeRegion(*packages.at(n), region_of_interest);
+                    const Chip& chip = *chips.at(n);
+                    is_valid.at(n) = chip.IsRegionActive(region_of_interest)
+                            ? region.HasSamePixels(chip.GetRegion(region_of_interest)) : !region.HasActivePixels();
+                });
+                n_invalid = std::count(is_valid.begin(), is_valid.end(), 0);
+                if(n_invalid)
+                    throw exception("%1% regions are not correctly decoded for the format '%2%'.")
+                        % n_invalid % format_name;
+
+                // The chips are decoded one after another, each of them by up to n_threads threads.
+                Result decode_parallel = RunStage("decode_parallel", params, 1, chips.size(), [&](size_t n) {
+                    decoded_chips.at(n) = std::make_shared<Chip>(encoder.Decode(*packages.at(n), n_threads));
+                });
+                for(size_t n = 0; n < chips.size(); ++n)
+                    is_valid.at(n) = *decoded_chips.at(n) == *chips.at(n);
+                n_invalid = std::count(is_valid.begin(), is_valid.end(), 0);
+                if(n_invalid)
+                    throw exception("%1% chips are not correctly decoded in parallel for the format '%2%'.")
+                        % n_invalid % format_name;
+
+                std::vector<PixelVector> decoded_addresses(chips.size());
+                std::vector<AdcVector> decoded_adcs(chips.size());
+                Result decode_addresses = RunStage("decode_addresses", params, n_threads, chips.size(), [&](size_t n) {
+                    decoded_addresses.at(n) = encoder.DecodeAddresses(*packages.at(n));
+                });
+                Result decode_adcs = RunStage("decode_adcs", params, n_threads, chips.size(), [&](size_t n) {
+                    decoded_adcs.at(n) = encoder.DecodeAdcs(*packages.at(n));
+                });
+                for(size_t n = 0; n < chips.size(); ++n) {
+                    const PixelVector& pixels = decoded_addresses.at(n);
+                    const AdcVector& adcs = decoded_adcs.at(n);
+                    const auto& original_pixels = chips.at(n)->GetPixels();
+                    is_valid.at(n) = pixels.size() == original_pixels.size() && adcs.size() == original_pixels.size();
+                    for(size_t k = 0; k < pixels.size() && is_valid.at(n); ++k) {
+                        const auto iter = original_pixels.find(pixels.at(k));
+                        is_valid.at(n) = iter != original_pixels.end() && iter->second == adcs.at(k);
+                    }
+                }
+                n_invalid = std::count(is_valid.begin(), is_valid.end(), 0);
+                if(n_invalid)
+                    throw exception("%1% chips are not correctly decoded into addresses and ADC values for the format"
+                                    " '%2%'.") % n_invalid % format_name;
+
+                Result link_demux = RunLinkDemux(params, n_threads, encoder, chips, packages);
+
+                size_t n_bits = 0;
+                Package::FieldSizeCollection n_field_bits = {};
+                QuantileSketch bits_per_chip;
+                for(const auto& package : packages) {
+                    n_bits += package->size();
+                    bits_per_chip.Add(package->size());
+                    for(size_t k = 0; k < Package::NumberOfFieldCategories; ++k)
+                        n_field_bits[k] += package->field_sizes()[k];
+                }
+                for(Result* result : { &encode, &encode_cached, &decode, &verify, &decode_region, &decode_parallel,
+                                       &decode_addresses, &decode_adcs, &link_demux }) {
+                    result->extra_values["hits_per_chip_mean"] = mean_n_hits;
+                    result->extra_values["bits_per_chip_mean"] = chips.size() ? double(n_bits) / chips.size() : 0;
+                    if(bits_per_chip.GetCount()) {
+                        result->extra_values["bits_per_chip_p99"] = bits_per_chip.UpperBound(0.99);
+                        result->extra_values["bits_per_chip_p999"] = bits_per_chip.UpperBound(0.999);
+                        result->extra_values["bits_per_chip_max"] = bits_per_chip.GetMax();
+                    }
+                    for(size_t k = 0; k < Package::NumberOfFieldCategories; ++k) {
+                        if(!n_field_bits[k] || !chips.size()) continue;
+                        const std::string& category_name = FieldCategoryName(static_cast<FieldCategory>(k));
+                        result->extra_values["bits_per_chip_mean_" + category_name] =
+                                double(n_field_bits[k]) / chips.size();
+                    }
+                    results.Add(*result);
+                }
+            }
+        }
+    }
+
+    void MeasureFootprints(const std::string& hits_per_chip_label, const ChipPtrVector& chips,
+                           const std::string& dictionaries)
+    {
+        const auto addFootprint = [&](const std::string& object, const AllocationStatistics& stat, size_t n_objects) {
+            Result result;
+            result.name = "footprint";
+            result.parameters = { { "object", object }, { "hits_per_chip", hits_per_chip_label } };
+            result.units = "bytes";
+            result.n_iterations = 1;
+            result.n_items = n_objects ? double(stat.retained_bytes) / n_objects : 0;
+            results.Add(result);
+        };
+
+        {
+            const AllocationCounter::Scope scope;
+            const ChipPtrVector chip_copies = CopyChips(chips);
+            addFootprint("Chip", scope.Stop(), chips.size());
+        }
+        {
+            const AllocationCounter::Scope scope;
+            std::vector<std::vector<PackedAdcRegion>> packed_chips;
+            packed_chips.reserve(chips.size());
+            for(const auto& chip : chips) {
+                std::vector<PackedAdcRegion> packed_regions;
+                const MultiRegionLayout& multi_layout = chip->GetMultiRegionLayout();
+                const size_t n_regions = multi_layout.GetNumberOfRegions();
+                packed_regions.reserve(n_regions);
+                for(size_t region_id = 0; region_id < n_regions; ++region_id) {
+                    // The dense storage keeps all regions, so the inactive ones take the same memory as the others.
+                    if(chip->IsRegionActive(region_id))
+                        packed_regions.emplace_back(chip->GetRegion(region_id), Adc(max_adc));
+                    else
+                        packed_regions.emplace_back(multi_layout.region_layout, Adc(max_adc));
+                }
+                packed_chips.push_back(std::move(packed_regions));
+            }
+            addFootprint("PackedAdcChip", scope.Stop(), chips.size());
+        }
+        {
+            const AllocationCounter::Scope scope;
+            const ChipDataEncoder::StatisticsSource statistics_source(dictionaries);
+            addFootprint("AlphabetStatisticsCollection", scope.Stop(), 1);
+        }
+        for(const auto& format_name : args.formats) {
+            const AllocationCounter::Scope scope;
+            const ChipDataEncoder encoder(ParseEncoderFormat(format_name), chip_layout, readout_unit_layout, max_adc,
+                                          Ordering::ByRegionByColumn, dictionaries);
+            addFootprint("ChipDataEncoder_" + format_name, scope.Stop(), 1);
+        }
+    }
+
+    static ChipPtrVector CopyChips(const ChipPtrVector& chips)
+    {
+        ChipPtrVector chip_copies;
+        chip_copies.reserve(chips.size());
+        for(const auto& chip : chips)
+            chip_copies.push_back(std::make_shared<Chip>(*chip));
+        return chip_copies;
+    }
+
+    static Result RunLinkDemux(const Result::ParameterMap& params, size_t n_threads, const ChipDataEncoder& encoder,
+                               const ChipPtrVector& chips, const PackagePtrVector& packages)
+    {
+        LinkStreamWriter link_stream;
+        for(size_t n = 0; n < packages.size(); ++n)
+            link_stream.AddPackage(static_cast<uint16_t>(n), *packages.at(n));
+        const LinkStreamReader reader(link_stream.GetBytes().data(), link_stream.GetBytes().size());
+
+        LinkStreamStatistics stat;
+        const auto start = Clock::now();
+        const LinkStreamReader::ChipVector link_chips = reader.Decode(encoder, n_threads, &stat);
+        Result result;
+        result.name = "link_demux";
+        result.parameters = params;
+        result.units = "chips";
+        result.n_iterations = 1;
+        result.time = SecondsSince(start);
+        result.n_items = chips.size();
+
+        bool is_valid = link_chips.size() == chips.size() && stat.n_frames == chips.size()
+                && !stat.n_corrupted_frames && !stat.n_resynchronisations;
+        for(size_t n = 0; n < link_chips.size() && is_valid; ++n)
+            is_valid = link_chips.at(n).chip_id == static_cast<uint16_t>(n) && *link_chips.at(n).chip == *chips.at(n);
+        if(!is_valid)
+            throw exception("Chips are not correctly demultiplexed from the link stream for the format '%1%'.")
+                % params.at("format");
+
+        size_t n_package_bytes = 0;
+        for(const auto& package : packages)
+            n_package_bytes += (package->size() + Package::BitsPerItem - 1) / Package::BitsPerItem;
+        if(chips.size()) {
+            result.extra_values["link_overhead_bits_per_chip"] =
+                    double(link_stream.GetBytes().size() - n_package_bytes) * Package::BitsPerByte / chips.size();
+        }
+        return result;
+    }
+
+    template<typename Function>
+    static Result RunStage(const std::string& name, const Result::ParameterMap& params, size_t n_threads,
+                           size_t n_chips, Function&& fn)
+    {
+        std::vector<LatencyVector> thread_latencies(n_threads);
+        std::vector<AllocationStatistics> thread_allocations(n_threads);
+        const auto processRange = [&](size_t thread_id) {
+            const size_t begin = n_chips * thread_id / n_threads, end = n_chips * (thread_id + 1) / n_threads;
+            LatencyVector& latencies = thread_latencies.at(thread_id);
+            AllocationStatistics& allocations = thread_allocations.at(thread_id);
+            latencies.reserve(end - begin);
+            for(size_t n = begin; n < end; ++n) {
+                const AllocationCounter::Scope allocation_scope;
+                const auto start = Clock::now();
+                fn(n);
+                latencies.push_back(SecondsSince(start));
+                const AllocationStatistics call_allocations = allocation_scope.Stop();
+                allocations.n_allocations += call_allocations.n_allocations;
+                allocations.n_bytes += call_allocations.n_bytes;
+                allocations.peak_live_bytes = std::max(allocations.peak_live_bytes, call_allocations.peak_live_bytes);
+            }
+        };
+
+        const auto start = Clock::now();
+        std::vector<std::thread> threads;
+        for(size_t thread_id = 1; thread_id < n_threads; ++thread_id)
+            threads.emplace_back(processRange, thread_id);
+        processRange(0);
+        for(auto& thread : threads)
+            thread.join();
+
+        Result result;
+        result.name = name;
+        result.parameters = params;
+        result.units = "chips";
+        result.n_iterations = 1;
+        result.time = SecondsSince(start);
+        result.n_items = n_chips;
+
+        LatencyVector latencies;
+        for(const auto& thread_latency : thread_latencies)
+            latencies.insert(latencies.end(), thread_latency.begin(), thread_latency.end());
+        std::sort(latencies.begin(), latencies.end());
+        static const std::vector<std::pair<std::string, double>> quantiles = {
+            { "latency_p50_us", 0.5 }, { "latency_p90_us", 0.9 }, { "latency_p99_us", 0.99 },
+            { "latency_p999_us", 0.999 }, { "latency_max_us", 1. },
+        };
+        for(const auto& quantile : quantiles)
+            result.extra_values[quantile.first] = Quantile(latencies, quantile.second) * 1e6;
+
+        if(AllocationCounter::IsEnabled() && n_chips) {
+            AllocationStatistics allocations;
+            for(const auto& thread_allocation : thread_allocations) {
+                allocations.n_allocations += thread_allocation.n_allocations;
+                allocations.n_bytes += thread_allocation.n_bytes;
+                allocations.peak_live_bytes = std::max(allocations.peak_live_bytes,
+                                                       thread_allocation.peak_live_bytes);
+            }
+            result.extra_values["allocations_per_call"] = double(allocations.n_allocations) / n_chips;
+            result.extra_values["allocated_bytes_per_call"] = double(allocations.n_bytes) / n_chips;
+            result.extra_values["peak_live_bytes_per_call_max"] = allocations.peak_live_bytes;
+        }
+        return result;
+    }
+
+private:
+    static constexpr size_t max_adc = 15, max_alphabet_size = 32, region_of_interest = 0;
+    Arguments args;
+    ResultCollection results;
+    const MultiRegionLayout chip_layout;
+    const RegionLayout readout_unit_layout;
+};
+
+} // namespace benchmark
+} // namespace pixel_studies
+
+int main(int argc, char* argv[])
+{
+    namespace po = boost::program_options;
+    using namespace pixel_studies::benchmark;
+
+    Arguments args;
+    po::options_description desc("End-to-end encode, decode and verify throughput benchmark for each EncoderFormat");
+    desc.add_options()
+        ("help", "print help message")
+        ("input", po::value<std::string>(&args.input)->default_value(""),
+             "input hit file; if not specified, chips are produced by the hit generator")
+        ("n-chips", po::value<size_t>(&args.n_chips)->default_value(10000), "number of chips per point")
+        ("hits-per-chip", po::value<std::vector<double>>(&args.hits_per_chip)->multitoken()
+             ->default_value({ 10, 100, 1000 }, "10 100 1000"), "mean number of generated hits per chip")
+        ("threads", po::value<std::vector<size_t>>(&args.threads)->multitoken()
+             ->default_value({ 1, 2, 4 }, "1 2 4"), "number of threads")
+        ("formats", po::value<std::vector<std::string>>(&args.formats)->multitoken()
+             ->default_value({ "SinglePixel", "Region", "RegionWithCompressedAdc", "Delta", "DeltaWithSubStreams" },
+                             "SinglePixel Region RegionWithCompressedAdc Delta DeltaWithSubStreams"),
+             "encoder formats")
+        ("dictionaries", po::value<std::string>(&args.dictionaries)->default_value(""),
+             "input file with dictionaries; if not specified, dictionaries are trained on the benchmark chips")
+        ("dictionaries-output", po::value<std::string>(&args.dictionaries_output)
+             ->default_value(""), "output file for the trained dictionaries; if not specified, they are not saved")
+        ("seed", po::value<uint64_t>(&args.seed)->default_value(12345), "random seed for the hit generator")
+        ("output", po::value<std::string>(&args.output)->default_value(""), "output JSON file")
+        ("trace", po::value<std::string>(&args.trace)->default_value(""),
+             "output Chrome trace file (requires PIXEL_STUDIES_INSTRUMENTATION)");
+
+    try {
+        po::variables_map vm;
+        po::store(po::parse_command_line(argc, argv, desc), vm);
+        if(vm.count("help")) {
+            std::cout << desc << std::endl;
+            return 0;
+        }
+        po::notify(vm);
+        for(size_t n_threads : args.threads) {
+            if(!n_threads)
+                throw pixel_studies::exception("Number of threads should be a positive number.");
+        }
+        for(double hits_per_chip : args.hits_per_chip) {
+            if(!(hits_per_chip > 0))
+                throw pixel_studies::exception("Mean number of hits per chip should be a positive number.");
+        }
+        BenchmarkChipDataEncoder benchmark(args);
+        benchmark.Run();
+    } catch(std::exception& e) {
+        std::cerr << "ERROR: " << e.what() << std::endl;
+        return 1;
+    }
+    return 0;
+}
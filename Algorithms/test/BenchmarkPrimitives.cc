@@ -0,0 +1,340 @@
+/*! Microbenchmarks for the bit I/O, Huffman coding and layout primitives.
+This file is part of https://github.com/kandrosov/OnChipDataCompression. */
+
+#include <fstream>
+#include <random>
+#include <boost/program_options.hpp>
+#include "OnChipDataCompression/Algorithms/interface/AlphabetStatisticsProducer.h"
+#include "OnChipDataCompression/Algorithms/interface/HitGenerator.h"
+#include "OnChipDataCompression/Algorithms/interface/HuffmanDecoder.h"
+#include "OnChipDataCompression/Algorithms/interface/HuffmanEncoder.h"
+#include "OnChipDataCompression/Algorithms/interface/Package.h"
+#include "OnChipDataCompression/Algorithms/test/BenchmarkTools.h"
+
+namespace pixel_studies {
+namespace benchmark {
+
+struct Arguments {
+    std::vector<size_t> sizes, widths, alphabet_sizes;
+    std::vector<double> occupancies;
+    double min_time;
+    uint64_t seed;
+    std::string filter, output;
+};
+
+class BenchmarkPrimitives {
+public:
+    using Letter = int;
+    using Producer = AlphabetStatisticsProducer<Letter>;
+    using Statistics = Producer::Statistics;
+    using StatisticsPtr = Producer::StatisticsPtr;
+    using LetterFrequencyMap = Producer::LetterFrequencyMap;
+    using Integer = Package::Integer;
+
+    explicit BenchmarkPrimitives(const Arguments& _args) :
+        args(_args), results("BenchmarkPrimitives"), runner(results, args.min_time, args.filter),
+        generator(args.seed) {}
+
+    void Run()
+    {
+        for(size_t size : args.sizes) {
+            for(size_t width : args.widths)
+                RunPackage(size, width);
+            for(size_t alphabet_size : args.alphabet_sizes)
+                RunHuffman(size, alphabet_size);
+            RunLayout(size);
+        }
+        for(size_t alphabet_size : args.alphabet_sizes)
+            RunHuffmanTree(alphabet_size);
+        for(double occupancy : args.occupancies)
+            RunOrderedPixels(occupancy);
+
+        if(!args.output.empty()) {
+            std::ofstream f(args.output);
+            f.exceptions(std::ofstream::badbit | std::ofstream::failbit);
+            results.WriteJson(f);
+        }
+    }
+
+private:
+    void RunPackage(size_t size, size_t width)
+    {
+        std::uniform_int_distribution<Integer> distr(0, Package::Mask(width));
+        std::vector<Integer> values(size);
+        for(auto& value : values)
+            value = distr(generator);
+        const Result::ParameterMap params = { { "size", ToString(size) }, { "width", ToString(width) } };
+        const double n_bits = double(size * width);
+
+        runner.Run("Package::write", params, "bits", [&]() {
+            Package package;
+            for(Integer value : values)
+                package.write(value, width);
+            DoNotOptimize(package.size());
+            return n_bits;
+        });
+        runner.Run("Package::write_ex", params, "bits", [&]() {
+            Package package;
+            for(Integer value : values)
+                package.write_ex(value, width);
+            DoNotOptimize(package.size());
+            return n_bits;
+        });
+
+        Package package;
+        for(Integer value : values)
+            package.write(value, width);
+        runner.Run("Package::iterator::read", params, "bits", [&]() {
+            Package::iterator iter = package.begin();
+            Integer sum = 0;
+            for(size_t n = 0; n < size; ++n)
+                sum += iter.read(width);
+            DoNotOptimize(sum);
+            return n_bits;
+        });
+        runner.Run("Package::iterator::read_ex", params, "bits", [&]() {
+            Package::iterator iter = package.begin();
+            Integer sum = 0;
+            for(size_t n = 0; n < size; ++n)
+                sum += iter.read_ex(width);
+            DoNotOptimize(sum);
+            return n_bits;
+        });
+
+        runner.Run("Package::write_bulk", params, "bits", [&]() {
+            Package package;
+            package.write_bulk(values.data(), values.size(), width);
+            DoNotOptimize(package.size());
+            return n_bits;
+        });
+        std::vector<Integer> read_values(size);
+        runner.Run("Package::iterator::read_bulk", params, "bits", [&]() {
+            Package::iterator iter = package.begin();
+            iter.read_bulk(read_values.data(), read_values.size(), width);
+            DoNotOptimize(read_values.back());
+            return n_bits;
+        });
+
+        using bit_packing::InstructionSet;
+        for(InstructionSet instruction_set : { InstructionSet::Scalar, InstructionSet::SSSE3, InstructionSet::AVX2 }) {
+            if(static_cast<int>(instruction_set) > static_cast<int>(bit_packing::GetSupportedInstructionSet()))
+                continue;
+            Result::ParameterMap isa_params = params;
+            isa_params["isa"] = bit_packing::InstructionSetName(instruction_set);
+            runner.Run("bit_packing::ReverseBits", isa_params, "values", [&]() {
+                read_values = values;
+                bit_packing::ReverseBits(read_values.data(), read_values.size(), width, instruction_set);
+                DoNotOptimize(read_values.back());
+                return double(size);
+            });
+        }
+
+        if(width > 16 || 16 % width) return;
+        const size_t values_per_word = 64 / width;
+        std::vector<uint64_t> words((size + values_per_word - 1) / values_per_word, 0);
+        for(size_t n = 0; n < size; ++n)
+            words[n / values_per_word] |= uint64_t(values[n]) << (n % values_per_word * width);
+        std::vector<uint16_t> unpacked_values(size);
+        for(InstructionSet instruction_set : { InstructionSet::Scalar, InstructionSet::SSSE3, InstructionSet::AVX2 }) {
+            if(static_cast<int>(instruction_set) > static_cast<int>(bit_packing::GetSupportedInstructionSet()))
+                continue;
+            Result::ParameterMap isa_params = params;
+            isa_params["isa"] = bit_packing::InstructionSetName(instruction_set);
+            runner.Run("bit_packing::UnpackUInt16", isa_params, "values", [&]() {
+                bit_packing::UnpackUInt16(words.data(), 0, size, width, unpacked_values.data(), instruction_set);
+                DoNotOptimize(unpacked_values.back());
+                return double(size);
+            });
+        }
+    }
+
+    void RunHuffman(size_t size, size_t alphabet_size)
+    {
+        const LetterFrequencyMap frequencies = MakeFrequencies(alphabet_size);
+        const StatisticsPtr stat = MakeStatistics(frequencies);
+        std::vector<double> weights;
+        for(const auto& entry : frequencies)
+            weights.push_back(entry.second);
+        std::discrete_distribution<Letter> distr(weights.begin(), weights.end());
+        std::vector<Letter> letters(size);
+        for(auto& letter : letters)
+            letter = distr(generator);
+
+        const Result::ParameterMap params = { { "size", ToString(size) },
+                                              { "alphabet_size", ToString(alphabet_size) } };
+        runner.Run("HuffmanEncoder::EncodeLetter", params, "symbols", [&]() {
+            Package package;
+            for(Letter letter : letters)
+                HuffmanEncoder::EncodeLetter(*stat, letter, package);
+            DoNotOptimize(package.size());
+            return double(size);
+        });
+
+        Package package;
+        for(Letter letter : letters)
+            HuffmanEncoder::EncodeLetter(*stat, letter, package);
+        runner.Run("HuffmanDecoder::DecodeLetter", params, "symbols", [&]() {
+            Package::iterator iter = package.begin();
+            Letter sum = 0;
+            for(size_t n = 0; n < size; ++n)
+                sum += HuffmanDecoder::DecodeLetter(*stat, iter);
+            DoNotOptimize(sum);
+            return double(size);
+        });
+
+        using LookupTable = HuffmanDecoder::LookupTable<Statistics>;
+        for(size_t max_letters_per_lookup : { size_t(1), size_t(LookupTable::MaxLettersPerLookup) }) {
+            const LookupTable table(*stat, LookupTable::DefaultMaxLookupBits, max_letters_per_lookup);
+            Result::ParameterMap table_params = params;
+            table_params["letters_per_lookup"] = ToString(max_letters_per_lookup);
+            runner.Run("HuffmanLookupTable::DecodeLetters", table_params, "symbols", [&]() {
+                Package::iterator iter = package.begin();
+                std::array<Letter, LookupTable::MaxLettersPerLookup> decoded;
+                Letter sum = 0;
+                for(size_t n = 0; n < size;) {
+                    const size_t n_decoded = table.DecodeLetters(iter, decoded.data(),
+                                                                 std::min(size - n, decoded.size()));
+                    for(size_t k = 0; k < n_decoded; ++k)
+                        sum += decoded[k];
+                    n += n_decoded;
+                }
+                DoNotOptimize(sum);
+                return double(size);
+            });
+        }
+    }
+
+    void RunHuffmanTree(size_t alphabet_size)
+    {
+        const LetterFrequencyMap frequencies = MakeFrequencies(alphabet_size);
+        const Result::ParameterMap params = { { "alphabet_size", ToString(alphabet_size) } };
+        runner.Run("HuffmanTree", params, "symbols", [&]() {
+            const HuffmanTree<Letter, Producer::Integer> tree(frequencies);
+            DoNotOptimize(tree.GetTable().size());
+            return double(alphabet_size);
+        });
+    }
+
+    void RunLayout(size_t size)
+    {
+        const MultiRegionLayout layout(400, 400, 1, 4);
+        std::uniform_int_distribution<size_t> distr(0, layout.GetNumberOfPixels() - 1);
+        std::vector<Pixel> pixels(size);
+        for(auto& pixel : pixels)
+            pixel = layout.GetPixel(distr(generator));
+        const Result::ParameterMap params = { { "size", ToString(size) } };
+
+        runner.Run("RegionLayout::GetPixelId+GetPixel", params, "conversions", [&]() {
+            size_t sum = 0;
+            for(const Pixel& pixel : pixels) {
+                const Pixel converted = layout.GetPixel(layout.GetPixelId(pixel));
+                sum += converted.row;
+            }
+            DoNotOptimize(sum);
+            return double(size);
+        });
+
+        runner.Run("MultiRegionLayout::ConvertToFromRegionPixel", params, "conversions", [&]() {
+            size_t sum = 0;
+            for(const Pixel& pixel : pixels) {
+                size_t region_id;
+                Pixel region_pixel, converted;
+                layout.ConvertToRegionPixel(pixel, region_id, region_pixel);
+                layout.ConvertFromRegionPixel(region_id, region_pixel, converted);
+                sum += converted.column + region_id;
+            }
+            DoNotOptimize(sum);
+            return double(size);
+        });
+    }
+
+    void RunOrderedPixels(double occupancy)
+    {
+        static const std::vector<std::pair<Ordering, std::string>> orderings = {
+            { Ordering::ByRow, "ByRow" }, { Ordering::ByColumn, "ByColumn" },
+            { Ordering::ByRegionByRow, "ByRegionByRow" }, { Ordering::ByRegionByColumn, "ByRegionByColumn" },
+        };
+
+        const MultiRegionLayout layout(400, 400, 1, 4);
+        HitGeneratorConfig config;
+        config.occupancy = occupancy;
+        HitGenerator hit_generator(layout, config, args.seed);
+        const Chip chip = hit_generator.Generate();
+        const double n_pixels = chip.GetPixels().size();
+
+        for(const auto& ordering : orderings) {
+            const Result::ParameterMap params = { { "occupancy", ToString(occupancy) },
+                                                  { "ordering", ordering.second } };
+            runner.Run("PixelMultiRegion::GetOrderedPixels", params, "pixels", [&]() {
+                const PixelWithAdcVector ordered_pixels = chip.GetOrderedPixels(ordering.first);
+                DoNotOptimize(ordered_pixels.size());
+                return n_pixels;
+            });
+        }
+    }
+
+    static LetterFrequencyMap MakeFrequencies(size_t alphabet_size)
+    {
+        // Zipf-like distribution, similar in shape to the delta and ADC alphabets.
+        static constexpr double max_frequency = 1e6;
+        LetterFrequencyMap frequencies;
+        for(size_t n = 0; n < alphabet_size; ++n)
+            frequencies[Letter(n)] = Producer::Integer(max_frequency / std::pow(n + 1., 1.2)) + 1;
+        return frequencies;
+    }
+
+    static StatisticsPtr MakeStatistics(const LetterFrequencyMap& frequencies)
+    {
+        Producer producer("benchmark", frequencies);
+        return producer.Produce();
+    }
+
+private:
+    Arguments args;
+    ResultCollection results;
+    Runner runner;
+    std::mt19937_64 generator;
+};
+
+} // namespace benchmark
+} // namespace pixel_studies
+
+int main(int argc, char* argv[])
+{
+    namespace po = boost::program_options;
+    using namespace pixel_studies::benchmark;
+
+    Arguments args;
+    po::options_description desc("Microbenchmarks for the bit I/O, Huffman coding and layout primitives");
+    desc.add_options()
+        ("help", "print help message")
+        ("sizes", po::value<std::vector<size_t>>(&args.sizes)->multitoken()
+             ->default_value({ 1024, 65536 }, "1024 65536"), "number of values processed per iteration")
+        ("widths", po::value<std::vector<size_t>>(&args.widths)->multitoken()
+             ->default_value({ 1, 4, 18 }, "1 4 18"), "bit widths for the package I/O benchmarks")
+        ("alphabet-sizes", po::value<std::vector<size_t>>(&args.alphabet_sizes)->multitoken()
+             ->default_value({ 16, 400 }, "16 400"), "alphabet sizes for the Huffman benchmarks")
+        ("occupancies", po::value<std::vector<double>>(&args.occupancies)->multitoken()
+             ->default_value({ 1e-3, 1e-2 }, "0.001 0.01"), "chip occupancies for the pixel ordering benchmarks")
+        ("min-time", po::value<double>(&args.min_time)->default_value(0.2), "minimal run time per benchmark in s")
+        ("seed", po::value<uint64_t>(&args.seed)->default_value(12345), "random seed")
+        ("filter", po::value<std::string>(&args.filter)->default_value(""),
+             "run only benchmarks which name contains the given string")
+        ("output", po::value<std::string>(&args.output)->default_value(""), "output JSON file");
+
+    try {
+        po::variables_map vm;
+        po::store(po::parse_command_line(argc, argv, desc), vm);
+        if(vm.count("help")) {
+            std::cout << desc << std::endl;
+            return 0;
+        }
+        po::notify(vm);
+        BenchmarkPrimitives benchmark(args);
+        benchmark.Run();
+    } catch(std::exception& e) {
+        std::cerr << "ERROR: " << e.what() << std::endl;
+        return 1;
+    }
+    return 0;
+}
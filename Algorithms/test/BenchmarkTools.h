@@ -0,0 +1,221 @@
+/*! Common tools for the benchmark executables.
+This file is part of https://github.com/kandrosov/OnChipDataCompression. */
+
+#pragma once
+
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <unistd.h>
+#include "OnChipDataCompression/Algorithms/interface/exception.h"
+
+namespace pixel_studies {
+namespace benchmark {
+
+using Clock = std::chrono::steady_clock;
+
+inline double SecondsSince(const Clock::time_point& start)
+{
+    return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+/// Prevents the compiler from optimising away the computation of the value.
+template<typename T>
+inline void DoNotOptimize(const T& value)
+{
+    asm volatile("" : : "r"(&value) : "memory");
+}
+
+inline std::string JsonEscape(const std::string& str)
+{
+    std::ostringstream ss;
+    for(char c : str) {
+        if(c == '"' || c == '\\')
+            ss << '\\' << c;
+        else if(static_cast<unsigned char>(c) < 0x20)
+            ss << "\\u" << std::hex << std::setw(4) << std::setfill('0') << int(c) << std::dec;
+        else
+            ss << c;
+    }
+    return ss.str();
+}
+
+struct Result {
+    using ParameterMap = std::map<std::string, std::string>;
+    using ValueMap = std::map<std::string, double>;
+
+    std::string name;
+    ParameterMap parameters;
+    std::string units;
+    size_t n_iterations;
+    double time, n_items;
+    ValueMap extra_values;
+
+    Result() : n_iterations(0), time(0), n_items(0) {}
+
+    double Throughput() const { return time > 0 ? n_items / time : 0; }
+
+    std::string ParametersString() const
+    {
+        std::ostringstream ss;
+        for(auto iter = parameters.begin(); iter != parameters.end(); ++iter) {
+            if(iter != parameters.begin())
+                ss << ",";
+            ss << iter->first << "=" << iter->second;
+        }
+        return ss.str();
+    }
+
+    void WriteJson(std::ostream& os) const
+    {
+        os << "{\"name\": \"" << JsonEscape(name) << "\", \"parameters\": {";
+        for(auto iter = parameters.begin(); iter != parameters.end(); ++iter) {
+            if(iter != parameters.begin())
+                os << ", ";
+            os << "\"" << JsonEscape(iter->first) << "\": \"" << JsonEscape(iter->second) << "\"";
+        }
+        os << "}, \"units\": \"" << JsonEscape(units) << "\", \"iterations\": " << n_iterations
+           << ", \"time_s\": " << time << ", \"items\": " << n_items
+           << ", \"throughput\": " << Throughput();
+        for(const auto& value : extra_values)
+            os << ", \"" << JsonEscape(value.first) << "\": " << value.second;
+        os << "}";
+    }
+};
+
+class ResultCollection {
+public:
+    explicit ResultCollection(const std::string& _benchmark_name) : benchmark_name(_benchmark_name) {}
+
+    void Add(const Result& result)
+    {
+        results.push_back(result);
+        PrintResult(std::cout, result);
+    }
+
+    const std::vector<Result>& GetResults() const { return results; }
+
+    static void PrintResult(std::ostream& os, const Result& result)
+    {
+        static const size_t name_width = 45, parameters_width = 45;
+        os << std::left << std::setw(name_width) << result.name << " " << std::setw(parameters_width)
+           << result.ParametersString() << " " << std::right << std::scientific << std::setprecision(3);
+        if(result.time > 0)
+            os << result.Throughput() << " " << result.units << "/s";
+        else
+            os << result.n_items << " " << result.units;
+        for(const auto& value : result.extra_values)
+            os << "  " << value.first << "=" << value.second;
+        os << std::defaultfloat << std::endl;
+    }
+
+    void WriteJson(std::ostream& os) const
+    {
+        os << std::setprecision(9) << "{\n\"benchmark\": \"" << JsonEscape(benchmark_name) << "\",\n\"results\": [\n";
+        for(size_t n = 0; n < results.size(); ++n) {
+            results.at(n).WriteJson(os);
+            os << (n + 1 < results.size() ? ",\n" : "\n");
+        }
+        os << "]\n}" << std::endl;
+    }
+
+private:
+    std::string benchmark_name;
+    std::vector<Result> results;
+};
+
+/// Repeats a function call until the minimal run time is reached. The function returns the number of items processed
+/// in one call, which is used to compute the throughput.
+class Runner {
+public:
+    Runner(ResultCollection& _results, double _min_time, const std::string& _filter) :
+        results(_results), min_time(_min_time), filter(_filter) {}
+
+    bool IsSelected(const std::string& name) const { return filter.empty() || name.find(filter) != std::string::npos; }
+
+    template<typename Function>
+    void Run(const std::string& name, const Result::ParameterMap& parameters, const std::string& units,
+             Function&& fn)
+    {
+        if(!IsSelected(name)) return;
+        Result result;
+        result.name = name;
+        result.parameters = parameters;
+        result.units = units;
+
+        DoNotOptimize(fn());
+        size_t n_calls = 1;
+        while(true) {
+            double n_items = 0;
+            const auto start = Clock::now();
+            for(size_t n = 0; n < n_calls; ++n)
+                n_items += fn();
+            const double time = SecondsSince(start);
+            if(time >= min_time || n_calls >= max_calls) {
+                result.n_iterations = n_calls;
+                result.time = time;
+                result.n_items = n_items;
+                break;
+            }
+            n_calls = time > 0 ? std::min(max_calls, size_t(n_calls * std::min(10., 1.5 * min_time / time)) + 1)
+                               : n_calls * 10;
+        }
+        results.Add(result);
+    }
+
+private:
+    static constexpr size_t max_calls = size_t(1) << 32;
+    ResultCollection& results;
+    double min_time;
+    std::string filter;
+};
+
+/// Returns the quantile of a sorted collection using the nearest-rank method.
+template<typename Collection>
+double Quantile(const Collection& sorted_values, double quantile)
+{
+    if(sorted_values.empty()) return 0;
+    const size_t rank = size_t(std::ceil(quantile * sorted_values.size()));
+    return sorted_values.at(std::min(sorted_values.size(), std::max<size_t>(rank, 1)) - 1);
+}
+
+/// Empty file in the temporary directory ($TMPDIR or /tmp), which is removed together with the object.
+class TemporaryFile {
+public:
+    explicit TemporaryFile(const std::string& prefix)
+    {
+        const char* tmp_dir = std::getenv("TMPDIR");
+        std::string path = std::string(tmp_dir && *tmp_dir ? tmp_dir : "/tmp") + "/" + prefix + "XXXXXX";
+        const int fd = mkstemp(&path[0]);
+        if(fd < 0)
+            throw exception("Unable to create a temporary file '%1%'.") % path;
+        close(fd);
+        file_name = path;
+    }
+    TemporaryFile(const TemporaryFile&) = delete;
+    TemporaryFile& operator=(const TemporaryFile&) = delete;
+    ~TemporaryFile() { std::remove(file_name.c_str()); }
+
+    const std::string& GetFileName() const { return file_name; }
+
+private:
+    std::string file_name;
+};
+
+template<typename T>
+std::string ToString(const T& value)
+{
+    std::ostringstream ss;
+    ss << value;
+    return ss.str();
+}
+
+} // namespace benchmark
+} // namespace pixel_studies
@@ -0,0 +1,158 @@
+/*! Bounded lock-free multi-producer multi-consumer queue for the stages of a processing pipeline.
+The items are stored in a ring buffer of preallocated cells. Each cell has a sequence number that tells whether it is
+ready to be written or read in the current lap, so producers and consumers claim cells with a single compare-and-swap
+and never wait for each other while the queue is neither full nor empty. The blocking Push waits while the queue is
+full, which propagates the backpressure to the producer, and the blocking Pop waits while it is empty.
+This file is part of https://github.com/kandrosov/OnChipDataCompression. */
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <thread>
+#include "OnChipDataCompression/Algorithms/interface/exception.h"
+
+namespace pixel_studies {
+
+template<typename T>
+class BoundedQueue {
+public:
+    using Value = T;
+
+    /// The capacity is rounded up to the nearest power of two, which is at least two, because the sequence numbers of
+    /// a single cell would not distinguish a full queue from an empty one.
+    explicit BoundedQueue(size_t min_capacity) :
+        capacity(RoundUpToPowerOfTwo(min_capacity)), mask(capacity - 1), cells(new Cell[capacity]), push_position(0),
+        pop_position(0), closed(false), cancelled(false), n_full_waits(0), n_empty_waits(0)
+    {
+        for(size_t n = 0; n < capacity; ++n)
+            cells[n].sequence.store(n, std::memory_order_relaxed);
+    }
+    BoundedQueue(const BoundedQueue&) = delete;
+    BoundedQueue& operator=(const BoundedQueue&) = delete;
+
+    size_t GetCapacity() const { return capacity; }
+
+    bool TryPush(T& value)
+    {
+        size_t position = push_position.load(std::memory_order_relaxed);
+        while(true) {
+            Cell& cell = cells[position & mask];
+            const size_t sequence = cell.sequence.load(std::memory_order_acquire);
+            const std::ptrdiff_t diff = std::ptrdiff_t(sequence) - std::ptrdiff_t(position);
+            if(diff == 0) {
+                if(push_position.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) {
+                    cell.value = std::move(value);
+                    cell.sequence.store(position + 1, std::memory_order_release);
+                    return true;
+                }
+            } else if(diff < 0) {
+                return false;
+            } else {
+                position = push_position.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    bool TryPop(T& value)
+    {
+        size_t position = pop_position.load(std::memory_order_relaxed);
+        while(true) {
+            Cell& cell = cells[position & mask];
+            const size_t sequence = cell.sequence.load(std::memory_order_acquire);
+            const std::ptrdiff_t diff = std::ptrdiff_t(sequence) - std::ptrdiff_t(position + 1);
+            if(diff == 0) {
+                if(pop_position.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) {
+                    value = std::move(cell.value);
+                    cell.sequence.store(position + capacity, std::memory_order_release);
+                    return true;
+                }
+            } else if(diff < 0) {
+                return false;
+            } else {
+                position = pop_position.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    /// Waits while the queue is full. Returns false if the queue is cancelled.
+    bool Push(T& value)
+    {
+        if(closed.load(std::memory_order_relaxed))
+            throw exception("Unable to push into a closed queue.");
+        for(size_t n_attempts = 0; !TryPush(value); ++n_attempts) {
+            if(cancelled.load(std::memory_order_relaxed)) return false;
+            if(!n_attempts)
+                n_full_waits.fetch_add(1, std::memory_order_relaxed);
+            Wait(n_attempts);
+        }
+        return true;
+    }
+
+    /// Waits while the queue is empty. Returns false if the queue is cancelled or if it is closed and all items are
+    /// popped.
+    bool Pop(T& value)
+    {
+        for(size_t n_attempts = 0; !TryPop(value); ++n_attempts) {
+            if(cancelled.load(std::memory_order_relaxed)) return false;
+            // All pushes are completed before the queue is closed, so the last attempt sees all of them.
+            if(closed.load(std::memory_order_acquire))
+                return TryPop(value);
+            if(!n_attempts)
+                n_empty_waits.fetch_add(1, std::memory_order_relaxed);
+            Wait(n_attempts);
+        }
+        return true;
+    }
+
+    /// Tells the consumers that there will be no more items. Should be called after the last push is completed.
+    void Close() { closed.store(true, std::memory_order_release); }
+
+    /// Stops all producers and consumers, e.g. when one of the pipeline stages has failed.
+    void Cancel() { cancelled.store(true, std::memory_order_relaxed); }
+
+    /// Number of pushes that found the queue full, i.e. how often the producers were slowed down by the consumers.
+    size_t GetNumberOfFullWaits() const { return n_full_waits.load(std::memory_order_relaxed); }
+    /// Number of pops that found the queue empty, i.e. how often the consumers were waiting for the producers.
+    size_t GetNumberOfEmptyWaits() const { return n_empty_waits.load(std::memory_order_relaxed); }
+
+private:
+    struct Cell {
+        std::atomic<size_t> sequence;
+        T value;
+    };
+
+    static size_t RoundUpToPowerOfTwo(size_t n)
+    {
+        if(!n)
+            throw exception("Queue capacity should be a positive number.");
+        size_t power = 2;
+        while(power < n)
+            power *= 2;
+        return power;
+    }
+
+    /// Spins for a short time, then gives the core to the other threads and finally sleeps, so a stage that waits
+    /// for a long time does not take the core from the stages that it is waiting for.
+    static void Wait(size_t n_attempts)
+    {
+        static constexpr size_t n_spins = 64, n_yields = 1024;
+        static constexpr std::chrono::microseconds sleep_time(50);
+        if(n_attempts < n_spins) return;
+        if(n_attempts < n_yields)
+            std::this_thread::yield();
+        else
+            std::this_thread::sleep_for(sleep_time);
+    }
+
+private:
+    const size_t capacity, mask;
+    std::unique_ptr<Cell[]> cells;
+    alignas(64) std::atomic<size_t> push_position;
+    alignas(64) std::atomic<size_t> pop_position;
+    std::atomic<bool> closed, cancelled;
+    std::atomic<size_t> n_full_waits, n_empty_waits;
+};
+
+} // namespace pixel_studies
@@ -0,0 +1,129 @@
+/*! Fixed-binning histograms filled through independent shards.
+Each stream or thread fills its own shard without locking, histograms are addressed by integer handles resolved once at
+registration. Together with the bins, each shard keeps a quantile sketch per histogram, which is not limited by the
+histogram range. The shards should be merged only when nobody is filling them.
+This file is part of https://github.com/kandrosov/OnChipDataCompression. */
+
+#pragma once
+
+#include <cmath>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "OnChipDataCompression/Algorithms/interface/QuantileSketch.h"
+
+namespace pixel_studies {
+
+class HistogramShards {
+public:
+    using Handle = size_t;
+    using BinContentVector = std::vector<double>;
+
+    struct Definition {
+        std::string name;
+        size_t n_bins;
+        double low, high;
+        size_t offset;
+        double bins_per_unit;
+    };
+
+    /// Histograms of a single stream or thread. The shard is owned by the HistogramShards that created it.
+    class Shard {
+    public:
+        /// Bin 0 is the underflow and bin n_bins + 1 is the overflow, as for the ROOT histograms.
+        /// Only non-negative values are supported.
+        void Fill(Handle handle, double value)
+        {
+            const Definition& def = (*definitions)[handle];
+            size_t bin;
+            if(value < def.low)
+                bin = 0;
+            else if(value >= def.high || std::isnan(value))
+                bin = def.n_bins + 1;
+            else
+                bin = std::min(def.n_bins, size_t((value - def.low) * def.bins_per_unit) + 1);
+            bins[def.offset + bin] += 1;
+            sketches[handle].Add(value);
+        }
+
+    private:
+        friend class HistogramShards;
+
+        Shard(const std::vector<Definition>& _definitions, size_t n_bins, double sketch_relative_accuracy) :
+            definitions(&_definitions), bins(n_bins, 0.),
+            sketches(_definitions.size(), QuantileSketch(sketch_relative_accuracy)) {}
+
+    private:
+        const std::vector<Definition>* definitions;
+        BinContentVector bins;
+        std::vector<QuantileSketch> sketches;
+    };
+
+    explicit HistogramShards(double _sketch_relative_accuracy = QuantileSketch::DefaultRelativeAccuracy) :
+        sketch_relative_accuracy(_sketch_relative_accuracy), n_shard_bins(0) {}
+    HistogramShards(const HistogramShards&) = delete;
+    HistogramShards& operator=(const HistogramShards&) = delete;
+
+    /// Registers histogram. All histograms should be registered before the first fill.
+    Handle Add(const std::string& name, size_t n_bins, double low, double high)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if(shards.size())
+            throw exception("Unable to add histogram '%1%' after the filling has started.") % name;
+        if(!n_bins || !(high > low))
+            throw exception("Invalid binning for histogram '%1%'.") % name;
+        definitions.push_back(Definition{ name, n_bins, low, high, n_shard_bins, n_bins / (high - low) });
+        n_shard_bins += n_bins + 2;
+        return definitions.size() - 1;
+    }
+
+    size_t size() const { return definitions.size(); }
+    const Definition& GetDefinition(Handle handle) const { return definitions.at(handle); }
+
+    /// Creates a new shard. A shard should be filled by a single thread at a time.
+    Shard& CreateShard()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        shards.emplace_back(new Shard(definitions, n_shard_bins, sketch_relative_accuracy));
+        return *shards.back();
+    }
+
+    /// Returns bin contents summed over all shards, including underflow and overflow bins.
+    BinContentVector GetBinContents(Handle handle) const
+    {
+        const Definition& def = definitions.at(handle);
+        BinContentVector contents(def.n_bins + 2, 0.);
+        std::lock_guard<std::mutex> lock(mutex);
+        for(const auto& shard : shards) {
+            for(size_t bin = 0; bin < contents.size(); ++bin)
+                contents[bin] += shard->bins[def.offset + bin];
+        }
+        return contents;
+    }
+
+    /// Returns quantile sketch merged over all shards.
+    QuantileSketch GetSketch(Handle handle) const
+    {
+        QuantileSketch sketch(sketch_relative_accuracy);
+        std::lock_guard<std::mutex> lock(mutex);
+        for(const auto& shard : shards)
+            sketch.Merge(shard->sketches.at(handle));
+        return sketch;
+    }
+
+    size_t GetNumberOfShards() const
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return shards.size();
+    }
+
+private:
+    const double sketch_relative_accuracy;
+    mutable std::mutex mutex;
+    std::vector<Definition> definitions;
+    size_t n_shard_bins;
+    std::vector<std::unique_ptr<Shard>> shards;
+};
+
+} // namespace pixel_studies
@@ -0,0 +1,180 @@
+/*! Dense pixel region with ADC values packed into the 64-bit words.
+Each pixel of the region occupies a fixed number of bits, chosen as the smallest power of two sufficient to store
+max_adc, so for max_adc = 15 two pixels share one byte. ADC = 0 marks an inactive pixel, as in the block formats.
+Rows are unpacked into the 16-bit ADC values with the vectorised kernels.
+It is a benchmark prototype of the dense storage: the chips and the package makers use the map-based PixelRegion, and
+PackedAdcRegion is only used to compare the memory footprint and the unpack throughput with it.
+This file is part of https://github.com/kandrosov/OnChipDataCompression. */
+
+#pragma once
+
+#include "OnChipDataCompression/Algorithms/interface/BitPacking.h"
+#include "OnChipDataCompression/Algorithms/interface/Chip.h"
+
+namespace pixel_studies {
+
+class PackedAdcRegion {
+public:
+    using Word = uint64_t;
+    using WordVector = std::vector<Word>;
+    using AdcVector = std::vector<Adc>;
+
+    static constexpr size_t BitsPerWord = 64;
+
+    /// Returns the number of bits per pixel: 1, 2, 4, 8 or 16.
+    static size_t BitsPerStoredAdc(Adc max_adc);
+
+    PackedAdcRegion(const RegionLayout& _region_layout, Adc _max_adc);
+    PackedAdcRegion(const PixelRegion& region, Adc _max_adc);
+
+    const RegionLayout& GetRegionLayout() const { return region_layout; }
+    size_t GetNumberOfRows() const { return region_layout.n_rows; }
+    size_t GetNumberOfColumns() const { return region_layout.n_columns; }
+    Adc GetMaxAdc() const { return max_adc; }
+    size_t GetBitsPerAdc() const { return bits_per_adc; }
+    size_t GetNumberOfActivePixels() const { return n_active_pixels; }
+    bool HasActivePixels() const { return n_active_pixels != 0; }
+    const WordVector& GetWords() const { return words; }
+    size_t GetMemorySize() const { return words.size() * sizeof(Word); }
+
+    void AddPixel(const Pixel& pixel, Adc adc);
+    Adc GetAdc(const Pixel& pixel) const { return GetAdcById(region_layout.GetPixelId(pixel)); }
+    Adc GetAdc(size_t row, size_t column) const { return GetAdc(Pixel(row, column)); }
+    void Clear();
+
+    /// Unpacks ADC values of n_pixels consecutive pixels starting from the pixel with id first_pixel_id.
+    void Unpack(size_t first_pixel_id, size_t n_pixels, Adc* adcs) const;
+    void UnpackRow(size_t row, Adc* adcs) const;
+    AdcVector UnpackAll() const;
+
+    /// Returns the active pixels ordered ByRow or ByColumn.
+    PixelWithAdcVector GetOrderedPixels(Ordering ordering) const;
+    bool HasSamePixels(const PixelRegion& other) const;
+
+private:
+    Adc GetAdcById(size_t pixel_id) const
+    {
+        const size_t values_per_word = BitsPerWord / bits_per_adc;
+        const Word word = words[pixel_id / values_per_word];
+        return static_cast<Adc>((word >> (pixel_id % values_per_word * bits_per_adc)) & adc_mask);
+    }
+
+private:
+    RegionLayout region_layout;
+    Adc max_adc;
+    size_t bits_per_adc;
+    Word adc_mask;
+    size_t n_active_pixels;
+    WordVector words;
+};
+
+inline size_t PackedAdcRegion::BitsPerStoredAdc(Adc max_adc)
+{
+    if(!max_adc)
+        throw exception("Invalid max ADC = %1% for the packed ADC region.") % max_adc;
+    size_t n_bits = 1;
+    while(n_bits < 16 && (size_t(1) << n_bits) <= max_adc)
+        n_bits *= 2;
+    return n_bits;
+}
+
+inline PackedAdcRegion::PackedAdcRegion(const RegionLayout& _region_layout, Adc _max_adc) :
+    region_layout(_region_layout), max_adc(_max_adc), bits_per_adc(BitsPerStoredAdc(max_adc)),
+    adc_mask((Word(1) << bits_per_adc) - 1), n_active_pixels(0),
+    words((region_layout.GetNumberOfPixels() * bits_per_adc + BitsPerWord - 1) / BitsPerWord, 0)
+{
+}
+
+inline PackedAdcRegion::PackedAdcRegion(const PixelRegion& region, Adc _max_adc) :
+    PackedAdcRegion(region.GetRegionLayout(), _max_adc)
+{
+    for(const auto& pixel_entry : region.GetPixels())
+        AddPixel(pixel_entry.first, pixel_entry.second);
+}
+
+inline void PackedAdcRegion::AddPixel(const Pixel& pixel, Adc adc)
+{
+    if(!adc || adc > max_adc)
+        throw exception("ADC = %1% of the pixel %2% is outside of the interval [1, %3%] supported by the packed"
+                        " ADC region.") % adc % pixel % max_adc;
+    const size_t pixel_id = region_layout.GetPixelId(pixel);
+    if(GetAdcById(pixel_id))
+        throw exception("Pixel %1% is already active.") % pixel;
+    const size_t values_per_word = BitsPerWord / bits_per_adc;
+    words[pixel_id / values_per_word] |= Word(adc) << (pixel_id % values_per_word * bits_per_adc);
+    ++n_active_pixels;
+}
+
+inline void PackedAdcRegion::Clear()
+{
+    std::fill(words.begin(), words.end(), 0);
+    n_active_pixels = 0;
+}
+
+inline void PackedAdcRegion::Unpack(size_t first_pixel_id, size_t n_pixels, Adc* adcs) const
+{
+    if(first_pixel_id + n_pixels > region_layout.GetNumberOfPixels())
+        throw exception("Pixel range [%1%, %2%) is outside of the region.") % first_pixel_id
+            % (first_pixel_id + n_pixels);
+    bit_packing::UnpackUInt16(words.data(), first_pixel_id, n_pixels, bits_per_adc, adcs);
+}
+
+inline void PackedAdcRegion::UnpackRow(size_t row, Adc* adcs) const
+{
+    if(row >= region_layout.n_rows)
+        throw exception("Row %1% is outside of the region interval [0, %2%].") % row % (region_layout.n_rows - 1);
+    Unpack(row * region_layout.n_columns, region_layout.n_columns, adcs);
+}
+
+inline PackedAdcRegion::AdcVector PackedAdcRegion::UnpackAll() const
+{
+    AdcVector adcs(region_layout.GetNumberOfPixels());
+    Unpack(0, adcs.size(), adcs.data());
+    return adcs;
+}
+
+inline PixelWithAdcVector PackedAdcRegion::GetOrderedPixels(Ordering ordering) const
+{
+    if(ordering != Ordering::ByRow && ordering != Ordering::ByColumn)
+        throw exception("Unsupported pixel ordering for the packed ADC region.");
+
+    PixelWithAdcVector ordered_pixels;
+    ordered_pixels.reserve(n_active_pixels);
+    if(!n_active_pixels) return ordered_pixels;
+
+    const size_t n_rows = region_layout.n_rows, n_columns = region_layout.n_columns;
+    if(ordering == Ordering::ByRow) {
+        AdcVector row_adcs(n_columns);
+        for(size_t row = 0; row < n_rows; ++row) {
+            UnpackRow(row, row_adcs.data());
+            for(size_t column = 0; column < n_columns; ++column) {
+                if(row_adcs[column])
+                    ordered_pixels.emplace_back(Pixel(row, column), row_adcs[column]);
+            }
+        }
+    } else {
+        const AdcVector adcs = UnpackAll();
+        for(size_t column = 0; column < n_columns; ++column) {
+            for(size_t row = 0; row < n_rows; ++row) {
+                const Adc adc = adcs[row * n_columns + column];
+                if(adc)
+                    ordered_pixels.emplace_back(Pixel(row, column), adc);
+            }
+        }
+    }
+    return ordered_pixels;
+}
+
+inline bool PackedAdcRegion::HasSamePixels(const PixelRegion& other) const
+{
+    if(other.GetRegionLayout() != region_layout || other.GetPixels().size() != n_active_pixels)
+        return false;
+    for(const auto& pixel_entry : other.GetPixels()) {
+        if(!region_layout.IsPixelInside(pixel_entry.first)
+                || GetAdcById(region_layout.GetPixelId(pixel_entry.first)) != pixel_entry.second)
+            return false;
+    }
+    return true;
+}
+
+} // namespace pixel_studies
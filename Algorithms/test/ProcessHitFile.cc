@@ -0,0 +1,272 @@
+/*! Standalone pipelined processing of a hit file: chip construction, encoding, optional verification and summary.
+The reader thread parses the hit file ahead of the workers, the pool of workers constructs and encodes the chips, and
+the aggregator owns the quantile sketches of the results. The stages exchange batches of chips through bounded queues,
+so a slow stage blocks the stages before it and the memory stays bounded for any size of the input file.
+This file is part of https://github.com/kandrosov/OnChipDataCompression. */
+
+#include <fstream>
+#include <thread>
+#include <boost/program_options.hpp>
+#include "OnChipDataCompression/Algorithms/interface/ChipDataEncoder.h"
+#include "OnChipDataCompression/Algorithms/interface/HitFile.h"
+#include "OnChipDataCompression/Algorithms/interface/QuantileSketch.h"
+#include "OnChipDataCompression/Algorithms/test/BenchmarkTools.h"
+#include "OnChipDataCompression/Algorithms/test/BoundedQueue.h"
+
+namespace pixel_studies {
+namespace benchmark {
+
+struct Arguments {
+    std::string input, dictionaries, output;
+    std::vector<std::string> formats;
+    size_t n_chips, threads, batch_size, queue_size;
+    bool verify;
+};
+
+class ProcessHitFile {
+public:
+    using HitBatch = std::vector<HitRecord>;
+
+    /// Results of a batch of chips. The per-format values are stored chip by chip: format_id + chip_id * n_formats.
+    struct ResultBatch {
+        std::vector<size_t> n_hits, n_bits, n_readout_cycles;
+        std::vector<double> encode_time;
+        std::vector<size_t> n_invalid;
+    };
+
+    struct FormatSummary {
+        QuantileSketch bits_per_chip, readout_cycles, encode_latency;
+        size_t n_invalid = 0;
+    };
+
+    explicit ProcessHitFile(const Arguments& _args) :
+        args(_args), results("ProcessHitFile"), chip_layout(400, 400, 1, 4), readout_unit_layout(2, 2),
+        hit_queue(args.queue_size), result_queue(args.queue_size), n_active_workers(args.threads)
+    {
+        if(!args.threads)
+            throw exception("Number of threads should be a positive number.");
+        if(!args.batch_size)
+            throw exception("Batch size should be a positive number.");
+        for(const std::string& format : args.formats) {
+            encoders.emplace_back(ParseEncoderFormat(format), chip_layout, readout_unit_layout, size_t(max_adc),
+                                  Ordering::ByRegionByColumn, args.dictionaries);
+        }
+        summaries.resize(encoders.size());
+    }
+
+    void Run()
+    {
+        const auto start = Clock::now();
+        std::vector<std::thread> threads;
+        threads.emplace_back([this]() { RunStage([this]() { ReadHits(); }); });
+        for(size_t n = 0; n < args.threads; ++n)
+            threads.emplace_back([this]() { RunStage([this]() { ProcessChips(); }); });
+        RunStage([this]() { Aggregate(); });
+        for(auto& thread : threads)
+            thread.join();
+        if(error)
+            std::rethrow_exception(error);
+        const double time = SecondsSince(start);
+
+        Result pipeline;
+        pipeline.name = "pipeline";
+        pipeline.parameters = { { "threads", ToString(args.threads) }, { "batch_size", ToString(args.batch_size) },
+                                { "queue_size", ToString(hit_queue.GetCapacity()) } };
+        pipeline.units = "chips";
+        pipeline.n_iterations = 1;
+        pipeline.time = time;
+        pipeline.n_items = hits_per_chip.GetCount();
+        if(hits_per_chip.GetCount()) {
+            pipeline.extra_values["hits_per_chip_mean"] = hits_per_chip.GetMean();
+            pipeline.extra_values["hits_per_chip_p99"] = hits_per_chip.UpperBound(0.99);
+        }
+        pipeline.extra_values["reader_blocked"] = hit_queue.GetNumberOfFullWaits();
+        pipeline.extra_values["workers_starved"] = hit_queue.GetNumberOfEmptyWaits();
+        pipeline.extra_values["workers_blocked"] = result_queue.GetNumberOfFullWaits();
+        results.Add(pipeline);
+
+        size_t n_invalid = 0;
+        for(size_t format_id = 0; format_id < encoders.size(); ++format_id) {
+            const FormatSummary& summary = summaries.at(format_id);
+            Result format;
+            format.name = "format";
+            format.parameters = { { "format", args.formats.at(format_id) } };
+            format.units = "chips";
+            format.n_iterations = 1;
+            format.n_items = summary.bits_per_chip.GetCount();
+            if(summary.bits_per_chip.GetCount()) {
+                format.extra_values["bits_per_chip_mean"] = summary.bits_per_chip.GetMean();
+                format.extra_values["bits_per_chip_p99"] = summary.bits_per_chip.UpperBound(0.99);
+                format.extra_values["bits_per_chip_max"] = summary.bits_per_chip.GetMax();
+                format.extra_values["readout_cycles_p99"] = summary.readout_cycles.UpperBound(0.99);
+                format.extra_values["readout_cycles_max"] = summary.readout_cycles.GetMax();
+                format.extra_values["encode_latency_mean_us"] = summary.encode_latency.GetMean() * 1e6;
+                format.extra_values["encode_latency_p99_us"] = summary.encode_latency.UpperBound(0.99) * 1e6;
+            }
+            if(hits_per_chip.GetSum() > 0)
+                format.extra_values["bits_per_hit_mean"] = summary.bits_per_chip.GetSum() / hits_per_chip.GetSum();
+            if(args.verify)
+                format.extra_values["n_invalid"] = summary.n_invalid;
+            results.Add(format);
+            n_invalid += summary.n_invalid;
+        }
+
+        if(!args.output.empty()) {
+            std::ofstream f(args.output);
+            f.exceptions(std::ofstream::badbit | std::ofstream::failbit);
+            results.WriteJson(f);
+        }
+        if(n_invalid)
+            throw exception("%1% decoded chips are different from the original chips.") % n_invalid;
+    }
+
+private:
+    /// Runs a stage and, if it fails, stops all other stages.
+    template<typename Function>
+    void RunStage(Function&& fn)
+    {
+        try {
+            fn();
+        } catch(...) {
+            std::lock_guard<std::mutex> lock(error_mutex);
+            if(!error)
+                error = std::current_exception();
+            hit_queue.Cancel();
+            result_queue.Cancel();
+        }
+    }
+
+    void ReadHits()
+    {
+        HitFileReader reader(args.input, chip_layout);
+        size_t n_chips = 0;
+        bool has_more = true;
+        while(has_more) {
+            HitBatch batch(args.batch_size);
+            size_t batch_size = 0;
+            for(; batch_size < batch.size() && n_chips < args.n_chips; ++batch_size, ++n_chips) {
+                if(!reader.ReadHits(batch.at(batch_size))) break;
+            }
+            has_more = batch_size == batch.size() && n_chips < args.n_chips;
+            batch.resize(batch_size);
+            if(batch.size() && !hit_queue.Push(batch)) return;
+        }
+        hit_queue.Close();
+    }
+
+    void ProcessChips()
+    {
+        const size_t n_formats = encoders.size();
+        HitBatch batch;
+        while(hit_queue.Pop(batch)) {
+            ResultBatch result;
+            result.n_invalid.resize(n_formats, 0);
+            result.n_hits.reserve(batch.size());
+            result.n_bits.reserve(batch.size() * n_formats);
+            result.n_readout_cycles.reserve(batch.size() * n_formats);
+            result.encode_time.reserve(batch.size() * n_formats);
+            for(const HitRecord& hits : batch) {
+                const ChipRecord record = hits.MakeChip(chip_layout);
+                result.n_hits.push_back(record.chip->GetPixels().size());
+                for(size_t format_id = 0; format_id < n_formats; ++format_id) {
+                    const ChipDataEncoder& encoder = encoders[format_id];
+                    const auto start = Clock::now();
+                    const Package package = encoder.Encode(*record.chip);
+                    result.encode_time.push_back(SecondsSince(start));
+                    result.n_bits.push_back(package.size());
+                    result.n_readout_cycles.push_back(package.readout_positions().size());
+                    if(args.verify && !encoder.Decode(package).HasSamePixels(*record.chip))
+                        ++result.n_invalid[format_id];
+                }
+            }
+            if(!result_queue.Push(result)) return;
+        }
+        if(--n_active_workers == 0)
+            result_queue.Close();
+    }
+
+    void Aggregate()
+    {
+        const size_t n_formats = encoders.size();
+        ResultBatch batch;
+        while(result_queue.Pop(batch)) {
+            for(size_t chip_id = 0; chip_id < batch.n_hits.size(); ++chip_id) {
+                hits_per_chip.Add(batch.n_hits.at(chip_id));
+                for(size_t format_id = 0; format_id < n_formats; ++format_id) {
+                    const size_t n = format_id + chip_id * n_formats;
+                    FormatSummary& summary = summaries.at(format_id);
+                    summary.bits_per_chip.Add(batch.n_bits.at(n));
+                    summary.readout_cycles.Add(batch.n_readout_cycles.at(n));
+                    summary.encode_latency.Add(batch.encode_time.at(n));
+                }
+            }
+            for(size_t format_id = 0; format_id < n_formats; ++format_id)
+                summaries.at(format_id).n_invalid += batch.n_invalid.at(format_id);
+        }
+    }
+
+private:
+    static constexpr size_t max_adc = 15;
+
+    const Arguments args;
+    ResultCollection results;
+    const MultiRegionLayout chip_layout;
+    const RegionLayout readout_unit_layout;
+    std::vector<ChipDataEncoder> encoders;
+    BoundedQueue<HitBatch> hit_queue;
+    BoundedQueue<ResultBatch> result_queue;
+    std::atomic<size_t> n_active_workers;
+    std::mutex error_mutex;
+    std::exception_ptr error;
+
+    // Owned by the aggregator.
+    QuantileSketch hits_per_chip;
+    std::vector<FormatSummary> summaries;
+};
+
+} // namespace benchmark
+} // namespace pixel_studies
+
+int main(int argc, char* argv[])
+{
+    namespace po = boost::program_options;
+    using namespace pixel_studies::benchmark;
+
+    Arguments args;
+    po::options_description desc("Pipelined encoding of the chips stored in a hit file");
+    desc.add_options()
+        ("help", "print help message")
+        ("input", po::value<std::string>(&args.input)->required(), "input hit file")
+        ("formats", po::value<std::vector<std::string>>(&args.formats)->multitoken()
+             ->default_value({ "SinglePixel", "Region", "RegionWithCompressedAdc", "Delta", "DeltaWithSubStreams" },
+                             "SinglePixel Region RegionWithCompressedAdc Delta DeltaWithSubStreams"),
+             "encoder formats")
+        ("dictionaries", po::value<std::string>(&args.dictionaries)->default_value(""),
+             "input file with dictionaries, required for the compressed formats")
+        ("n-chips", po::value<size_t>(&args.n_chips)->default_value(std::numeric_limits<size_t>::max(), "all"),
+             "maximal number of chips to process")
+        ("threads", po::value<size_t>(&args.threads)->default_value(std::max(1u, std::thread::hardware_concurrency())),
+             "number of encoding threads")
+        ("batch-size", po::value<size_t>(&args.batch_size)->default_value(64),
+             "number of chips passed between the stages at once")
+        ("queue-size", po::value<size_t>(&args.queue_size)->default_value(16),
+             "maximal number of batches waiting between two stages")
+        ("verify", po::bool_switch(&args.verify), "decode the packages and compare them with the original chips")
+        ("output", po::value<std::string>(&args.output)->default_value(""), "output JSON file");
+
+    try {
+        po::variables_map vm;
+        po::store(po::parse_command_line(argc, argv, desc), vm);
+        if(vm.count("help")) {
+            std::cout << desc << std::endl;
+            return 0;
+        }
+        po::notify(vm);
+        ProcessHitFile process(args);
+        process.Run();
+    } catch(std::exception& e) {
+        std::cerr << "ERROR: " << e.what() << std::endl;
+        return 1;
+    }
+    return 0;
+}
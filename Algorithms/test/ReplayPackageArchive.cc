@@ -0,0 +1,187 @@
+/*! Replays an archive of encoded packages into the readout link model and, optionally, into the decoders.
+The archive is produced by TestChipDataEncoder with the packageArchive parameter, so different readout link models can
+be studied without re-running the framework and the encoding.
+This file is part of https://github.com/kandrosov/OnChipDataCompression. */
+
+#include <fstream>
+#include <set>
+#include <boost/program_options.hpp>
+#include "OnChipDataCompression/Algorithms/interface/ChipDataEncoder.h"
+#include "OnChipDataCompression/Algorithms/interface/PackageArchive.h"
+#include "OnChipDataCompression/Algorithms/interface/QuantileSketch.h"
+#include "OnChipDataCompression/Algorithms/interface/ReadoutLinkModel.h"
+#include "OnChipDataCompression/Algorithms/test/BenchmarkTools.h"
+
+namespace pixel_studies {
+namespace benchmark {
+
+struct Arguments {
+    std::string input, dictionaries, output;
+    std::vector<std::string> formats;
+    std::vector<uint32_t> runs;
+    std::vector<uint64_t> events;
+    std::vector<uint32_t> modules;
+    std::vector<size_t> link_bits;
+    bool decode;
+};
+
+class ReplayPackageArchive {
+public:
+    explicit ReplayPackageArchive(const Arguments& _args) :
+        args(_args), archive(args.input), results("ReplayPackageArchive"), chip_layout(400, 400, 1, 4),
+        readout_unit_layout(2, 2), runs(args.runs.begin(), args.runs.end()),
+        events(args.events.begin(), args.events.end()),
+        modules(args.modules.begin(), args.modules.end())
+    {
+        for(size_t link_bits : args.link_bits) {
+            if(!link_bits)
+                throw exception("Number of bits per readout cycle should be a positive number.");
+        }
+    }
+
+    void Run()
+    {
+        const std::vector<std::string>& formats = args.formats.empty() ? archive.GetFormats() : args.formats;
+        for(const std::string& format : formats) {
+            if(archive.GetFormatId(format) == PackageArchiveReader::NotFound)
+                throw exception("Format '%1%' is not present in the archive '%2%'.") % format % args.input;
+            const std::vector<size_t> entries = SelectEntries(format);
+            for(size_t link_bits : args.link_bits)
+                ReplayLink(format, entries, link_bits);
+            if(args.decode)
+                ReplayDecoding(format, entries);
+        }
+
+        if(!args.output.empty()) {
+            std::ofstream f(args.output);
+            f.exceptions(std::ofstream::badbit | std::ofstream::failbit);
+            results.WriteJson(f);
+        }
+    }
+
+private:
+    std::vector<size_t> SelectEntries(const std::string& format) const
+    {
+        std::vector<size_t> selected;
+        for(size_t entry_id : archive.SelectEntries(format)) {
+            const PackageArchiveEntry& entry = archive.GetEntry(entry_id);
+            if((runs.empty() || runs.count(entry.run_id)) && (events.empty() || events.count(entry.event_id))
+                    && (modules.empty() || modules.count(entry.module_id)))
+                selected.push_back(entry_id);
+        }
+        return selected;
+    }
+
+    void ReplayLink(const std::string& format, const std::vector<size_t>& entries, size_t link_bits)
+    {
+        const ReadoutLinkModel link_model(link_bits);
+        QuantileSketch bits_per_chip, n_clc, max_queue_size;
+        const auto start = Clock::now();
+        for(size_t entry_id : entries) {
+            const PackageView package = archive.GetPackage(entry_id);
+            const ReadoutLinkStatistics link_stat = link_model.Simulate(
+                        package.readout_positions, package.readout_positions + package.n_readout_positions);
+            bits_per_chip.Add(package.size());
+            n_clc.Add(link_stat.n_clc);
+            max_queue_size.Add(link_stat.max_queue_size);
+        }
+
+        Result result;
+        result.name = "link";
+        result.parameters = { { "format", format }, { "link_bits", ToString(link_bits) } };
+        result.units = "chips";
+        result.n_iterations = 1;
+        result.time = SecondsSince(start);
+        result.n_items = entries.size();
+        if(entries.size()) {
+            result.extra_values["bits_per_chip_mean"] = bits_per_chip.GetMean();
+            result.extra_values["bits_per_chip_max"] = bits_per_chip.GetMax();
+            result.extra_values["n_clc_mean"] = n_clc.GetMean();
+            result.extra_values["n_clc_p99"] = n_clc.UpperBound(0.99);
+            result.extra_values["n_clc_max"] = n_clc.GetMax();
+            result.extra_values["max_queue_p99"] = max_queue_size.UpperBound(0.99);
+            result.extra_values["max_queue_max"] = max_queue_size.GetMax();
+        }
+        results.Add(result);
+    }
+
+    void ReplayDecoding(const std::string& format, const std::vector<size_t>& entries)
+    {
+        const ChipDataEncoder encoder(ParseEncoderFormat(format), chip_layout, readout_unit_layout, max_adc,
+                                      Ordering::ByRegionByColumn, args.dictionaries);
+        size_t n_hits = 0;
+        const auto start = Clock::now();
+        for(size_t entry_id : entries) {
+            const Package package = archive.GetPackage(entry_id).ToPackage();
+            n_hits += encoder.Decode(package).GetPixels().size();
+        }
+
+        Result result;
+        result.name = "decode";
+        result.parameters = { { "format", format } };
+        result.units = "chips";
+        result.n_iterations = 1;
+        result.time = SecondsSince(start);
+        result.n_items = entries.size();
+        result.extra_values["hits_per_chip_mean"] = entries.size() ? double(n_hits) / entries.size() : 0;
+        results.Add(result);
+    }
+
+private:
+    static constexpr size_t max_adc = 15;
+
+    const Arguments args;
+    const PackageArchiveReader archive;
+    ResultCollection results;
+    const MultiRegionLayout chip_layout;
+    const RegionLayout readout_unit_layout;
+    const std::set<uint32_t> runs;
+    const std::set<uint64_t> events;
+    const std::set<uint32_t> modules;
+};
+
+} // namespace benchmark
+} // namespace pixel_studies
+
+int main(int argc, char* argv[])
+{
+    namespace po = boost::program_options;
+    using namespace pixel_studies::benchmark;
+
+    Arguments args;
+    po::options_description desc("Replay of the encoded packages stored in an archive");
+    desc.add_options()
+        ("help", "print help message")
+        ("input", po::value<std::string>(&args.input)->required(), "input package archive")
+        ("formats", po::value<std::vector<std::string>>(&args.formats)->multitoken(),
+             "encoder formats to replay; if not specified, all formats in the archive are replayed")
+        ("runs", po::value<std::vector<uint32_t>>(&args.runs)->multitoken(),
+             "replay only the given runs")
+        ("events", po::value<std::vector<uint64_t>>(&args.events)->multitoken(),
+             "replay only the given events")
+        ("modules", po::value<std::vector<uint32_t>>(&args.modules)->multitoken(),
+             "replay only the given modules")
+        ("link-bits", po::value<std::vector<size_t>>(&args.link_bits)->multitoken()
+             ->default_value({ pixel_studies::ReadoutLinkModel::DefaultBitsPerClc }, "64"),
+             "number of bits sent by the readout link per clock cycle")
+        ("decode", po::bool_switch(&args.decode), "decode the packages")
+        ("dictionaries", po::value<std::string>(&args.dictionaries)->default_value(""),
+             "input file with dictionaries, required to decode the compressed formats")
+        ("output", po::value<std::string>(&args.output)->default_value(""), "output JSON file");
+
+    try {
+        po::variables_map vm;
+        po::store(po::parse_command_line(argc, argv, desc), vm);
+        if(vm.count("help")) {
+            std::cout << desc << std::endl;
+            return 0;
+        }
+        po::notify(vm);
+        ReplayPackageArchive replay(args);
+        replay.Run();
+    } catch(std::exception& e) {
+        std::cerr << "ERROR: " << e.what() << std::endl;
+        return 1;
+    }
+    return 0;
+}
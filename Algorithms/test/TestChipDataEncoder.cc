@@ -1,12 +1,15 @@
 /*! Test for ChipDataEncoder class.
+The module is a global analyzer: the encoders are immutable and shared between the streams, while each stream fills
+its own histogram shard. The shards are merged at the end of the job. If the packageArchive parameter is set, all
+encoded packages are stored in the archive to be replayed by ReplayPackageArchive without re-encoding.
+Only the pixels of the first chip of chip_layout in each module are encoded, so all packages are archived with chip
+id 0.
 This file is part of https://github.com/kandrosov/OnChipDataCompression. */
 
 #include <iostream>
-#include <mutex>
-#include <condition_variable>
 #include <TH1.h>
 #include <TFile.h>
-#include "FWCore/Framework/interface/EDAnalyzer.h"
+#include "FWCore/Framework/interface/global/EDAnalyzer.h"
 #include "FWCore/Framework/interface/Event.h"
 #include "FWCore/ParameterSet/interface/ParameterSet.h"
 #include "FWCore/ServiceRegistry/interface/Service.h"
@@ -18,47 +21,70 @@ This file is part of https://github.com/kandrosov/OnChipDataCompression. */
 
 #include "CommonTools/UtilAlgos/interface/TFileService.h"
 #include "OnChipDataCompression/Algorithms/interface/ChipDataEncoder.h"
+#include "OnChipDataCompression/Algorithms/interface/Instrumentation.h"
+#include "OnChipDataCompression/Algorithms/interface/PackageArchive.h"
+#include "OnChipDataCompression/Algorithms/interface/ReadoutLinkModel.h"
+#include "OnChipDataCompression/Algorithms/test/HistogramShards.h"
 
-class TestChipDataEncoder : public edm::EDAnalyzer {
+struct TestChipDataEncoderStreamData {
+    pixel_studies::HistogramShards::Shard* histograms;
+};
+
+class TestChipDataEncoder : public edm::global::EDAnalyzer<edm::StreamCache<TestChipDataEncoderStreamData>> {
 public:
+    using StreamData = TestChipDataEncoderStreamData;
     using Encoder = pixel_studies::ChipDataEncoder;
     using EncoderPtr = std::shared_ptr<Encoder>;
-    using EncoderMap = std::map<std::string, EncoderPtr>;
     using EncoderFormat = pixel_studies::EncoderFormat;
     using Hist = TH1D;
     using HistPtr = std::shared_ptr<TH1D>;
     using HistMap = std::map<std::string, HistPtr>;
+    using HistHandle = pixel_studies::HistogramShards::Handle;
     using PixelDigiCollection = edm::DetSetVector<PixelDigi>;
     using Package = pixel_studies::Package;
 
+    struct EncoderDescriptor {
+        std::string name;
+        EncoderPtr encoder;
+        HistHandle bits_per_chip, bits_per_item, n_readout_clc, n_readout_active_clc, n_readout_inactive_clc,
+                   max_readout_queue, adc;
+        std::vector<HistHandle> bits_per_chip_by_field;
+    };
+
     TestChipDataEncoder(const edm::ParameterSet& cfg) :
         dictionaries_file(cfg.getParameter<std::string>("dictionaries")),
         pixelDigis_token(consumes<PixelDigiCollection>(cfg.getParameter<edm::InputTag>("pixelDigis"))),
         chip_layout(400, 400, 1, 4), readout_unit_layout(2, 2)
     {
         using namespace pixel_studies;
-        encoders["SinglePixel"] = std::make_shared<Encoder>(EncoderFormat::SinglePixel, chip_layout,
-                                                            readout_unit_layout, 15);
-        encoders["Region"] = std::make_shared<Encoder>(EncoderFormat::Region, chip_layout, readout_unit_layout, 15);
-        encoders["RegionWithCompressedAdc"] = std::make_shared<Encoder>(
+        const std::string archive_file = cfg.getUntrackedParameter<std::string>("packageArchive", "");
+        if(archive_file.size())
+            package_archive.reset(new PackageArchiveWriter(archive_file));
+        AddEncoder("Delta", std::make_shared<Encoder>(EncoderFormat::Delta, chip_layout, readout_unit_layout, 15,
+                                                      Ordering::ByRegionByColumn, dictionaries_file));
+        AddEncoder("DeltaWithSubStreams", std::make_shared<Encoder>(
+                    EncoderFormat::DeltaWithSubStreams, chip_layout, readout_unit_layout, 15,
+                    Ordering::ByRegionByColumn, dictionaries_file));
+        AddEncoder("Region", std::make_shared<Encoder>(EncoderFormat::Region, chip_layout, readout_unit_layout, 15));
+        AddEncoder("RegionWithCompressedAdc", std::make_shared<Encoder>(
                     EncoderFormat::RegionWithCompressedAdc, chip_layout, readout_unit_layout, 15,
-                    Ordering::ByRegionByColumn, dictionaries_file);
-        encoders["Delta"] = std::make_shared<Encoder>(EncoderFormat::Delta, chip_layout, readout_unit_layout, 15,
-                                                      Ordering::ByRegionByColumn, dictionaries_file);
-        for(const auto& encoder_entry : encoders) {
-            CreateCommonHist("BitsPerChip_" + encoder_entry.first, 12800);
-            CreateCommonHist("BitsPerItem_" + encoder_entry.first, 1280);
-            CreateCommonHist("N_readoutClc_" + encoder_entry.first, 1000);
-            CreateCommonHist("N_readoutActiveClc_" + encoder_entry.first, 1000);
-            CreateCommonHist("N_readoutInactiveClc_" + encoder_entry.first, 1000);
-            CreateCommonHist("Max_readoutQueue_" + encoder_entry.first, 1000);
-            CreateCommonHist("ADC_" + encoder_entry.first, 16);
-        }
+                    Ordering::ByRegionByColumn, dictionaries_file));
+        AddEncoder("SinglePixel", std::make_shared<Encoder>(EncoderFormat::SinglePixel, chip_layout,
+                                                            readout_unit_layout, 15));
     }
 
-    virtual void analyze(const edm::Event& event, const edm::EventSetup& /*setup*/) override
+    virtual std::unique_ptr<StreamData> beginStream(edm::StreamID /*stream_id*/) const override
+    {
+        std::unique_ptr<StreamData> stream_data(new StreamData());
+        stream_data->histograms = &histogram_shards.CreateShard();
+        return stream_data;
+    }
+
+    virtual void analyze(edm::StreamID stream_id, const edm::Event& event,
+                         const edm::EventSetup& /*setup*/) const override
     {
         using namespace pixel_studies;
+        HistogramShards::Shard& histograms = *streamCache(stream_id)->histograms;
         edm::Handle<PixelDigiCollection> pixelDigis;
         event.getByToken(pixelDigis_token, pixelDigis);
         for(const auto& detector : *pixelDigis) {
@@ -81,36 +107,36 @@ public:
             } else {
                 throw std::runtime_error("Bad DetId");
                 }
-            
-            
-            Chip chip(chip_layout);
-            for(const PixelDigi& digi : detector) {
-                const Pixel pixel(digi.row(), digi.column());
-                const Adc adc(digi.adc() - 1);
-                if(chip_layout.IsPixelInside(pixel))
-                    chip.AddPixel(pixel, adc);
-                FillHistogram("Max_readoutQueue_" + maker_name, adc);
-            }
-            for(const auto& encoder_entry : encoders) {
-                const auto& package = encoder_entry.second->Encode(chip);
-                const Chip decoded_chip = encoder_entry.second->Decode(package);
+
+            const Chip chip = MakeChip(detector);
+            for(const EncoderDescriptor& descriptor : encoders) {
+                const auto& package = descriptor.encoder->Encode(chip);
+                const Chip decoded_chip = descriptor.encoder->Decode(package);
                 if(decoded_chip != chip) {
-                    std::cout << "Module id: " << detector.id << ". PackageMaker: " << encoder_entry.first << std::endl;
+                    std::cout << "Module id: " << detector.id << ". PackageMaker: " << descriptor.name << std::endl;
                     chip.HasSamePixels(decoded_chip, &std::cerr);
                     throw pixel_studies::exception("invalid encoding-decoding");
                 }
-                AnalyzePackage(encoder_entry.first, package);
+                AnalyzePackage(descriptor, package, histograms);
+                if(package_archive) {
+                    package_archive->WritePackage(descriptor.name, event.id().run(), event.id().luminosityBlock(),
+                                                  event.id().event(), detector.detId(), 0, package);
+                }
+                for(const auto& pixel_with_adc : decoded_chip.GetPixels())
+                    histograms.Fill(descriptor.adc, pixel_with_adc.second);
             }
         }
     }
 
-    virtual void endJob()
+    virtual void endJob() override
     {
+        if(package_archive)
+            package_archive->Close();
         static const std::vector<double> quantiles = { 0.01, 0.001, 0.0001 };
         static const size_t first_column_width = 50, q_column_width = 15;
         static const std::string h_sep = " | ";
         static const size_t v_sep_width = first_column_width + h_sep.size()
-                + quantiles.size() * (q_column_width + h_sep.size());
+                + (quantiles.size() + 1) * (q_column_width + h_sep.size());
         static const std::string v_sep(v_sep_width, '-');
 
         std::cout << v_sep << "\n" << std::left << std::setw(first_column_width) << "Histogram name" << h_sep;
@@ -120,86 +146,137 @@ public:
             ss << efficiency << "% events";
             std::cout << std::setw(q_column_width) << ss.str() << h_sep;
         }
-        std::cout << "\n" << v_sep << "\n";
+        std::cout << std::setw(q_column_width) << "max" << h_sep << "\n" << v_sep << "\n";
+        MergeHistogramShards();
         auto& file = edm::Service<TFileService>()->file();
         for(const auto& hist_entry : histograms) {
             std::cout << std::left << std::setw(first_column_width) << hist_entry.first << h_sep;
+            const pixel_studies::QuantileSketch sketch = histogram_shards.GetSketch(hist_handles.at(hist_entry.first));
             for(size_t n = 0; n < quantiles.size(); ++n) {
-                const double upper_limit = GetUpperLimit(hist_entry.first, quantiles.at(n));
+                const double upper_limit = sketch.GetCount() ? sketch.UpperBound(1. - quantiles.at(n)) : 0;
                 std::ostringstream ss;
                 ss << "< " << upper_limit;
                 std::cout << std::setw(q_column_width) << ss.str() << h_sep;
             }
-            std::cout << "\n";
+            std::cout << std::setw(q_column_width) << (sketch.GetCount() ? sketch.GetMax() : 0) << h_sep << "\n";
 
             file.WriteTObject(hist_entry.second.get(), hist_entry.first.c_str());
         }
         std::cout << v_sep << std::endl;
+
+        if(pixel_studies::instrumentation::IsEnabled())
+            pixel_studies::instrumentation::Registry::Instance().WriteSummary(std::cout, true);
     }
 
 private:
-    void CreateCommonHist(const std::string& name, size_t n_bins)
+    pixel_studies::Chip MakeChip(const edm::DetSet<PixelDigi>& detector) const
+    {
+        using namespace pixel_studies;
+        PIXEL_STUDIES_SCOPED_TIMER(ChipConstruction);
+        Chip chip(chip_layout);
+        for(const PixelDigi& digi : detector) {
+            const Pixel pixel(digi.row(), digi.column());
+            const Adc adc(digi.adc() - 1);
+            if(chip_layout.IsPixelInside(pixel))
+                chip.AddPixel(pixel, adc);
+        }
+        PIXEL_STUDIES_COUNT(ChipConstruction, Chips, 1);
+        PIXEL_STUDIES_COUNT(ChipConstruction, Hits, chip.GetPixels().size());
+        return chip;
+    }
+
+    static const std::vector<pixel_studies::FieldCategory>& FieldCategories()
+    {
+        using pixel_studies::FieldCategory;
+        static const std::vector<FieldCategory> categories = {
+            FieldCategory::Address, FieldCategory::RegionId, FieldCategory::Adc, FieldCategory::Escape,
+            FieldCategory::RawFallback, FieldCategory::Trailer, FieldCategory::Index
+        };
+        return categories;
+    }
+
+    static std::string FieldHistName(const std::string& maker_name, pixel_studies::FieldCategory category)
+    {
+        return "BitsPerChip_" + maker_name + "_" + pixel_studies::FieldCategoryName(category);
+    }
+
+    void AddEncoder(const std::string& name, const EncoderPtr& encoder)
+    {
+        EncoderDescriptor descriptor;
+        descriptor.name = name;
+        descriptor.encoder = encoder;
+        descriptor.bits_per_chip = CreateCommonHist("BitsPerChip_" + name, 12800);
+        descriptor.bits_per_item = CreateCommonHist("BitsPerItem_" + name, 1280);
+        descriptor.n_readout_clc = CreateCommonHist("N_readoutClc_" + name, 1000);
+        descriptor.n_readout_active_clc = CreateCommonHist("N_readoutActiveClc_" + name, 1000);
+        descriptor.n_readout_inactive_clc = CreateCommonHist("N_readoutInactiveClc_" + name, 1000);
+        descriptor.max_readout_queue = CreateCommonHist("Max_readoutQueue_" + name, 1000);
+        descriptor.adc = CreateCommonHist("ADC_" + name, 16);
+        for(pixel_studies::FieldCategory category : FieldCategories())
+            descriptor.bits_per_chip_by_field.push_back(CreateCommonHist(FieldHistName(name, category), 12800));
+        encoders.push_back(descriptor);
+    }
+
+    HistHandle CreateCommonHist(const std::string& name, size_t n_bins)
     {
         histograms[name] = std::make_shared<Hist>(name.c_str(), name.c_str(), n_bins, -0.5, n_bins - 0.5);
+        hist_handles[name] = histogram_shards.Add(name, n_bins, -0.5, n_bins - 0.5);
+        return hist_handles[name];
     }
 
-    void FillHistogram(const std::string& name, double value)
+    void MergeHistogramShards()
     {
-        std::unique_lock<std::mutex> lock(mutex);
-        histograms.at(name)->Fill(value);
+        for(HistHandle handle = 0; handle < histogram_shards.size(); ++handle) {
+            const auto& def = histogram_shards.GetDefinition(handle);
+            const auto& hist = histograms.at(def.name);
+            const auto contents = histogram_shards.GetBinContents(handle);
+            // Filling with weights would enable Sumw2, so the contents are set directly to keep the bin errors
+            // sqrt(n) as for the serial fill.
+            double n_entries = 0;
+            for(size_t bin = 0; bin < contents.size(); ++bin) {
+                hist->SetBinContent(bin, contents.at(bin));
+                n_entries += contents.at(bin);
+            }
+            // All filled values are integers, so the bin centers reproduce the histogram statistics exactly.
+            hist->ResetStats();
+            hist->SetEntries(n_entries);
+        }
     }
 
-    void AnalyzePackage(const std::string& maker_name, const Package& package)
+    static void AnalyzePackage(const EncoderDescriptor& descriptor, const Package& package,
+                               pixel_studies::HistogramShards::Shard& histograms)
     {
         using PositionCollection = Package::PositionCollection;
-        static const size_t out_size = 64;
+        static const pixel_studies::ReadoutLinkModel link_model;
 
-        FillHistogram("BitsPerChip_" + maker_name, package.size());
+        histograms.Fill(descriptor.bits_per_chip, package.size());
+        for(size_t n = 0; n < FieldCategories().size(); ++n)
+            histograms.Fill(descriptor.bits_per_chip_by_field.at(n), package.field_size(FieldCategories()[n]));
         const PositionCollection& queue = package.readout_positions();
-        size_t n_clc = 0, n_active_clc = 0, out_queue_pos = 0, prev_pos = 0, max_out_queue_pos = 0;
+        size_t prev_pos = 0;
         for(size_t pos : queue) {
-            const size_t item_size = pos - prev_pos;
-            FillHistogram("BitsPerItem_" + maker_name, item_size);
-            out_queue_pos += item_size;
-            max_out_queue_pos = std::max(out_queue_pos, max_out_queue_pos);
+            histograms.Fill(descriptor.bits_per_item, pos - prev_pos);
             prev_pos = pos;
-            if(out_queue_pos >= out_size) {
-                out_queue_pos -= out_size;
-                ++n_active_clc;
-            }
-            ++n_clc;
         }
-        while(out_queue_pos) {
-            out_queue_pos -= std::min(out_queue_pos, out_size);
-            ++n_clc; ++n_active_clc;
-        }
-        FillHistogram("N_readoutClc_" + maker_name, n_clc);
-        FillHistogram("N_readoutActiveClc_" + maker_name, n_active_clc);
-        FillHistogram("N_readoutInactiveClc_" + maker_name, n_clc - n_active_clc);
-        FillHistogram("Max_readoutQueue_" + maker_name, max_out_queue_pos);
-    }
-
-    double GetUpperLimit(const std::string& name, double quantile) const
-    {
-        const auto& hist = histograms.at(name);
-        const int last_bin = hist->GetNbinsX() + 1;
-        const double full_integral = hist->Integral(0, last_bin);
-        const double q_integral = quantile * full_integral;
-        int q_bin = last_bin;
-        while(hist->Integral(q_bin, last_bin) < q_integral)
-            --q_bin;
-        return hist->GetBinLowEdge(q_bin);
+        const pixel_studies::ReadoutLinkStatistics link_stat = link_model.Simulate(queue.begin(), queue.end());
+        histograms.Fill(descriptor.n_readout_clc, link_stat.n_clc);
+        histograms.Fill(descriptor.n_readout_active_clc, link_stat.n_active_clc);
+        histograms.Fill(descriptor.n_readout_inactive_clc, link_stat.n_inactive_clc());
+        histograms.Fill(descriptor.max_readout_queue, link_stat.max_queue_size);
     }
 
 private:
-    std::mutex mutex;
     std::string dictionaries_file;
     edm::EDGetTokenT<PixelDigiCollection> pixelDigis_token;
     pixel_studies::MultiRegionLayout chip_layout;
     pixel_studies::RegionLayout readout_unit_layout;
 
-    EncoderMap encoders;
+    std::vector<EncoderDescriptor> encoders;
     HistMap histograms;
+    std::map<std::string, HistHandle> hist_handles;
+    // Shards are created in the const beginStream, the creation is synchronised inside HistogramShards.
+    mutable pixel_studies::HistogramShards histogram_shards;
+    std::unique_ptr<pixel_studies::PackageArchiveWriter> package_archive;
 };
 
 #include "FWCore/Framework/interface/MakerMacros.h"
@@ -9,6 +9,8 @@ from FWCore.ParameterSet.VarParsing import VarParsing
 options = VarParsing('analysis')
 options.register('dictionaries', 'dictionaries.txt', VarParsing.multiplicity.singleton, VarParsing.varType.string,
                  "Input file with dictionaries.")
+options.register('packageArchive', '', VarParsing.multiplicity.singleton, VarParsing.varType.string,
+                 "Output archive with the encoded packages. If empty, packages are not stored.")
 
 options.parseArguments()
 
@@ -24,6 +26,7 @@ process.maxEvents = cms.untracked.PSet( input = cms.untracked.int32(options.maxE
 
 process.testChipDataEncoder = cms.EDAnalyzer('TestChipDataEncoder',
     dictionaries = cms.string(options.dictionaries),
+    packageArchive = cms.untracked.string(options.packageArchive),
     pixelDigis = cms.InputTag('simSiPixelDigis', 'Pixel', 'HLT')
 )
 process.p = cms.Path(process.testChipDataEncoder)
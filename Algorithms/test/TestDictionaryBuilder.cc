@@ -1,8 +1,13 @@
 /*! Test for DictionaryBuilder class.
+Each stream fills its own DictionaryBuilder. The letter frequencies of all streams are merged at the end of the stream,
+so the saved dictionaries do not depend on the number of streams. If the snapshots are enabled, all streams fill the
+shared builder instead, so the convergence is checked on the frequencies of all streams together. With
+stopWhenConverged, the set of chips that enter the dictionaries depends on the order in which the streams process the
+events, so the dictionaries are not reproducible between the jobs.
 This file is part of https://github.com/kandrosov/OnChipDataCompression. */
 
 #include <iostream>
-#include "FWCore/Framework/interface/EDAnalyzer.h"
+#include "FWCore/Framework/interface/global/EDAnalyzer.h"
 #include "FWCore/ParameterSet/interface/ParameterSet.h"
 #include "FWCore/Framework/interface/Event.h"
 #include "DataFormats/Common/interface/DetSetVector.h"
@@ -11,24 +16,41 @@ This file is part of https://github.com/kandrosov/OnChipDataCompression. */
 #include "DataFormats/SiPixelDetId/interface/PXBDetId.h"
 #include "DataFormats/SiPixelDetId/interface/PXFDetId.h"
 #include "OnChipDataCompression/Algorithms/interface/DictionaryBuilder.h"
+#include "OnChipDataCompression/Algorithms/interface/Instrumentation.h"
 
-class TestDictionaryBuilder : public edm::EDAnalyzer {
+struct TestDictionaryBuilderStreamData {
+    std::unique_ptr<pixel_studies::DictionaryBuilder> builder;
+};
+
+class TestDictionaryBuilder : public edm::global::EDAnalyzer<edm::StreamCache<TestDictionaryBuilderStreamData>> {
 public:
     using Builder = pixel_studies::DictionaryBuilder;
     using BuilderPtr = std::shared_ptr<Builder>;
     using PixelDigiCollection = edm::DetSetVector<PixelDigi>;
+    using StreamData = TestDictionaryBuilderStreamData;
 
     TestDictionaryBuilder(const edm::ParameterSet& cfg) :
         outputFile(cfg.getParameter<std::string>("outputFile")),
         pixelDigis_token(consumes<PixelDigiCollection>(cfg.getParameter<edm::InputTag>("pixelDigis"))),
         chip_layout(400, 400, 1, 4), readout_unit_layout(2, 2),
-        builder(chip_layout, pixel_studies::Ordering::ByRegionByColumn, readout_unit_layout, 15, 32)
+        convergence(CreateConvergenceConfig(cfg)), builder(CreateBuilder())
     {
     }
 
-    virtual void analyze(const edm::Event& event, const edm::EventSetup& /*setup*/) override
+    virtual std::unique_ptr<StreamData> beginStream(edm::StreamID /*stream_id*/) const override
+    {
+        std::unique_ptr<StreamData> stream_data(new StreamData());
+        if(!convergence.chips_per_snapshot)
+            stream_data->builder = CreateBuilder();
+        return stream_data;
+    }
+
+    virtual void analyze(edm::StreamID stream_id, const edm::Event& event,
+                         const edm::EventSetup& /*setup*/) const override
     {
         using namespace pixel_studies;
+        Builder& target_builder = GetBuilder(stream_id);
+        if(convergence.stop_when_converged && target_builder.IsConverged()) return;
         edm::Handle<PixelDigiCollection> pixelDigis;
         event.getByToken(pixelDigis_token, pixelDigis);
         for(const auto& detector : *pixelDigis) {
@@ -51,28 +73,76 @@ public:
             }
 
             if(partId != 0 || layerId != 1) continue;
-            Chip chip(chip_layout);
-            for(const PixelDigi& digi : detector) {
-                const Pixel pixel(digi.row(), digi.column());
-                const Adc adc(digi.adc() - 1);
-                if(chip_layout.IsPixelInside(pixel))
-                    chip.AddPixel(pixel, adc);
-            }
-            builder.AddChip(chip);
+            target_builder.AddChip(MakeChip(detector));
         }
     }
 
-    virtual void endJob()
+    virtual void endStream(edm::StreamID stream_id) const override
     {
-        builder.SaveDictionaries(outputFile);
+        const StreamData& stream_data = *streamCache(stream_id);
+        if(stream_data.builder)
+            builder->Merge(*stream_data.builder);
+    }
+
+    virtual void endJob() override
+    {
+        if(convergence.chips_per_snapshot) {
+            std::cout << "Dictionary snapshots:\n";
+            builder->WriteSnapshots(std::cout);
+        }
+        builder->SaveDictionaries(outputFile);
+
+        if(pixel_studies::instrumentation::IsEnabled())
+            pixel_studies::instrumentation::Registry::Instance().WriteSummary(std::cout, true);
     }
 
 private:
+    static pixel_studies::DictionaryConvergenceConfig CreateConvergenceConfig(const edm::ParameterSet& cfg)
+    {
+        pixel_studies::DictionaryConvergenceConfig config;
+        config.chips_per_snapshot = cfg.getParameter<unsigned>("chipsPerSnapshot");
+        config.tolerance = cfg.getParameter<double>("convergenceTolerance");
+        config.n_stable_snapshots = cfg.getParameter<unsigned>("stableSnapshots");
+        config.stop_when_converged = cfg.getParameter<bool>("stopWhenConverged");
+        return config;
+    }
+
+    std::unique_ptr<Builder> CreateBuilder() const
+    {
+        return std::unique_ptr<Builder>(new Builder(chip_layout, pixel_studies::Ordering::ByRegionByColumn,
+                                                    readout_unit_layout, 15, 32, convergence));
+    }
+
+    Builder& GetBuilder(edm::StreamID stream_id) const
+    {
+        const StreamData& stream_data = *streamCache(stream_id);
+        return stream_data.builder ? *stream_data.builder : *builder;
+    }
+
+    pixel_studies::Chip MakeChip(const edm::DetSet<PixelDigi>& detector) const
+    {
+        using namespace pixel_studies;
+        PIXEL_STUDIES_SCOPED_TIMER(ChipConstruction);
+        Chip chip(chip_layout);
+        for(const PixelDigi& digi : detector) {
+            const Pixel pixel(digi.row(), digi.column());
+            const Adc adc(digi.adc() - 1);
+            if(chip_layout.IsPixelInside(pixel))
+                chip.AddPixel(pixel, adc);
+        }
+        PIXEL_STUDIES_COUNT(ChipConstruction, Chips, 1);
+        PIXEL_STUDIES_COUNT(ChipConstruction, Hits, chip.GetPixels().size());
+        return chip;
+    }
+
     std::string outputFile;
     edm::EDGetTokenT<PixelDigiCollection> pixelDigis_token;
     pixel_studies::MultiRegionLayout chip_layout;
     pixel_studies::RegionLayout readout_unit_layout;
-    Builder builder;
+    pixel_studies::DictionaryConvergenceConfig convergence;
+    // Receives the counts of each stream in the const endStream or, with the snapshots, the chips of all streams in the
+    // const analyze. Both are synchronised inside the builder.
+    std::unique_ptr<Builder> builder;
 };
 
 #include "FWCore/Framework/interface/MakerMacros.h"
@@ -9,6 +9,15 @@ from FWCore.ParameterSet.VarParsing import VarParsing
 options = VarParsing('analysis')
 options.register('dictionaries', 'dictionaries.txt', VarParsing.multiplicity.singleton, VarParsing.varType.string,
                  "Output file with dictionaries.")
+options.register('chipsPerSnapshot', 0, VarParsing.multiplicity.singleton, VarParsing.varType.int,
+                 "Number of chips of all streams between two snapshots of the letter frequencies (0 - no snapshots).")
+options.register('convergenceTolerance', 1e-4, VarParsing.multiplicity.singleton, VarParsing.varType.float,
+                 "Maximal KL divergence and code length change in bits per letter between two stable snapshots.")
+options.register('stableSnapshots', 3, VarParsing.multiplicity.singleton, VarParsing.varType.int,
+                 "Number of consecutive stable snapshots required for the convergence.")
+options.register('stopWhenConverged', False, VarParsing.multiplicity.singleton, VarParsing.varType.bool,
+                 "Skip the events after the dictionaries are converged. The dictionaries then depend on the order in which"
+                 " the streams process the events and are not reproducible between the jobs.")
 
 options.parseArguments()
 
@@ -23,6 +32,10 @@ process.maxEvents = cms.untracked.PSet( input = cms.untracked.int32(options.maxE
 
 process.testDictionaryBuilder = cms.EDAnalyzer('TestDictionaryBuilder',
     outputFile = cms.string(options.dictionaries),
+    chipsPerSnapshot = cms.uint32(options.chipsPerSnapshot),
+    convergenceTolerance = cms.double(options.convergenceTolerance),
+    stableSnapshots = cms.uint32(options.stableSnapshots),
+    stopWhenConverged = cms.bool(options.stopWhenConverged),
     pixelDigis = cms.InputTag('simSiPixelDigis', 'Pixel', 'HLT')
 )
 process.p = cms.Path(process.testDictionaryBuilder)